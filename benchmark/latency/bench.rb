@@ -0,0 +1,160 @@
+#!/usr/bin/env ruby
+# frozen_string_literal: true
+
+require "bundler/setup"
+require "json"
+require "optparse"
+require "rbconfig"
+require "time"
+require "mini_racer"
+
+# Per-call latency distribution for tiny calls, where the Ruby <-> V8 thread
+# handoff dominates. Each case runs the same calls against contexts that
+# differ only in how they wait for each other.
+
+CONFIGS = {
+  "mutex" => {},
+  "mutex_spin" => {
+    spin: 50
+  },
+  "ring" => {
+    transport: :ring
+  },
+  "ring_spin" => {
+    transport: :ring,
+    spin: 50
+  }
+}.freeze
+
+options = {
+  iterations: Integer(ENV.fetch("BENCH_ITERATIONS", "20000")),
+  warmup: Integer(ENV.fetch("BENCH_WARMUP", "1000")),
+  rounds: Integer(ENV.fetch("BENCH_ROUNDS", "1")),
+  only: nil,
+  json: false,
+  single_threaded: ENV["BENCH_SINGLE_THREADED"] == "1"
+}
+
+OptionParser
+  .new do |parser|
+    parser.banner = "Usage: bundle exec ruby benchmark/latency/bench.rb [options]"
+
+    parser.on(
+      "--only REGEX",
+      "Run only benchmark names matching REGEX"
+    ) { |value| options[:only] = Regexp.new(value) }
+
+    parser.on(
+      "--iterations COUNT",
+      Integer,
+      "Timed calls per case; default: BENCH_ITERATIONS or 20000"
+    ) { |value| options[:iterations] = value }
+
+    parser.on(
+      "--warmup COUNT",
+      Integer,
+      "Untimed calls per case; default: BENCH_WARMUP or 1000"
+    ) { |value| options[:warmup] = value }
+
+    parser.on(
+      "--rounds COUNT",
+      Integer,
+      "Repeat the timed calls COUNT times; default: BENCH_ROUNDS or 1"
+    ) { |value| options[:rounds] = value }
+
+    parser.on("--json", "Print JSON instead of human-readable output") do
+      options[:json] = true
+    end
+
+    parser.on(
+      "--single-threaded",
+      "Run V8 on MiniRacer's single-threaded platform"
+    ) { options[:single_threaded] = true }
+  end
+  .parse!
+
+abort "--iterations must be positive" if options[:iterations] < 1
+abort "--rounds must be positive" if options[:rounds] < 1
+
+MiniRacer::Platform.set_flags!(:single_threaded) if options[:single_threaded]
+
+CALLS = {
+  "call_noop" => ->(ctx) { ctx.call("noop") },
+  "eval_int" => ->(ctx) { ctx.eval("1") },
+  "callback_echo" => ->(ctx) { ctx.call("echo", 1) }
+}.freeze
+
+def percentile(sorted, pct)
+  sorted[((sorted.length - 1) * pct / 100.0).round]
+end
+
+results = []
+CONFIGS.each do |config_name, config|
+  CALLS.each do |call_name, call|
+    name = "#{call_name}/#{config_name}"
+    next if options[:only] && !name.match?(options[:only])
+
+    ctx = MiniRacer::Context.new(**config)
+    ctx.attach("rb_echo", ->(v) { v })
+    ctx.eval("function noop() {} function echo(x) { return rb_echo(x) }")
+    options[:warmup].times { call.call(ctx) }
+
+    samples = []
+    GC.start
+    GC.disable
+    begin
+      (options[:rounds] * options[:iterations]).times do
+        t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+        call.call(ctx)
+        samples << Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond) -
+          t0
+      end
+    ensure
+      GC.enable
+    end
+    ctx.dispose
+
+    total_ns = samples.sum
+    samples.sort!
+    p50, p90, p99, p999 =
+      [50, 90, 99, 99.9].map { |pct| percentile(samples, pct) / 1000.0 }
+    results << {
+      name: name,
+      iterations: samples.length,
+      rounds: options[:rounds],
+      total_ms: total_ns / 1e6,
+      ms_per_iter: total_ns / 1e6 / samples.length,
+      p50_us: p50,
+      p90_us: p90,
+      p99_us: p99,
+      p999_us: p999
+    }
+  end
+end
+
+abort "No benchmarks matched" if results.empty?
+
+metadata = {
+  mini_racer_version: MiniRacer::VERSION,
+  ruby_version: RUBY_DESCRIPTION,
+  platform: RbConfig::CONFIG["platform"],
+  timestamp: Time.now.utc.iso8601,
+  iterations: options[:iterations],
+  warmup: options[:warmup],
+  rounds: options[:rounds],
+  single_threaded: options[:single_threaded]
+}
+
+if options[:json]
+  puts JSON.pretty_generate({ metadata: metadata, benchmarks: results })
+  exit
+end
+
+puts "mini_racer #{MiniRacer::VERSION}"
+puts "ruby       #{RUBY_DESCRIPTION}"
+puts "single     #{options[:single_threaded]}"
+puts
+results.each do |row|
+  puts "%-28s p50=%8.2fus p90=%8.2fus p99=%8.2fus p99.9=%8.2fus" %
+         row.values_at(:name, :p50_us, :p90_us, :p99_us, :p999_us)
+end
@@ -28,6 +28,12 @@ JOBS = [
     script: "benchmark/serde/bench.rb",
     args: ["--single-threaded"]
   ),
+  Job.new(
+    name: "latency/default",
+    tags: %w[all latency default],
+    script: "benchmark/latency/bench.rb",
+    args: []
+  ),
   Job.new(
     name: "transpile/default",
     tags: %w[all transpile realworld default],
@@ -195,7 +201,7 @@ def sync_benchmark_files!(target_dir)
     FileUtils.cp(src, File.join(benchmark_dir, name)) if File.exist?(src)
   end
 
-  %w[serde transpile].each do |name|
+  %w[serde latency transpile].each do |name|
     dst = File.join(benchmark_dir, name)
     FileUtils.rm_rf(dst)
     FileUtils.cp_r(File.join(ROOT, "benchmark", name), dst)
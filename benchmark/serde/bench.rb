@@ -36,6 +36,7 @@ class Suite
 
     selected_cases.each do |bench|
       samples = []
+      allocations = []
 
       @rounds.times do
         begin
@@ -46,9 +47,11 @@ class Suite
 
           @warmup.times { bench.block.call }
 
+          allocated = GC.stat(:total_allocated_objects)
           started_at = Process.clock_gettime(CLOCK)
           bench.iterations.times { bench.block.call }
           samples << (Process.clock_gettime(CLOCK) - started_at)
+          allocations << GC.stat(:total_allocated_objects) - allocated
         ensure
           GC.enable
         end
@@ -62,18 +65,21 @@ class Suite
         rounds: @rounds,
         total_ms: elapsed * 1000.0,
         ms_per_iter: elapsed * 1000.0 / bench.iterations,
+        # Ruby objects, taking the least noisy round
+        allocs_per_iter: allocations.min.fdiv(bench.iterations),
         samples_ms: sample_ms
       }
       results << result
 
       unless quiet
         output.puts(
-          "%-42s n=%-8d total=%10.3fms per=%10.6fms" %
+          "%-42s n=%-8d total=%10.3fms per=%10.6fms allocs=%10.1f" %
             [
               result[:name],
               result[:iterations],
               result[:total_ms],
-              result[:ms_per_iter]
+              result[:ms_per_iter],
+              result[:allocs_per_iter]
             ]
         )
       end
@@ -159,8 +165,9 @@ suite =
     rounds: options[:rounds]
   )
 ctx = MiniRacer::Context.new(timeout: 120_000)
+sym_ctx = MiniRacer::Context.new(timeout: 120_000, symbolize_keys: true)
 
-ctx.eval(<<~JS)
+helpers = <<~JS
   function noop() {
     return 1;
   }
@@ -173,6 +180,12 @@ ctx.eval(<<~JS)
     return a + b;
   }
 
+  var App = {
+    render(value) {
+      return value;
+    }
+  };
+
   function intArray(n) {
     const array = [];
     for (let i = 0; i < n; i++) array.push(i);
@@ -209,6 +222,27 @@ ctx.eval(<<~JS)
     return array;
   }
 
+  // ~1 MiB strings: one-byte or two-byte, pure ASCII or with a single
+  // non-ASCII character at the end, which V8 still serializes whole
+  const longStrings = {
+    ascii: "abcdefgh".repeat(1 << 17),
+    latin1: "abcdefgh".repeat(1 << 17) + "é",
+    latin1_dense: "éèêë".repeat(1 << 18),
+    two_byte_ascii: "abcdefgh".repeat(1 << 17) + "Ā",
+    cjk: "日本語テキスト".repeat(1 << 17),
+    emoji: "😀".repeat(1 << 18),
+  };
+
+  function longString(kind) {
+    return longStrings[kind];
+  }
+
+  function samples(n) {
+    const array = new Float64Array(n);
+    for (let i = 0; i < n; i++) array[i] = i + 0.5;
+    return array;
+  }
+
   function objectOfInts(n) {
     const object = {};
     for (let i = 0; i < n; i++) object["k" + i] = i;
@@ -234,6 +268,9 @@ ctx.eval(<<~JS)
   }
 JS
 
+ctx.eval(helpers)
+sym_ctx.eval(helpers)
+
 ctx.attach("rubyEcho", proc { |value| value })
 ctx.attach("rubyAdd", proc { |a, b| a + b })
 
@@ -242,6 +279,13 @@ ruby_floats_10k = Array.new(10_000) { |i| i + 0.5 }
 ruby_strings_10k = Array.new(10_000) { |i| "x#{i}" }
 ruby_utf8_strings_10k = Array.new(10_000) { |i| "Ā#{i}" }
 ruby_emoji_strings_10k = Array.new(10_000) { |i| "😀#{i}" }
+ruby_long_strings = {
+  "ascii" => "abcdefgh" * (1 << 17),
+  "latin1" => "àbcdéfgh" * (1 << 17),
+  "cyrillic" => "Добрый день" * (1 << 16),
+  "cjk" => "日本語テキスト" * (1 << 17)
+}
+ruby_samples_1m = MiniRacer::TypedArray.pack(:float64, Array.new(1_000_000) { |i| i + 0.5 })
 ruby_hash_1k = 1_000.times.each_with_object({}) { |i, h| h["k#{i}"] = i }
 ruby_array_of_hashes_1k =
   Array.new(1_000) { |i| { "id" => i, "name" => "x#{i}" } }
@@ -265,15 +309,41 @@ end
 suite.add("js_to_ruby/return_10k_utf8_emoji_strings", 50) do
   ctx.call("emojiStringArray", 10_000)
 end
+%w[ascii latin1 latin1_dense two_byte_ascii cjk emoji].each do |kind|
+  suite.add("js_to_ruby/return_1m_#{kind}_string", 100) do
+    ctx.call("longString", kind)
+  end
+end
+suite.add("js_to_ruby/return_1m_float64array", 20) do
+  ctx.call("samples", 1_000_000).to_a
+end
 suite.add("js_to_ruby/return_object_1k_ints", 200) do
   ctx.call("objectOfInts", 1_000)
 end
 suite.add("js_to_ruby/return_array_1k_objects", 100) do
   ctx.call("arrayOfObjects", 1_000)
 end
+suite.add("js_to_ruby/return_array_1k_objects_symbolized", 100) do
+  sym_ctx.call("arrayOfObjects", 1_000)
+end
 
 # Ruby -> JS serialization plus reply deserialization through Context#call.
 suite.add("ruby_to_js/call_no_args", 100_000) { ctx.call("noop") }
+suite.add("ruby_to_js/call_path", 100_000) { ctx.call("App.render", 1) }
+
+# Same calls through prepared handles, which skip the name lookup.
+noop_handle = ctx.function("noop")
+render_handle = ctx.function("App.render")
+suite.add("ruby_to_js/call_no_args_handle", 100_000) { noop_handle.call }
+suite.add("ruby_to_js/call_path_handle", 100_000) { render_handle.call(1) }
+
+# 100 calls per round trip versus 100 separate round trips.
+batch_100 = Array.new(100) { |i| ["id", i] }
+suite.add("ruby_to_js/call_100_sequential", 1_000) do
+  batch_100.each { |name, arg| ctx.call(name, arg) }
+end
+suite.add("ruby_to_js/call_many_100", 1_000) { ctx.call_many(batch_100) }
+
 suite.add("ruby_to_js/call_int_arg", 100_000) { ctx.call("id", 123) }
 suite.add("ruby_to_js/call_short_string", 100_000) { ctx.call("id", "hello") }
 suite.add("ruby_to_js/call_utf8_string", 100_000) { ctx.call("id", "Ā hello") }
@@ -284,6 +354,14 @@ end
 suite.add("ruby_to_js/roundtrip_10k_floats", 100) do
   ctx.call("id", ruby_floats_10k)
 end
+ruby_long_strings.each do |kind, string|
+  suite.add("ruby_to_js/call_1m_#{kind}_string", 100) do
+    ctx.call("noop", string)
+  end
+end
+suite.add("ruby_to_js/call_1m_float64array", 20) do
+  ctx.call("noop", ruby_samples_1m)
+end
 suite.add("ruby_to_js/roundtrip_10k_strings", 50) do
   ctx.call("id", ruby_strings_10k)
 end
@@ -371,7 +449,9 @@ if options[:compare]
         baseline_ms_per_iter: old_per,
         current_ms_per_iter: new_per,
         ratio: new_per / old_per,
-        change_pct: ((new_per / old_per) - 1.0) * 100.0
+        change_pct: ((new_per / old_per) - 1.0) * 100.0,
+        baseline_allocs_per_iter: old[:allocs_per_iter],
+        current_allocs_per_iter: row[:allocs_per_iter]
       }
     end
   payload[:comparisons] = comparisons
@@ -381,13 +461,19 @@ if options[:compare]
     puts "Comparison against #{options[:compare]}"
     comparisons.each do |row|
       direction = row[:change_pct] <= 0 ? "faster" : "slower"
-      puts "%-42s %8.3fms -> %8.3fms  %+7.2f%% %s" %
+      allocs =
+        if row[:baseline_allocs_per_iter]
+          "  allocs %.1f -> %.1f" %
+            [row[:baseline_allocs_per_iter], row[:current_allocs_per_iter]]
+        end
+      puts "%-42s %8.3fms -> %8.3fms  %+7.2f%% %s%s" %
              [
                row[:name],
                row[:baseline_ms_per_iter],
                row[:current_ms_per_iter],
                row[:change_pct],
-               direction
+               direction,
+               allocs
              ]
     end
   end
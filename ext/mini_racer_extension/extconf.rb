@@ -14,6 +14,11 @@ require 'libv8-node'
 IS_DARWIN = RUBY_PLATFORM =~ /darwin/
 
 have_library('pthread')
+# optional, for write_heap_snapshot(gzip: true)
+# have_header defines HAVE_ZLIB_H on its own, even without the library
+if have_header('zlib.h') && !have_library('z', 'deflateInit2_')
+  $defs.delete('-DHAVE_ZLIB_H')
+end
 have_library('objc') if IS_DARWIN
 $CXXFLAGS += " -Wall" unless $CXXFLAGS.split.include? "-Wall"
 $CXXFLAGS += " -g" unless $CXXFLAGS.split.include? "-g"
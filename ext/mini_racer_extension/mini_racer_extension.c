@@ -5,8 +5,15 @@
 #include <string.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sched.h>
 #include <errno.h>
 #include <math.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 #if defined(__linux__) && !defined(__GLIBC__)
 // musl compatibility for glibc-linked libraries (e.g. libv8-node)
@@ -37,6 +44,8 @@ float __isoc23_strtof(const char *nptr, char **endptr) {
 #include "ruby/version.h"
 #include "ruby/thread.h"
 #include "serde.c"
+#include "ring.c"
+#include "transcode.c"
 #include "mini_racer_v8.h"
 
 // for debugging
@@ -134,14 +143,39 @@ typedef struct Context
     // gets too complicated
     atomic_int quit;
     int verbose_exceptions;
+    int code_cache;
+    char *code_cache_dir; // NULL unless persisted with a MiniRacer::CodeCache
+    uint64_t calls;       // requests made, for ContextPool's max_calls
+    int reset;            // V8 thread only, see context_reset
+    int snapshot_builder; // made by Snapshot.build
+    int sealed;           // V8 thread only, see snapshot_s_build
+    int track_refs;       // detect shared and cyclic values when serializing
+    int symbolize_keys;   // JS object keys become symbols
+    // set by a ContextPool with max_heap:; the V8 thread then stores the
+    // used heap size in |used_heap| before replying, see v8_timedwait
+    int track_heap;
+    _Atomic int64_t used_heap;
     int64_t idle_gc, max_memory, timeout;
     struct State *pst; // used by v8 thread
     VALUE procs;       // array of js -> ruby callbacks
+    VALUE snapshot_procs; // the ones the snapshot came with, or Qnil
+    VALUE module_resolver; // Context#load_module's block or Qnil
     VALUE exception;   // pending exception or Qnil
     Buf req, res;      // ruby->v8 request/response, mediated by |mtx| and |cv|
     Buf v8_req;        // stable v8-side copy of a request returned by v8_roundtrip
+    // transport: :ring; when set, requests travel through |to_v8| and
+    // responses through |to_ruby| instead of |req| and |res| (which the
+    // v8 thread then only uses to collect replies before publishing them)
+    int ring;
+    Ring to_v8, to_ruby;
+    // spin-then-park waiting, see spin_budget(); |req_seq| and |res_seq|
+    // are bumped with |mtx| held whenever |req| or |res| is published
+    // and read without it by spinning threads
+    int64_t spin_max;                     // nanoseconds, 0 disables spinning
+    _Atomic int64_t call_ewma, idle_ewma; // nanoseconds
+    atomic_uint req_seq, res_seq;
     int res_ready;     // protected by |mtx|; response may be filled before ready
-    Buf snapshot;
+    struct Blob *snapshot; // or NULL
     pthread_t single_threaded_thr;
     pid_t single_threaded_pid;
     int single_threaded_thr_started;
@@ -152,18 +186,143 @@ typedef struct Context
     pthread_mutex_t mtx;
     pthread_cond_t cv;
     struct {
-        pthread_mutex_t mtx;
-        pthread_cond_t cv;
-        int active; // dispatch thread only
-        int cancel; // protected by |mtx|
+        // absolute time in clock_ns() units, or one of the WD_* states;
+        // written by the dispatch thread, CAS'd to WD_FIRING by watchdog
+        _Atomic int64_t deadline;
+        int active;     // dispatch thread only
+        int registered; // written with |watchdog.mtx| held
     } wd; // watchdog
     Barrier early_init, late_init;
 } Context;
 
+enum
+{
+    BLOB_HEAP,   // malloc'd along with the Blob
+    BLOB_MAPPED, // see blob_mmap
+    BLOB_V8,     // made by v8_snapshot_build
+};
+
+// immutable snapshot data, shared by a Snapshot and the contexts made
+// from it since V8 reads from it for as long as the isolate lives;
+// freed by whoever lets go last, which can be a v8 thread, hence
+// no ruby_xmalloc
+typedef struct Blob {
+    atomic_int refs;
+    int kind;
+    size_t len;
+    uint8_t *data;
+} Blob;
+
 typedef struct Snapshot {
-    VALUE blob;
+    Blob *blob; // NULL when empty
+    // frozen array of the callbacks attached in Snapshot.build, the blob
+    // refers to them by index; Qnil for other snapshots
+    VALUE procs;
+    int verbose_exceptions; // for warmup!
 } Snapshot;
 
+// copies |data|; returns NULL when empty or out of memory, check |len|
+static Blob *blob_new(const void *data, size_t len)
+{
+    Blob *b;
+
+    if (!len)
+        return NULL;
+    b = malloc(sizeof(*b) + len);
+    if (!b)
+        return NULL;
+    atomic_init(&b->refs, 1);
+    b->kind = BLOB_HEAP;
+    b->len = len;
+    b->data = (uint8_t *)&b[1];
+    memcpy(b->data, data, len);
+    return b;
+}
+
+// takes ownership of a blob made by v8_snapshot_build, without copying;
+// returns NULL when out of memory, |data| is freed then
+static Blob *blob_adopt(uint8_t *data, size_t len)
+{
+    Blob *b;
+
+    b = malloc(sizeof(*b));
+    if (!b) {
+        v8_snapshot_free(data);
+        return NULL;
+    }
+    atomic_init(&b->refs, 1);
+    b->kind = BLOB_V8;
+    b->len = len;
+    b->data = data;
+    return b;
+}
+
+// maps |fd| read-only; pages are shared with the page cache and, after
+// fork, between parent and children; returns an errno
+static int blob_mmap(int fd, Blob **pb)
+{
+    struct stat st;
+    Blob *b;
+    void *p;
+
+    *pb = NULL;
+    if (fstat(fd, &st))
+        return errno;
+    if (!S_ISREG(st.st_mode))
+        return EINVAL;
+    if (!st.st_size)
+        return 0;
+    b = malloc(sizeof(*b));
+    if (!b)
+        return ENOMEM;
+    p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+        free(b);
+        return errno;
+    }
+    atomic_init(&b->refs, 1);
+    b->kind = BLOB_MAPPED;
+    b->len = st.st_size;
+    b->data = p;
+    *pb = b;
+    return 0;
+}
+
+static Blob *blob_ref(Blob *b)
+{
+    if (b)
+        atomic_fetch_add(&b->refs, 1);
+    return b;
+}
+
+static void blob_unref(Blob *b)
+{
+    if (!b || atomic_fetch_sub(&b->refs, 1) > 1)
+        return;
+    if (b->kind == BLOB_MAPPED)
+        munmap(b->data, b->len);
+    if (b->kind == BLOB_V8)
+        v8_snapshot_free(b->data);
+    free(b);
+}
+
+// a background compile, see context_eval_background; shared by the ruby
+// thread waiting for it and the v8 side, whoever lets go last frees it
+typedef struct Compile {
+    pthread_mutex_t mtx;
+    pthread_cond_t cv;
+    int refs, done, interrupted; // protected by |mtx|
+} Compile;
+
+typedef struct Pool {
+    VALUE idle;   // Thread::Queue of ready contexts (or creation errors)
+    VALUE kwargs; // frozen, for Context#initialize
+    long size;
+    int64_t max_calls, max_heap; // recycling thresholds, 0 is unlimited
+    uint64_t checkouts, recycles, created, wait_ns;
+    int closed;
+} Pool;
+
 static void context_destroy(Context *c);
 static void context_abandon(Context *c);
 static void context_free(void *arg);
@@ -192,6 +351,18 @@ static const rb_data_type_t snapshot_type = {
     },
 };
 
+static void pool_mark(void *arg);
+static size_t pool_size(const void *arg);
+
+static const rb_data_type_t pool_type = {
+    .wrap_struct_name   =  "mini_racer/context_pool",
+    .function           = {
+        .dfree = RUBY_TYPED_DEFAULT_FREE,
+        .dmark = pool_mark,
+        .dsize = pool_size,
+    },
+};
+
 static VALUE platform_init_error;
 static VALUE context_disposed_error;
 static VALUE parse_error;
@@ -203,9 +374,13 @@ static VALUE snapshot_error;
 static VALUE terminated_error;
 static VALUE context_class;
 static VALUE snapshot_class;
+static VALUE code_cache_class;
 static VALUE date_time_class;
 static VALUE binary_class;
+static VALUE typed_array_class;
 static VALUE js_function_class;
+static VALUE function_handle_class;
+static rb_encoding *utf16le_encoding;
 
 static pthread_mutex_t flags_mtx = PTHREAD_MUTEX_INITIALIZER;
 static Buf flags; // protected by |flags_mtx|
@@ -220,14 +395,27 @@ typedef struct State
     uint8_t verbatim_keys:1;
 } State;
 
+// object keys by their bytes on the wire, which stay valid
+// for the duration of the deserialization
+typedef struct KeyCache
+{
+    const uint8_t *p;
+    uint32_t n;
+    uint8_t latin1;
+    VALUE v;
+} KeyCache;
+
 // note: must be stack-allocated or VALUEs won't be visible to ruby's GC
 typedef struct DesCtx
 {
     State   *tos;
     VALUE   refs; // object refs array
     uint8_t transcode_latin1:1;
+    uint8_t symbolize_keys:1;
+    uint32_t last_object_size;
     char    err[64];
     State   stack[512];
+    KeyCache keys[64]; // direct-mapped, power of two
 } DesCtx;
 
 struct rendezvous_nogvl
@@ -252,6 +440,9 @@ static void DesCtx_init(DesCtx *c)
     *c->tos = (State){Qundef, Qundef, /*verbatim_keys*/0};
     *c->err = '\0';
     c->transcode_latin1 = 1; // convert to utf8
+    c->symbolize_keys = 0;
+    c->last_object_size = 0;
+    memset(c->keys, 0, sizeof(c->keys));
 }
 
 static void put(DesCtx *c, VALUE v)
@@ -270,8 +461,13 @@ static void put(DesCtx *c, VALUE v)
         if (*b == Qundef) {
             *b = v;
         } else {
-            if (!c->tos->verbatim_keys)
-                *b = rb_funcall(*b, rb_intern("to_s"), 0);
+            // keys from des_key are final, others are strings or numbers
+            if (!c->tos->verbatim_keys && !SYMBOL_P(*b)) {
+                if (!RB_TYPE_P(*b, T_STRING))
+                    *b = rb_funcall(*b, rb_intern("to_s"), 0);
+                if (c->symbolize_keys)
+                    *b = rb_str_intern(*b);
+            }
             rb_hash_aset(*a, *b, v);
             *b = Qundef;
         }
@@ -329,19 +525,56 @@ static void des_int(void *arg, int64_t v)
     put(arg, LL2NUM((LONG_LONG)v));
 }
 
-static void des_num(void *arg, double v)
+static VALUE num_value(double v)
 {
     if (isfinite(v) && v == trunc(v)) {
         // INT64_MAX is not exactly representable as a double: it rounds up to
         // 2^63, which would let 2^63 through and make the cast undefined.
-        if (v >= -0x1p63 && v < 0x1p63) {
-            put(arg, LL2NUM((LONG_LONG)v));
-        } else {
-            put(arg, rb_dbl2big(v));
-        }
-    } else {
-        put(arg, DBL2NUM(v));
+        if (v >= -0x1p63 && v < 0x1p63)
+            return LL2NUM((LONG_LONG)v);
+        return rb_dbl2big(v);
+    }
+    return DBL2NUM(v);
+}
+
+static void des_num(void *arg, double v)
+{
+    put(arg, num_value(v));
+}
+
+// appends straight to the array being built, see des1_nums
+static void put_many(DesCtx *c, const VALUE *v, size_t n)
+{
+    size_t i;
+
+    if (*c->err)
+        return;
+    if (RB_TYPE_P(c->tos->a, T_ARRAY)) {
+        rb_ary_cat(c->tos->a, v, n);
+        return;
     }
+    for (i = 0; i < n; i++)
+        put(c, v[i]);
+}
+
+static void des_ints(void *arg, const int64_t *v, size_t n)
+{
+    VALUE a[64];
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        a[i] = LL2NUM((LONG_LONG)v[i]);
+    put_many(arg, a, n);
+}
+
+static void des_nums(void *arg, const double *v, size_t n)
+{
+    VALUE a[64];
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        a[i] = num_value(v[i]);
+    put_many(arg, a, n);
 }
 
 static void des_date(void *arg, double v)
@@ -384,20 +617,94 @@ static void des_bigint(void *arg, const void *p, size_t n, int sign)
     put(c, v);
 }
 
-static void des_string(void *arg, const char *s, size_t n)
+// the result's coderange is known up front, which saves ruby from
+// scanning the string again the first time it's used
+static VALUE str_from_latin1(const uint8_t *s, size_t n)
 {
-    put(arg, rb_utf8_str_new(s, n));
+    uint8_t *p;
+    size_t k;
+    VALUE v;
+
+    v = rb_utf8_str_new(NULL, n);
+    k = ascii_run8((uint8_t *)RSTRING_PTR(v), s, n);
+    if (k == n) {
+        ENC_CODERANGE_SET(v, ENC_CODERANGE_7BIT);
+        return v;
+    }
+    rb_str_resize(v, k + latin1_utf8_len(&s[k], n-k));
+    p = (uint8_t *)RSTRING_PTR(v);
+    latin1_to_utf8(&p[k], &s[k], n-k);
+    ENC_CODERANGE_SET(v, ENC_CODERANGE_VALID);
+    return v;
+}
+
+// |n| is in bytes; returns Qnil if |s| is not valid UTF-16
+static VALUE str_from_utf16le(const uint8_t *s, size_t n)
+{
+    uint8_t *p, *e;
+    size_t k;
+    VALUE v;
+
+    n /= 2;
+    v = rb_utf8_str_new(NULL, n);
+    k = ascii_run16((uint8_t *)RSTRING_PTR(v), s, n);
+    if (k == n) {
+        ENC_CODERANGE_SET(v, ENC_CODERANGE_7BIT);
+        return v;
+    }
+    rb_str_resize(v, k + 3*(n-k)); // worst case
+    p = (uint8_t *)RSTRING_PTR(v);
+    e = utf16le_to_utf8(&p[k], &s[2*k], n-k);
+    if (!e)
+        return Qnil;
+    rb_str_resize(v, e - p);
+    ENC_CODERANGE_SET(v, ENC_CODERANGE_VALID);
+    return v;
+}
+
+// object keys as interned strings or symbols; arrays of same-shape
+// objects repeat the same keys, those cost a cache lookup after the first
+static int des_key(DesCtx *c, int latin1, const uint8_t *p, size_t n)
+{
+    KeyCache *k;
+    uint32_t h;
+    size_t i;
+    VALUE v;
+
+    if (*c->err || c->tos->b != Qundef || c->tos->verbatim_keys)
+        return 0;
+    if (!RB_TYPE_P(c->tos->a, T_HASH))
+        return 0;
+    h = 2166136261u; // fnv-1a
+    for (i = 0; i < n; i++)
+        h = (h ^ p[i]) * 16777619u;
+    k = &c->keys[h & (countof(c->keys)-1)];
+    if (k->p && k->n == n && k->latin1 == latin1 && !memcmp(k->p, p, n)) {
+        put(c, k->v);
+        return 1;
+    }
+    for (i = 0; latin1 && i < n && p[i] < 128; i++);
+    if (!latin1 || i == n) { // ascii is utf-8
+        v = rb_enc_interned_str((const char *)p, n, rb_utf8_encoding());
+    } else {
+        v = rb_str_to_interned_str(str_from_latin1(p, n));
+    }
+    if (c->symbolize_keys)
+        v = rb_str_intern(v);
+    *k = (KeyCache){p, n, latin1, v};
+    put(c, v);
+    return 1;
 }
 
-static VALUE str_encode_bang(VALUE v)
+static void des_string(void *arg, const char *s, size_t n)
 {
-    // TODO cache these? this function can get called often
-    return rb_funcall(v, rb_intern("encode!"), 1, rb_str_new_cstr("UTF-8"));
+    if (des_key(arg, /*latin1*/0, (const uint8_t *)s, n))
+        return;
+    put(arg, rb_utf8_str_new(s, n));
 }
 
 static void des_string8(void *arg, const uint8_t *s, size_t n)
 {
-    rb_encoding *e;
     DesCtx *c;
     VALUE v;
 
@@ -405,13 +712,9 @@ static void des_string8(void *arg, const uint8_t *s, size_t n)
     if (*c->err)
         return;
     if (c->transcode_latin1) {
-        e = rb_enc_find("ISO-8859-1"); // TODO cache?
-        if (!e) {
-            snprintf(c->err, sizeof(c->err), "no ISO-8859-1 encoding");
+        if (des_key(c, /*latin1*/1, s, n))
             return;
-        }
-        v = rb_enc_str_new((char *)s, n, e);
-        v = str_encode_bang(v); // cannot fail
+        v = str_from_latin1(s, n);
     } else {
         v = rb_enc_str_new((char *)s, n, rb_ascii8bit_encoding());
     }
@@ -422,10 +725,8 @@ static void des_string8(void *arg, const uint8_t *s, size_t n)
 // des_string16: |n| is in bytes, not code points
 static void des_string16(void *arg, const void *s, size_t n)
 {
-    rb_encoding *e;
-    VALUE v, r;
     DesCtx *c;
-    int exc;
+    VALUE v;
 
     c = arg;
     if (*c->err)
@@ -433,20 +734,12 @@ static void des_string16(void *arg, const void *s, size_t n)
     // TODO(bnoordhuis) replace this hack with something more principled
     if (n == sizeof(js_function_marker) && !memcmp(js_function_marker, s, n))
         return put(c, rb_funcall(js_function_class, rb_intern("new"), 0));
-    e = rb_enc_find("UTF-16LE"); // TODO cache?
-    if (!e) {
-        snprintf(c->err, sizeof(c->err), "no UTF16-LE encoding");
-        return;
-    }
-    v = rb_enc_str_new((char *)s, n, e);
+    v = str_from_utf16le(s, n);
     // JS strings can contain unmatched or illegal surrogate pairs
     // that Ruby won't decode; return the string as-is in that case
-    r = rb_protect(str_encode_bang, v, &exc);
-    if (exc) {
-        rb_set_errinfo(Qnil);
-        r = v;
-    }
-    put(c, r);
+    if (NIL_P(v))
+        v = rb_enc_str_new((char *)s, n, utf16le_encoding);
+    put(c, v);
 }
 
 // ruby doesn't really have a concept of a byte array so store it as
@@ -454,12 +747,94 @@ static void des_string16(void *arg, const void *s, size_t n)
 // numbers, but the latter is markedly less efficient, storage-wise
 static void des_arraybuffer(void *arg, const void *s, size_t n)
 {
-    put(arg, rb_enc_str_new((char *)s, n, rb_ascii8bit_encoding()));
+    DesCtx *c;
+    VALUE v;
+
+    c = arg;
+    v = rb_enc_str_new((char *)s, n, rb_ascii8bit_encoding());
+    rb_ary_push(c->refs, v);
+    put(c, v);
 }
 
-static void des_array_begin(void *arg)
+static const struct {
+    char tag, size;
+    const char *name;
+} typed_array_types[] = {
+    {'b', 1, "int8"},
+    {'B', 1, "uint8"},
+    {'C', 1, "uint8_clamped"},
+    {'w', 2, "int16"},
+    {'W', 2, "uint16"},
+    {'d', 4, "int32"},
+    {'D', 4, "uint32"},
+    {'h', 2, "float16"},
+    {'f', 4, "float32"},
+    {'F', 8, "float64"},
+    {'q', 8, "bigint64"},
+    {'Q', 8, "biguint64"},
+};
+
+// Uint8Arrays and DataViews become strings with just the bytes they
+// cover, other typed arrays become MiniRacer::TypedArray objects that
+// keep the element type and share the arraybuffer string
+static void put_typed_array(DesCtx *c, VALUE buf, int type,
+                            uint64_t off, uint64_t len)
 {
-    push(arg, rb_ary_new());
+    size_t i;
+    VALUE v;
+
+    if (*c->err)
+        return;
+    if (!RB_TYPE_P(buf, T_STRING) || off + len < off
+        || off + len > (uint64_t)RSTRING_LEN(buf)) {
+        snprintf(c->err, sizeof(c->err), "bad typed array");
+        return;
+    }
+    if (type == 'B' || type == '?' || NIL_P(typed_array_class)) {
+        v = buf;
+        if (off > 0 || len < (uint64_t)RSTRING_LEN(buf))
+            v = rb_str_subseq(buf, off, len);
+        goto done;
+    }
+    for (i = 0; typed_array_types[i].tag != type; i++)
+        if (i+1 == countof(typed_array_types)) {
+            snprintf(c->err, sizeof(c->err), "bad typed array");
+            return;
+        }
+    v = rb_obj_alloc(typed_array_class);
+    rb_ivar_set(v, rb_intern("@type"), ID2SYM(rb_intern(typed_array_types[i].name)));
+    rb_ivar_set(v, rb_intern("@buffer"), buf);
+    rb_ivar_set(v, rb_intern("@byte_offset"), ULL2NUM(off));
+    rb_ivar_set(v, rb_intern("@length"), ULL2NUM(len / typed_array_types[i].size));
+done:
+    rb_ary_push(c->refs, v);
+    put(c, v);
+}
+
+static void des_typed_array(void *arg, const void *s, size_t n,
+                            int type, uint64_t off, uint64_t len)
+{
+    DesCtx *c;
+    VALUE v;
+
+    c = arg;
+    v = rb_enc_str_new((char *)s, n, rb_ascii8bit_encoding());
+    rb_ary_push(c->refs, v);
+    put_typed_array(c, v, type, off, len);
+}
+
+static void des_typed_array_ref(void *arg, uint32_t id,
+                                int type, uint64_t off, uint64_t len)
+{
+    DesCtx *c;
+
+    c = arg;
+    put_typed_array(c, rb_ary_entry(c->refs, id), type, off, len);
+}
+
+static void des_array_begin(void *arg, uint32_t count)
+{
+    push(arg, rb_ary_new_capa(count));
 }
 
 static void des_array_end(void *arg)
@@ -487,14 +862,29 @@ static void des_named_props_end(void *arg)
     c->tos--; // dropped, no way to represent in ruby
 }
 
-static void des_object_begin(void *arg)
+static void des_object_begin(void *arg, uint32_t count)
 {
-    push(arg, rb_hash_new());
+    DesCtx *c;
+
+    c = arg;
+    // the count isn't known up front but objects in an array tend to
+    // have the same shape, so size it like the one before it
+    if (!count)
+        count = c->last_object_size;
+    push(c, rb_hash_new_capa(count));
 }
 
 static void des_object_end(void *arg)
 {
-    pop(arg);
+    DesCtx *c;
+
+    c = arg;
+    if (!*c->err && RB_TYPE_P(c->tos->a, T_HASH)) {
+        c->last_object_size = RHASH_SIZE(c->tos->a);
+        if (c->last_object_size > 4096)
+            c->last_object_size = 4096; // don't overdo it
+    }
+    pop(c);
 }
 
 static void des_map_begin(void *arg)
@@ -526,6 +916,11 @@ static void des_error_begin(void *arg)
     push(arg, rb_ary_new());
 }
 
+static VALUE error_key(DesCtx *c, const char *s)
+{
+    return c->symbolize_keys ? ID2SYM(rb_intern(s)) : rb_str_new_cstr(s);
+}
+
 static void des_error_end(void *arg)
 {
     VALUE *a, h, message, stack, cause, newline;
@@ -540,9 +935,9 @@ static void des_error_end(void *arg)
     }
     a = &c->tos->a;
     h = rb_ary_pop(*a);
-    message = rb_hash_aref(h, rb_str_new_cstr("message"));
-    stack = rb_hash_aref(h, rb_str_new_cstr("stack"));
-    cause = rb_hash_aref(h, rb_str_new_cstr("cause"));
+    message = rb_hash_aref(h, error_key(c, "message"));
+    stack = rb_hash_aref(h, error_key(c, "stack"));
+    cause = rb_hash_aref(h, error_key(c, "cause"));
     if (NIL_P(message))
         message = rb_str_new_cstr("JS exception");
     if (!NIL_P(stack)) {
@@ -562,21 +957,73 @@ static int collect(VALUE k, VALUE v, VALUE a)
     return ST_CONTINUE;
 }
 
-static void add_string(Ser *s, VALUE v)
+// V8 takes strings as UTF-8 or as Latin-1, the latter when |*one_byte|
+// is set; ASCII and Latin-1 strings are returned as-is, strings in an
+// encoding that isn't ASCII compatible are converted to UTF-8 and the
+// rest is taken to be UTF-8 already; with a NULL |one_byte|, Latin-1
+// is converted too; ruby caches the coderange so this usually doesn't
+// have to look at the string
+static VALUE str_for_v8(VALUE str, int *one_byte)
 {
     rb_encoding *e;
+
+    Check_Type(str, T_STRING);
+    if (one_byte)
+        *one_byte = 0;
+    e = rb_enc_get(str);
+    if (!e)
+        return str;
+    if (rb_enc_asciicompat(e) && rb_enc_str_coderange(str) == ENC_CODERANGE_7BIT)
+        goto narrow;
+    if (!strcmp(e->name, "ISO-8859-1")) {
+        if (one_byte)
+            goto narrow;
+        return rb_str_conv_enc(str, e, rb_utf8_encoding());
+    }
+    if (!rb_enc_asciicompat(e))
+        return rb_str_conv_enc(str, e, rb_utf8_encoding());
+    return str;
+narrow:
+    if (one_byte)
+        *one_byte = 1;
+    return str;
+}
+
+static void add_string(Ser *s, VALUE v)
+{
+    int one_byte;
     const void *p;
-    size_t n;
+    size_t n, k;
+    uint8_t *d;
 
     Check_Type(v, T_STRING);
-    e = rb_enc_get(v);
+    // V8 strings are latin1 or utf16; sending them in that form lets V8
+    // copy them as-is instead of decoding utf8 on its thread
+    if (rb_enc_get(v) == utf16le_encoding)
+        return ser_string16(s, RSTRING_PTR(v), RSTRING_LEN(v));
+    v = str_for_v8(v, &one_byte);
     p = RSTRING_PTR(v);
     n = RSTRING_LEN(v);
-    if (e) {
-        if (!strcmp(e->name, "ISO-8859-1"))
-            return ser_string8(s, p, n);
-        if (!strcmp(e->name, "UTF-16LE"))
-            return ser_string16(s, p, n);
+    if (one_byte)
+        return ser_string8(s, p, n);
+    if (rb_enc_get(v) != rb_utf8_encoding()
+        || rb_enc_str_coderange(v) != ENC_CODERANGE_VALID)
+        return ser_string(s, p, n);
+    switch (utf8_width(p, n, &k)) {
+    case 1:
+        w_byte(s, '"');
+        w_varint(s, k);
+        if ((d = w_reserve(s, k)))
+            utf8_to_latin1(d, p, n);
+        return;
+    case 2:
+        if (2*k > n) // mostly ascii, utf8 is smaller
+            break;
+        w_byte(s, 'c');
+        w_varint(s, 2*k);
+        if ((d = w_reserve(s, 2*k)))
+            utf8_to_utf16le(d, p, n);
+        return;
     }
     return ser_string(s, p, n);
 }
@@ -613,68 +1060,195 @@ static int serialize_bigint(Ser *s, VALUE v)
     return *s->err ? -1 : 0;
 }
 
-static int serialize1(Ser *s, VALUE refs, VALUE v)
+// without ref tracking, stands in for cycle detection
+#define SERIALIZE_MAX_DEPTH 1000
+
+// arrays and hashes seen during one serialization, so shared and cyclic
+// values are written as back references; V8 numbers objects in the order
+// they appear, hence ids are handed out in order
+typedef struct Refs {
+    st_table *ids; // VALUE -> ref id, keyed by address; NULL if not tracking
+    int depth;
+} Refs;
+
+static void refs_mark(void *arg)
+{
+    if (arg)
+        rb_mark_set(arg); // pins, objects mustn't move while keyed by address
+}
+
+static void refs_free(void *arg)
+{
+    if (arg)
+        st_free_table(arg);
+}
+
+static size_t refs_size(const void *arg)
+{
+    return arg ? st_memsize(arg) : 0;
+}
+
+static const rb_data_type_t refs_type = {
+    .wrap_struct_name   =  "mini_racer/refs",
+    .function           = {
+        .dfree = refs_free,
+        .dmark = refs_mark,
+        .dsize = refs_size,
+    },
+};
+
+// writes a back reference and returns 1 if |v| was seen before,
+// otherwise gives it the next ref id in |*id|
+static int seen_ref(Ser *s, Refs *refs, VALUE v, st_data_t *id)
+{
+    if (!refs->ids) {
+        if (refs->depth > SERIALIZE_MAX_DEPTH)
+            return bail(&s->err, "nested too deeply, cyclic?");
+        return 0;
+    }
+    if (st_lookup(refs->ids, (st_data_t)v, id)) {
+        ser_object_ref(s, *id);
+        return 1;
+    }
+    *id = refs->ids->num_entries;
+    st_insert(refs->ids, (st_data_t)v, *id);
+    return 0;
+}
+
+static int serialize1(Ser *s, Refs *refs, VALUE v);
+
+// the arraybuffer and the view each take up an object id on the
+// other end; a buffer shared by several views is sent once
+static int serialize_view(Ser *s, Refs *refs, VALUE v, VALUE buf,
+                          int type, size_t off, size_t len)
+{
+    st_data_t id;
+
+    if (refs->ids && st_lookup(refs->ids, (st_data_t)v, &id)) {
+        ser_object_ref(s, id);
+        return 0;
+    }
+    if (refs->ids && st_lookup(refs->ids, (st_data_t)buf, &id)) {
+        ser_object_ref(s, id);
+    } else {
+        if (refs->ids)
+            st_insert(refs->ids, (st_data_t)buf, refs->ids->num_entries);
+        ser_arraybuffer(s, RSTRING_PTR(buf), RSTRING_LEN(buf));
+    }
+    if (refs->ids)
+        st_insert(refs->ids, (st_data_t)v, refs->ids->num_entries);
+    ser_typed_array(s, type, off, len);
+    return *s->err ? -1 : 0;
+}
+
+static int serialize_typed_array(Ser *s, Refs *refs, VALUE v)
+{
+    VALUE buf, type;
+    size_t i, off, len;
+
+    type = rb_ivar_get(v, rb_intern("@type"));
+    buf = rb_ivar_get(v, rb_intern("@buffer"));
+    off = NUM2SIZET(rb_ivar_get(v, rb_intern("@byte_offset")));
+    len = NUM2SIZET(rb_ivar_get(v, rb_intern("@length")));
+    Check_Type(buf, T_STRING);
+    for (i = 0; i < countof(typed_array_types); i++)
+        if (SYMBOL_P(type) && !strcmp(rb_id2name(SYM2ID(type)), typed_array_types[i].name))
+            break;
+    if (i == countof(typed_array_types))
+        return bail(&s->err, "bad typed array type");
+    len *= typed_array_types[i].size;
+    if (off + len < off || off + len > (size_t)RSTRING_LEN(buf))
+        return bail(&s->err, "typed array out of bounds");
+    return serialize_view(s, refs, v, buf, typed_array_types[i].tag, off, len);
+}
+
+struct serialize_pair
+{
+    Ser *s;
+    Refs *refs;
+    int map; // any key goes
+    int err; // -1 on error, 1 if a key needs Map encoding
+};
+
+// serializes straight from the hash, no intermediate key/value array
+static int serialize_pair(VALUE k, VALUE v, VALUE arg)
+{
+    struct serialize_pair *a;
+
+    a = (void *)arg;
+    switch (a->map ? T_FIXNUM : TYPE(k)) {
+    case T_FIXNUM:
+    case T_STRING:
+    case T_SYMBOL:
+        break;
+    default:
+        a->err = 1;
+        return ST_STOP;
+    }
+    if (serialize1(a->s, a->refs, k) || serialize1(a->s, a->refs, v)) {
+        a->err = -1;
+        return ST_STOP;
+    }
+    return ST_CONTINUE;
+}
+
+// drops refs made after |arg|, for when serialize1 rewinds
+static int forget_ref(st_data_t k, st_data_t v, st_data_t arg)
 {
-    VALUE a, t, id;
+    return v > arg ? ST_DELETE : ST_CONTINUE;
+}
+
+static int serialize1(Ser *s, Refs *refs, VALUE v)
+{
+    struct serialize_pair a;
+    uint32_t mark;
+    st_data_t id;
     size_t i, n;
+    VALUE t;
 
     if (*s->err)
         return -1;
     switch (TYPE(v)) {
     case T_ARRAY:
-        {
-            VALUE obj_id = rb_obj_id(v);
-            id = rb_hash_lookup(refs, obj_id);
-            if (NIL_P(id)) {
-                n = RARRAY_LENINT(v);
-                i = rb_hash_size_num(refs);
-                rb_hash_aset(refs, obj_id, LONG2FIX(i));
-                ser_array_begin(s, n);
-                for (i = 0; i < n; i++)
-                    if (serialize1(s, refs, rb_ary_entry(v, i)))
-                        return -1;
-                ser_array_end(s, n);
-            } else {
-                ser_object_ref(s, FIX2LONG(id));
-            }
-        }
+        if (seen_ref(s, refs, v, &id))
+            break;
+        n = RARRAY_LENINT(v);
+        refs->depth++;
+        ser_array_begin(s, n);
+        for (i = 0; i < n; i++)
+            if (serialize1(s, refs, rb_ary_entry(v, i)))
+                return -1;
+        ser_array_end(s, n);
+        refs->depth--;
         break;
     case T_HASH:
-        {
-            VALUE obj_id = rb_obj_id(v);
-            id = rb_hash_lookup(refs, obj_id);
-            if (NIL_P(id)) {
-                a = rb_ary_new();
-                i = rb_hash_size_num(refs);
-                n = rb_hash_size_num(v);
-                rb_hash_aset(refs, obj_id, LONG2FIX(i));
-                rb_hash_foreach(v, collect, a);
-                for (i = 0; i < 2*n; i += 2) {
-                    t = rb_ary_entry(a, i);
-                    switch (TYPE(t)) {
-                    case T_FIXNUM:
-                    case T_STRING:
-                    case T_SYMBOL:
-                        continue;
-                    }
-                    break;
-                }
-                if (i == 2*n) {
-                    ser_object_begin(s);
-                    for (i = 0; i < 2*n; i += 2) {
-                        if (serialize1(s, refs, rb_ary_entry(a, i+0)))
-                            return -1;
-                        if (serialize1(s, refs, rb_ary_entry(a, i+1)))
-                            return -1;
-                    }
-                    ser_object_end(s, n);
-                } else {
-                    return bail(&s->err, "TODO serialize as Map");
-                }
-            } else {
-                ser_object_ref(s, FIX2LONG(id));
-            }
+        if (seen_ref(s, refs, v, &id))
+            break;
+        n = rb_hash_size_num(v);
+        refs->depth++;
+        a = (struct serialize_pair){s, refs, /*map*/0, 0};
+        mark = s->b.len;
+        ser_object_begin(s);
+        rb_hash_foreach(v, serialize_pair, (VALUE)&a);
+        if (a.err < 0)
+            return -1;
+        if (a.err == 0) {
+            ser_object_end(s, n);
+            refs->depth--;
+            break;
         }
+        // a key that can't be a property name, start over as a Map;
+        // forget refs to values we're about to serialize again
+        s->b.len = mark;
+        if (refs->ids)
+            st_foreach(refs->ids, forget_ref, id);
+        a = (struct serialize_pair){s, refs, /*map*/1, 0};
+        ser_map_begin(s);
+        rb_hash_foreach(v, serialize_pair, (VALUE)&a);
+        if (a.err)
+            return -1;
+        ser_map_end(s, 2*n);
+        refs->depth--;
         break;
     case T_DATA:
         if (date_time_class == CLASS_OF(v)) {
@@ -729,7 +1303,9 @@ static int serialize1(Ser *s, VALUE refs, VALUE v)
         } else if (!NIL_P(binary_class) && rb_obj_is_kind_of(v, binary_class)) {
             t = rb_ivar_get(v, rb_intern("@data"));
             Check_Type(t, T_STRING);
-            ser_uint8array(s, RSTRING_PTR(t), RSTRING_LEN(t));
+            return serialize_view(s, refs, v, t, 'B', 0, RSTRING_LEN(t));
+        } else if (!NIL_P(typed_array_class) && rb_obj_is_kind_of(v, typed_array_class)) {
+            return serialize_typed_array(s, refs, v);
         } else {
             snprintf(s->err, sizeof(s->err), "unsupported type %s", rb_class2name(CLASS_OF(v)));
             return -1;
@@ -745,10 +1321,26 @@ static int serialize1(Ser *s, VALUE refs, VALUE v)
 }
 
 // don't mix with ser_array_begin/ser_object_begin because
-// that will throw off the object reference count
-static int serialize(Ser *s, VALUE v)
+// that will throw off the object reference count;
+// |track_refs| is false for values known to be trees
+static int serialize(Ser *s, VALUE v, int track_refs)
 {
-    return serialize1(s, rb_hash_new(), v);
+    VALUE holder;
+    Refs refs;
+    int r;
+
+    refs = (Refs){NULL, 0};
+    if (!track_refs)
+        return serialize1(s, &refs, v);
+    // owned by |holder| so the GC frees it if serialize1 raises
+    holder = TypedData_Wrap_Struct(0, &refs_type, NULL);
+    refs.ids = st_init_numtable();
+    DATA_PTR(holder) = refs.ids;
+    r = serialize1(s, &refs, v);
+    DATA_PTR(holder) = NULL;
+    st_free_table(refs.ids);
+    RB_GC_GUARD(holder);
+    return r;
 }
 
 static struct timespec deadline_ms(int ms)
@@ -781,82 +1373,388 @@ static int deadline_exceeded(struct timespec deadline)
     return timespec_le(deadline, deadline_ms(0));
 }
 
-static void *v8_watchdog(void *arg)
+enum
 {
-    struct timespec deadline;
-    Context *c;
+    WD_DISARMED =  0,
+    WD_FIRING   = -1, // watchdog is terminating the isolate
+    WD_FIRED    = -2, // isolate has been terminated, pending disarm
+};
 
-    c = arg;
-    deadline = deadline_ms(c->timeout);
-    pthread_mutex_lock(&c->wd.mtx);
-    for (;;) {
-        if (c->wd.cancel)
-            break;
-        pthread_cond_timedwait(&c->wd.cv, &c->wd.mtx, &deadline);
-        if (c->wd.cancel)
-            break;
-        if (deadline_exceeded(deadline)) {
-            v8_terminate_watchdog(c->pst);
-            break;
-        }
-    }
-    pthread_mutex_unlock(&c->wd.mtx);
-    return NULL;
-}
+// one watchdog thread for the whole process; contexts register once and
+// afterwards arm and disarm their deadlines with plain atomic stores, the
+// mutex is only taken when a deadline is earlier than the next wakeup
+static struct {
+    pthread_once_t once;
+    pthread_mutex_t mtx;
+    pthread_cond_t cv;
+    _Atomic int64_t next; // next scheduled wakeup, INT64_MAX when idle
+    atomic_int running;
+    Context **contexts;   // protected by |mtx|
+    size_t len, cap;      // protected by |mtx|
+} watchdog = {
+    .once = PTHREAD_ONCE_INIT,
+    .mtx = PTHREAD_MUTEX_INITIALIZER,
+    .next = INT64_MAX,
+};
 
-static void v8_timedwait(Context *c, const uint8_t *p, size_t n,
-                         void (*func)(struct State *pst, const uint8_t *p, size_t n))
+// same clock as deadline_ms
+static int64_t clock_ns(void)
 {
-    pthread_t thr;
-    int r;
+    struct timespec t;
 
-    if (c->timeout <= 0 || c->wd.active) {
-        func(c->pst, p, n);
-        return;
+#ifdef __APPLE__
+    clock_gettime(CLOCK_REALTIME, &t);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &t);
+#endif
+    return (int64_t)t.tv_sec*1000*1000*1000 + t.tv_nsec;
+}
+
+static void watchdog_cv_init(void)
+{
+    pthread_condattr_t cattr;
+
+    pthread_condattr_init(&cattr);
+#ifndef __APPLE__
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&watchdog.cv, &cattr);
+    pthread_condattr_destroy(&cattr);
+}
+
+// the watchdog thread doesn't survive fork; the child starts a new one
+// the next time a timed call arms a deadline; inherited contexts are
+// forgotten so it never touches the V8 state of a call that was in flight
+static void watchdog_atfork_child(void)
+{
+    size_t i;
+
+    for (i = 0; i < watchdog.len; i++) {
+        atomic_store(&watchdog.contexts[i]->wd.deadline, WD_DISARMED);
+        watchdog.contexts[i]->wd.registered = 0;
     }
-    c->wd.active = 1;
-    r = pthread_create(&thr, NULL, v8_watchdog, c);
+    watchdog.len = 0;
+    pthread_mutex_init(&watchdog.mtx, NULL);
+    watchdog_cv_init();
+    atomic_store(&watchdog.next, INT64_MAX);
+    atomic_store(&watchdog.running, 0);
+}
+
+static void watchdog_once_init(void)
+{
+    watchdog_cv_init();
+    pthread_atfork(NULL, NULL, watchdog_atfork_child);
+}
+
+// called with |watchdog.mtx| held; fires expired deadlines and
+// returns the earliest pending deadline or INT64_MAX if there is none
+static int64_t watchdog_scan(void)
+{
+    int64_t d, now, next;
+    Context *c;
+    size_t i;
+
+    now = clock_ns();
+    next = INT64_MAX;
+    for (i = 0; i < watchdog.len; i++) {
+        c = watchdog.contexts[i];
+        d = atomic_load(&c->wd.deadline);
+        if (d <= 0)
+            continue;
+        if (d > now) {
+            if (next > d)
+                next = d;
+            continue;
+        }
+        // loses the race when the dispatch thread disarms concurrently
+        if (!atomic_compare_exchange_strong(&c->wd.deadline, &d, WD_FIRING))
+            continue;
+        v8_terminate_watchdog(c->pst);
+        atomic_store(&c->wd.deadline, WD_FIRED);
+    }
+    return next;
+}
+
+static void *watchdog_main(void *arg)
+{
+    static const int64_t ns_per_sec = 1000*1000*1000;
+    struct timespec t;
+    int64_t next;
+
+    (void)&arg;
+#ifdef __linux__
+    prctl(PR_SET_NAME, "mini_racer-wd"); // shows up in /proc/self/task/*/comm
+#endif
+    pthread_mutex_lock(&watchdog.mtx);
+    for (;;) {
+        next = watchdog_scan();
+        // publish before rescanning: a concurrent watchdog_arm either sees
+        // the new value and signals us, or we see its deadline here
+        atomic_store(&watchdog.next, next);
+        if (watchdog_scan() < next)
+            continue;
+        if (next == INT64_MAX) {
+            pthread_cond_wait(&watchdog.cv, &watchdog.mtx);
+        } else {
+            t.tv_sec = next / ns_per_sec;
+            t.tv_nsec = next % ns_per_sec;
+            pthread_cond_timedwait(&watchdog.cv, &watchdog.mtx, &t);
+        }
+    }
+    return NULL;
+}
+
+// called with |watchdog.mtx| held
+static int watchdog_start(void)
+{
+    pthread_attr_t attr;
+    pthread_t thr;
+    int r;
+
+    if (atomic_load(&watchdog.running))
+        return 0;
+    if ((r = pthread_attr_init(&attr)))
+        return r;
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    r = pthread_create(&thr, &attr, watchdog_main, NULL);
+    pthread_attr_destroy(&attr);
+    if (!r)
+        atomic_store(&watchdog.running, 1);
+    return r;
+}
+
+static int watchdog_register(Context *c)
+{
+    Context **p;
+    size_t n;
+    int r;
+
+    pthread_once(&watchdog.once, watchdog_once_init);
+    pthread_mutex_lock(&watchdog.mtx);
+    r = watchdog_start();
+    if (r || c->wd.registered)
+        goto out;
+    if (watchdog.len == watchdog.cap) {
+        n = watchdog.cap ? 2*watchdog.cap : 16;
+        p = realloc(watchdog.contexts, n*sizeof(*p));
+        if (!p) {
+            r = ENOMEM;
+            goto out;
+        }
+        watchdog.contexts = p;
+        watchdog.cap = n;
+    }
+    watchdog.contexts[watchdog.len++] = c;
+    c->wd.registered = 1;
+out:
+    pthread_mutex_unlock(&watchdog.mtx);
+    return r;
+}
+
+static void watchdog_unregister(Context *c)
+{
+    size_t i;
+
+    if (!c->wd.registered)
+        return;
+    pthread_mutex_lock(&watchdog.mtx);
+    for (i = 0; i < watchdog.len; i++) {
+        if (watchdog.contexts[i] == c) {
+            watchdog.contexts[i] = watchdog.contexts[--watchdog.len];
+            break;
+        }
+    }
+    c->wd.registered = 0;
+    pthread_mutex_unlock(&watchdog.mtx);
+}
+
+static int watchdog_arm(Context *c, int64_t timeout)
+{
+    int64_t deadline;
+    int r;
+
+    if (!c->wd.registered || !atomic_load(&watchdog.running))
+        if ((r = watchdog_register(c)))
+            return r;
+    deadline = clock_ns() + timeout*1000*1000;
+    atomic_store(&c->wd.deadline, deadline);
+    // common case: the watchdog already wakes up earlier than |deadline|,
+    // e.g. for an earlier deadline of this context that has since passed
+    if (deadline < atomic_load(&watchdog.next)) {
+        pthread_mutex_lock(&watchdog.mtx);
+        pthread_cond_signal(&watchdog.cv);
+        pthread_mutex_unlock(&watchdog.mtx);
+    }
+    return 0;
+}
+
+static void watchdog_disarm(Context *c)
+{
+    int64_t d;
+
+    d = atomic_load(&c->wd.deadline);
+    for (;;) {
+        if (d == WD_FIRING) {
+            sched_yield(); // watchdog is inside v8_terminate_watchdog
+            d = atomic_load(&c->wd.deadline);
+            continue;
+        }
+        if (atomic_compare_exchange_weak(&c->wd.deadline, &d, WD_DISARMED))
+            break;
+    }
+    if (d == WD_FIRED)
+        v8_cancel_watchdog_termination(c->pst);
+}
+
+static void v8_timedwait(Context *c, int64_t timeout, const uint8_t *p, size_t n,
+                         void (*func)(struct State *pst, const uint8_t *p, size_t n))
+{
+    int r;
+
+    if (timeout <= 0 || c->wd.active) {
+        func(c->pst, p, n);
+        goto out;
+    }
+    r = watchdog_arm(c, timeout);
     if (r) {
-        c->wd.active = 0;
-        fprintf(stderr, "mini_racer: watchdog: pthread_create: %s\n", strerror(r));
+        fprintf(stderr, "mini_racer: watchdog: %s\n", strerror(r));
         fflush(stderr);
+        func(c->pst, p, n);
+        goto out;
     }
+    c->wd.active = 1;
     func(c->pst, p, n);
-    if (r)
-        return;
-    pthread_mutex_lock(&c->wd.mtx);
-    c->wd.cancel = 1;
-    pthread_cond_signal(&c->wd.cv);
-    pthread_mutex_unlock(&c->wd.mtx);
-    pthread_join(thr, NULL);
-    v8_cancel_watchdog_termination(c->pst);
-    c->wd.cancel = 0;
+    watchdog_disarm(c);
     c->wd.active = 0;
+out:
+    // the reply isn't published yet, pool_checkin sees this value
+    if (c->track_heap)
+        atomic_store(&c->used_heap, v8_used_heap_size(c->pst));
+}
+
+// A parked peer costs two context switches, far more than a call that
+// runs for a microsecond, so waiters first poll for a while. The budget
+// follows the peer's recent latency: about twice the moving average, or
+// nothing when that average exceeds |spin_max| because we'd park anyway.
+// |call_ewma| tracks ruby waiting on v8, |idle_ewma| v8 waiting on ruby.
+static int64_t spin_budget(Context *c, _Atomic int64_t *ewma)
+{
+    int64_t t;
+
+    if (!c->spin_max)
+        return 0;
+    t = atomic_load_explicit(ewma, memory_order_relaxed);
+    if (t > c->spin_max)
+        return 0;
+    return 2*t < c->spin_max ? 2*t : c->spin_max;
+}
+
+static void spin_update(Context *c, _Atomic int64_t *ewma, int64_t t0)
+{
+    int64_t t, dt;
+
+    if (!c->spin_max)
+        return;
+    dt = clock_ns() - t0;
+    // clamp outliers so one slow call or long idle period doesn't
+    // disable spinning for the next hundred calls
+    if (dt > 4*c->spin_max)
+        dt = 4*c->spin_max;
+    t = atomic_load_explicit(ewma, memory_order_relaxed);
+    atomic_store_explicit(ewma, t + (dt - t) / 8, memory_order_relaxed);
+}
+
+// polls |*seq| until it changes from |seen|, |*stop| becomes non-zero
+// or |budget| nanoseconds pass; caller re-checks the real condition
+static void spin_wait(atomic_uint *seq, unsigned seen, atomic_int *stop, int64_t budget)
+{
+    int64_t t0;
+    int i;
+
+    t0 = clock_ns();
+    for (i = 1;; i++) {
+        if (atomic_load_explicit(seq, memory_order_acquire) != seen)
+            return;
+        if (atomic_load_explicit(stop, memory_order_relaxed))
+            return;
+        cpu_relax();
+        if (i % 64 == 0 && clock_ns() - t0 >= budget)
+            return;
+    }
+}
+
+static inline int64_t spin_clock(Context *c)
+{
+    return c->spin_max ? clock_ns() : 0;
 }
 
 static void dispatch1(Context *c, const uint8_t *p, size_t n)
 {
+    const uint8_t *op, *pe;
+    uint64_t timeout;
     uint8_t b;
+    int fd;
 
     assert(n > 0);
+    op = p; // reported when the request is malformed
+    timeout = c->timeout;
+    // per-call timeout override, request is (t)imeout <varint ms> <request>
+    if (*p == 't') {
+        pe = p + n;
+        p++;
+        if (r_varint(&p, pe, &timeout) || p == pe)
+            goto bad;
+        n = pe - p;
+        op = p;
+    }
+    // Snapshot.build is done with the context, only the blob is left
+    if (c->sealed && *p != 'z') {
+        b = 'e'; // no ruby exception pending, reads as a disposed context
+        v8_reply(c, &b, 1);
+        return;
+    }
     switch (*p) {
     case 'A': return v8_attach(c->pst, p+1, n-1);
-    case 'C': return v8_timedwait(c, p+1, n-1, v8_call);
-    case 'D': return v8_timedwait(c, p+1, n-1, v8_call_await);
-    case 'E': return v8_timedwait(c, p+1, n-1, v8_eval);
-    case 'F': return v8_timedwait(c, p+1, n-1, v8_eval_await);
+    case 'B': return v8_timedwait(c, timeout, p+1, n-1, v8_call_many);
+    case 'C': return v8_timedwait(c, timeout, p+1, n-1, v8_call);
+    case 'D': return v8_timedwait(c, timeout, p+1, n-1, v8_call_await);
+    case 'E': return v8_timedwait(c, timeout, p+1, n-1, v8_eval);
+    case 'F': return v8_timedwait(c, timeout, p+1, n-1, v8_eval_await);
+    case 'G': return v8_timedwait(c, timeout, p+1, n-1, v8_load_module);
     case 'H': return v8_heap_snapshot(c->pst);
+    case 'I': return v8_timedwait(c, timeout, p+1, n-1, v8_invoke);
+    case 'J': return v8_timedwait(c, timeout, p+1, n-1, v8_invoke_await);
+    case 'K': // start bac(k)ground compile, see v8_compile_start
+        if (n < 1 + sizeof(Compile *) + 1 + sizeof(uint32_t))
+            goto bad;
+        return v8_compile_start(c->pst, p+1, n-1);
+    case 'k': // finish background compile, request is <Compile*> <await>
+        if (n != 1 + sizeof(Compile *) + 1)
+            goto bad;
+        return v8_timedwait(c, timeout, p+1, n-1, v8_compile_finish);
     case 'M': return v8_perform_microtask_checkpoint(c->pst);
+    case 'N': c->reset = v8_reset(c->pst); return;
+    case 'O': // (O)utput heap snapshot, request is <fd> <gzip>
+        if (n != 1 + sizeof(int) + 1)
+            goto bad;
+        memcpy(&fd, p+1, sizeof(fd));
+        return v8_write_heap_snapshot(c->pst, fd, p[1+sizeof(fd)]);
     case 'P': return v8_pump_message_loop(c->pst);
+    case 'R': return v8_timedwait(c, timeout, p+1, n-1, v8_function);
     case 'S': return v8_heap_stats(c->pst);
-    case 'T': return v8_snapshot(c->pst, p+1, n-1);
-    case 'W': return v8_warmup(c->pst, p+1, n-1);
+    case 'U': return v8_function_dispose(c->pst, p+1, n-1);
+    case 'Z': // seal Snapshot.build's context, returns err or empty string
+        c->sealed = v8_snapshot_seal(c->pst);
+        c->reset = c->sealed && !single_threaded; // see v8_thread_init
+        return;
+    case 'z': return v8_snapshot_blob(c->pst);
     case 'L':
         b = 0;
         v8_reply(c, &b, 1); // doesn't matter what as long as it's not empty
         return v8_low_memory_notification(c->pst);
     }
-    fprintf(stderr, "mini_racer: bad request %02x\n", *p);
+bad:
+    fprintf(stderr, "mini_racer: bad request %02x\n", *op);
     fflush(stderr);
 }
 
@@ -876,6 +1774,7 @@ static void dispatch_buf(Context *c, Buf *req)
     pthread_mutex_lock(&c->mtx);
     buf_reset(&local_req);
     c->res_ready = 1;
+    atomic_fetch_add(&c->res_seq, 1);
     pthread_cond_signal(&c->cv);
 }
 
@@ -884,16 +1783,85 @@ static void dispatch(Context *c)
     dispatch_buf(c, &c->req);
 }
 
-// called by v8_isolate_and_context
-void v8_thread_main(Context *c, struct State *pst)
+// ring transport counterpart of dispatch_buf; |mtx| is not held
+static void dispatch_ring(Context *c, Buf *req)
+{
+    Buf local_req;
+
+    buf_move(req, &local_req);
+    dispatch1(c, local_req.buf, local_req.len);
+    buf_reset(&local_req);
+    ring_send(&c->to_ruby, &c->res);
+}
+
+static int v8_thread_main_ring(Context *c)
+{
+    bool issued_idle_gc = true;
+    int64_t timeout, t0;
+    Buf req;
+    int r;
+
+    buf_init(&req);
+    t0 = spin_clock(c);
+    while (!atomic_load(&c->quit) && !c->reset) {
+        timeout = -1;
+        if (c->idle_gc > 0 && !issued_idle_gc)
+            timeout = c->idle_gc * 1000000;
+        r = ring_wait(&c->to_v8, &c->quit, NULL, spin_budget(c, &c->idle_ewma), timeout);
+        if (r == ETIMEDOUT) {
+            v8_low_memory_notification(c->pst);
+            issued_idle_gc = true;
+        }
+        if (r)
+            continue; // idle or quit signal from other thread
+        spin_update(c, &c->idle_ewma, t0);
+        ring_recv(&c->to_v8, &req);
+        dispatch_ring(c, &req);
+        issued_idle_gc = false;
+        t0 = spin_clock(c);
+    }
+    buf_reset(&req);
+    if (c->reset)
+        return 1;
+    pthread_mutex_lock(&c->mtx); // v8_thread_start expects it held
+    return 0;
+}
+
+// wakes up threads parked on the ring transport so they notice |quit|
+static void context_wake(Context *c)
+{
+    if (!c->ring)
+        return;
+    ring_wake(&c->to_v8);
+    ring_wake(&c->to_ruby);
+}
+
+// called by v8_isolate_and_context; returns 1 when Context#reset! wants
+// fresh contexts, v8_isolate_and_context then calls it again
+int v8_thread_main(Context *c, struct State *pst)
 {
     struct timespec deadline;
     bool issued_idle_gc = true;
+    int64_t budget, t0;
+    unsigned seen;
 
-    c->pst = pst;
-    barrier_wait(&c->late_init);
+    if (c->reset) {
+        c->reset = 0;
+    } else {
+        c->pst = pst;
+        barrier_wait(&c->late_init);
+    }
+    if (c->ring)
+        return v8_thread_main_ring(c);
     pthread_mutex_lock(&c->mtx);
-    while (!c->quit) {
+    t0 = spin_clock(c);
+    while (!c->quit && !c->reset) {
+        if (!c->req.len && (budget = spin_budget(c, &c->idle_ewma))) {
+            seen = atomic_load(&c->req_seq);
+            pthread_mutex_unlock(&c->mtx);
+            spin_wait(&c->req_seq, seen, &c->quit, budget);
+            pthread_mutex_lock(&c->mtx);
+        }
         if (!c->req.len) {
             if (c->idle_gc > 0) {
                 deadline = deadline_ms(c->idle_gc);
@@ -908,15 +1876,23 @@ void v8_thread_main(Context *c, struct State *pst)
         }
         if (!c->req.len)
             continue; // spurious wakeup or quit signal from other thread
+        spin_update(c, &c->idle_ewma, t0);
         dispatch(c);
         issued_idle_gc = false;
         pthread_cond_signal(&c->cv);
+        t0 = spin_clock(c);
     }
+    if (!c->reset)
+        return 0; // v8_thread_start expects |mtx| held
+    pthread_mutex_unlock(&c->mtx);
+    return 1;
 }
 
 // called by v8_thread_main and from mini_racer_v8.cc
 void v8_dispatch(Context *c)
 {
+    if (c->ring)
+        return dispatch_ring(c, &c->v8_req);
     pthread_mutex_lock(&c->mtx);
     dispatch_buf(c, &c->v8_req);
     pthread_mutex_unlock(&c->mtx);
@@ -926,20 +1902,48 @@ void v8_dispatch(Context *c)
 // or v8_pump_message_loop
 void v8_roundtrip(Context *c, const uint8_t **p, size_t *n)
 {
+    static const uint8_t disposed[] = "edisposed context";
+    int64_t budget, t0;
+    unsigned seen;
+
+    t0 = spin_clock(c);
+    if (c->ring) {
+        buf_reset(&c->v8_req);
+        if (c->res.len)
+            ring_send(&c->to_ruby, &c->res);
+        if (ring_wait(&c->to_v8, &c->quit, NULL, spin_budget(c, &c->idle_ewma), -1)) {
+            *p = disposed;
+            *n = sizeof(disposed) - 1;
+            return;
+        }
+        spin_update(c, &c->idle_ewma, t0);
+        ring_recv(&c->to_v8, &c->v8_req);
+        *p = c->v8_req.buf;
+        *n = c->v8_req.len;
+        return;
+    }
     pthread_mutex_lock(&c->mtx);
     buf_reset(&c->v8_req);
-    if (c->res.len)
+    if (c->res.len) {
         c->res_ready = 1;
+        atomic_fetch_add(&c->res_seq, 1);
+    }
     pthread_cond_signal(&c->cv);
+    if (!c->req.len && (budget = spin_budget(c, &c->idle_ewma))) {
+        seen = atomic_load(&c->req_seq);
+        pthread_mutex_unlock(&c->mtx);
+        spin_wait(&c->req_seq, seen, &c->quit, budget);
+        pthread_mutex_lock(&c->mtx);
+    }
     while (!c->req.len && !atomic_load(&c->quit))
         pthread_cond_wait(&c->cv, &c->mtx);
     if (!c->req.len && atomic_load(&c->quit)) {
-        static const uint8_t disposed[] = "edisposed context";
         *p = disposed;
         *n = sizeof(disposed) - 1;
         pthread_mutex_unlock(&c->mtx);
         return;
     }
+    spin_update(c, &c->idle_ewma, t0);
     buf_reset(&c->res);
     c->res_ready = 0;
     buf_move(&c->req, &c->v8_req);
@@ -950,11 +1954,48 @@ void v8_roundtrip(Context *c, const uint8_t **p, size_t *n)
 
 void v8_reply(Context *c, const uint8_t *p, size_t n)
 {
+    if (c->ring) { // only the v8 thread touches |res|
+        buf_put(&c->res, p, n);
+        return;
+    }
     pthread_mutex_lock(&c->mtx);
     buf_put(&c->res, p, n);
     pthread_mutex_unlock(&c->mtx);
 }
 
+void v8_compile_done(Compile *cp)
+{
+    pthread_mutex_lock(&cp->mtx);
+    cp->done = 1;
+    pthread_cond_broadcast(&cp->cv);
+    pthread_mutex_unlock(&cp->mtx);
+}
+
+void v8_compile_release(Compile *cp)
+{
+    int refs;
+
+    pthread_mutex_lock(&cp->mtx);
+    refs = --cp->refs;
+    pthread_mutex_unlock(&cp->mtx);
+    if (refs)
+        return;
+    pthread_cond_destroy(&cp->cv);
+    pthread_mutex_destroy(&cp->mtx);
+    free(cp);
+}
+
+// true when the ruby thread let go, it won't ask to finish the compile
+int v8_compile_abandoned(Compile *cp)
+{
+    int r;
+
+    pthread_mutex_lock(&cp->mtx);
+    r = (cp->refs == 1);
+    pthread_mutex_unlock(&cp->mtx);
+    return r;
+}
+
 static void v8_once_init(void)
 {
     static pthread_once_t once = PTHREAD_ONCE_INIT;
@@ -968,7 +2009,10 @@ static void *v8_thread_start(void *arg)
     c = arg;
     barrier_wait(&c->early_init);
     v8_once_init();
-    v8_thread_init(c, c->snapshot.buf, c->snapshot.len, c->max_memory, c->verbose_exceptions);
+    v8_thread_init(c, c->snapshot ? c->snapshot->data : NULL,
+                   c->snapshot ? c->snapshot->len : 0, c->max_memory,
+                   c->verbose_exceptions, c->code_cache, c->code_cache_dir,
+                   c->snapshot_builder);
     while (c->quit < 2)
         pthread_cond_wait(&c->cv, &c->mtx);
     context_destroy(c);
@@ -1014,11 +2058,17 @@ static VALUE rendezvous_callback_do(VALUE arg)
     assert(b->len > 0);
     assert(*b->buf == 'c');
     DesCtx_init(&d);
+    d.symbolize_keys = c->symbolize_keys;
     args = deserialize1(&d, b->buf+1, b->len-1); // skip 'c' marker
     func = rb_ary_pop(args); // callback id
     if (!RB_INTEGER_TYPE_P(func))
         rb_raise(runtime_error, "bad callback id");
     id = NUM2LONG(func);
+    if (id == MODULE_RESOLVER) { // [specifier, referrer], see v8_load_module
+        if (NIL_P(c->module_resolver))
+            return Qnil;
+        return rb_funcall2(c->module_resolver, rb_intern("call"), RARRAY_LENINT(args), RARRAY_PTR(args));
+    }
     if (id < 0 || id >= RARRAY_LEN(c->procs))
         rb_raise(runtime_error, "bad callback id");
     func = rb_ary_entry(c->procs, id);
@@ -1045,7 +2095,7 @@ static void *rendezvous_callback(void *arg)
         goto fail;
     }
     ser_init1(&s, 'c'); // callback reply
-    if (serialize(&s, r)) {
+    if (serialize(&s, r, c->track_refs)) {
         c->exception = rb_exc_new_cstr(internal_error, s.err);
         ser_reset(&s);
         goto fail;
@@ -1137,9 +2187,40 @@ static void rendezvous_release(struct rendezvous_nogvl *a)
     pthread_mutex_unlock(&c->rr_mtx);
 }
 
+// ring transport part of rendezvous_nogvl: sends |a->req| if not empty and
+// moves the response into |a->res|; returns 0, EINTR or ECANCELED
+static int rendezvous_ring(struct rendezvous_nogvl *a)
+{
+    int64_t t0;
+    Context *c;
+
+    c = a->context;
+    if (atomic_load(&c->quit))
+        goto cancelled;
+    t0 = spin_clock(c);
+    if (a->req->len)
+        ring_send(&c->to_v8, a->req); // v8 thread takes ownership of req
+    if (!ring_wait(&c->to_ruby, &a->interrupted, &c->quit, spin_budget(c, &c->call_ewma), -1)) {
+        spin_update(c, &c->call_ewma, t0);
+        ring_recv(&c->to_ruby, a->res);
+        return 0;
+    }
+    if (!atomic_load(&c->quit)) {
+        atomic_store(&a->active, 0);
+        return EINTR;
+    }
+cancelled:
+    buf_reset(a->req);
+    a->finished = 1;
+    rendezvous_release(a);
+    return ECANCELED;
+}
+
 static inline void *rendezvous_nogvl(void *arg)
 {
     struct rendezvous_nogvl *a;
+    int64_t budget, t0;
+    unsigned seen;
     Context *c;
     int r;
 
@@ -1160,6 +2241,11 @@ static inline void *rendezvous_nogvl(void *arg)
 
 next:
     atomic_store(&a->active, 1);
+    if (c->ring) {
+        if ((r = rendezvous_ring(a)))
+            return (void *)(intptr_t)r;
+        goto response;
+    }
     pthread_mutex_lock(&c->mtx);
     if (atomic_load(&c->quit)) {
         buf_reset(a->req);
@@ -1168,10 +2254,12 @@ next:
         rendezvous_release(a);
         return (void *)(intptr_t)ECANCELED;
     }
+    t0 = spin_clock(c);
     if (a->req->len) {
         assert(c->req.len == 0);
         assert(!c->res_ready);
         buf_move(a->req, &c->req); // v8 thread takes ownership of req
+        atomic_fetch_add(&c->req_seq, 1);
         if (single_threaded) {
             r = single_threaded_runner_start(c);
             if (r) {
@@ -1184,6 +2272,12 @@ next:
         }
         pthread_cond_signal(&c->cv);
     }
+    if (!c->res_ready && (budget = spin_budget(c, &c->call_ewma))) {
+        seen = atomic_load(&c->res_seq);
+        pthread_mutex_unlock(&c->mtx);
+        spin_wait(&c->res_seq, seen, &a->interrupted, budget);
+        pthread_mutex_lock(&c->mtx);
+    }
     while (!c->res_ready && !atomic_load(&a->interrupted) && !atomic_load(&c->quit))
         pthread_cond_wait(&c->cv, &c->mtx);
     if (!c->res_ready && atomic_load(&a->interrupted)) {
@@ -1198,10 +2292,12 @@ next:
         rendezvous_release(a);
         return (void *)(intptr_t)ECANCELED;
     }
+    spin_update(c, &c->call_ewma, t0);
     buf_move(&c->res, a->res);
     c->res_ready = 0;
     pthread_cond_broadcast(&c->cv);
     pthread_mutex_unlock(&c->mtx);
+response:
     atomic_store(&a->active, 0);
     if (*a->res->buf == 'c') { // js -> ruby callback?
         rb_thread_call_with_gvl(rendezvous_callback, a);
@@ -1230,6 +2326,7 @@ static void rendezvous_ubf(void *arg)
     atomic_store(&a->interrupted, 1);
     c = a->context;
     pthread_cond_broadcast(&c->cv);
+    context_wake(c);
 }
 
 static void terminate_ubf(void *arg)
@@ -1242,6 +2339,25 @@ static void terminate_ubf(void *arg)
     pthread_cond_broadcast(&c->cv);
 }
 
+// ring transport part of rendezvous_cancel_nogvl
+static void rendezvous_cancel_ring(Context *c)
+{
+    static const uint8_t terminated[] = "eterminated";
+    Buf req, res;
+
+    buf_init(&req);
+    buf_init(&res);
+    while (!ring_wait(&c->to_ruby, &c->quit, NULL, 0, -1)) {
+        ring_recv(&c->to_ruby, &res);
+        if (res.len && *res.buf != 'c')
+            break;
+        buf_reset(&res);
+        buf_put(&req, terminated, sizeof(terminated) - 1);
+        ring_send(&c->to_v8, &req);
+    }
+    buf_reset(&res);
+}
+
 static void *rendezvous_cancel_nogvl(void *arg)
 {
     // Reply to any pending JS->Ruby callback with an 'e' marker plus message
@@ -1255,6 +2371,10 @@ static void *rendezvous_cancel_nogvl(void *arg)
     atomic_store(&a->active, 0);
     if (c->pst)
         v8_terminate_execution(c->pst);
+    if (c->ring) {
+        rendezvous_cancel_ring(c);
+        goto done;
+    }
     pthread_mutex_lock(&c->mtx);
     pthread_cond_broadcast(&c->cv);
     while (!atomic_load(&c->quit)) {
@@ -1268,6 +2388,7 @@ static void *rendezvous_cancel_nogvl(void *arg)
         c->res_ready = 0;
         buf_reset(&c->req);
         buf_put(&c->req, terminated, sizeof(terminated) - 1);
+        atomic_fetch_add(&c->req_seq, 1);
         pthread_cond_signal(&c->cv);
     }
     buf_reset(&c->req);
@@ -1276,6 +2397,7 @@ static void *rendezvous_cancel_nogvl(void *arg)
     c->res_ready = 0;
     pthread_cond_broadcast(&c->cv);
     pthread_mutex_unlock(&c->mtx);
+done:
     if (c->pst)
         v8_cancel_terminate_execution(c->pst);
     a->finished = 1;
@@ -1324,6 +2446,7 @@ static void rendezvous_no_des(Context *c, Buf *req, Buf *res)
         buf_reset(req);
         rb_raise(context_disposed_error, "disposed context");
     }
+    c->calls++;
     a.context = c;
     a.req = req;
     a.res = res;
@@ -1373,6 +2496,7 @@ static VALUE rendezvous(Context *c, Buf *req)
     DesCtx d;
 
     DesCtx_init(&d);
+    d.symbolize_keys = c->symbolize_keys;
     return rendezvous1(c, req, &d);
 }
 
@@ -1391,22 +2515,23 @@ static void raise_exception_with_message(VALUE klass, VALUE e)
     rb_exc_raise(rb_exc_new_str(klass, message));
 }
 
-static void handle_exception(VALUE e)
+// returns an exception object for |e| or Qnil if |e| isn't an error
+static VALUE new_exception(VALUE e)
 {
     const char *s;
     VALUE klass;
     long n;
 
     if (NIL_P(e))
-        return;
+        return Qnil;
     e = StringValue(e);
     n = RSTRING_LEN(e);
     if (n == 0)
-        return;
+        return Qnil;
     s = RSTRING_PTR(e);
     switch ((unsigned char)*s) {
     case NO_ERROR:
-        return;
+        return Qnil;
     case INTERNAL_ERROR:
         klass = internal_error;
         break;
@@ -1425,7 +2550,14 @@ static void handle_exception(VALUE e)
     default:
         rb_raise(internal_error, "bad error class %02x", (unsigned char)*s);
     }
-    raise_exception_with_message(klass, e);
+    return rb_exc_new_str(klass, rb_str_subseq(e, 1, n - 1));
+}
+
+static void handle_exception(VALUE e)
+{
+    e = new_exception(e);
+    if (!NIL_P(e))
+        rb_exc_raise(e);
 }
 
 static VALUE context_alloc(VALUE klass)
@@ -1449,11 +2581,18 @@ static VALUE context_alloc(VALUE klass)
         if (Qtrue == rb_funcall(m, rb_intern("const_defined?"), 1, rb_str_new_cstr("Binary")))
             binary_class = rb_const_get(m, rb_intern("Binary"));
     }
+    if (NIL_P(typed_array_class)) {
+        VALUE m = rb_const_get(rb_cObject, rb_intern("MiniRacer"));
+        if (Qtrue == rb_funcall(m, rb_intern("const_defined?"), 1, rb_str_new_cstr("TypedArray")))
+            typed_array_class = rb_const_get(m, rb_intern("TypedArray"));
+    }
     c = ruby_xmalloc(sizeof(*c));
     memset(c, 0, sizeof(*c));
     c->exception = Qnil;
     c->procs = rb_ary_new();
-    buf_init(&c->snapshot);
+    c->snapshot_procs = Qnil;
+    c->module_resolver = Qnil;
+    c->track_refs = 1;
     buf_init(&c->req);
     buf_init(&c->res);
     buf_init(&c->v8_req);
@@ -1477,26 +2616,16 @@ static VALUE context_alloc(VALUE klass)
     cause = "pthread_cond_init";
     if ((r = pthread_cond_init(&c->cv, &cattr)))
         goto fail3;
-    cause = "pthread_mutex_init";
-    if ((r = pthread_mutex_init(&c->wd.mtx, NULL)))
-        goto fail4;
-    cause = "pthread_cond_init";
-    if (pthread_cond_init(&c->wd.cv, &cattr))
-        goto fail5;
     cause = "barrier_init";
     if ((r = barrier_init(&c->early_init, 2)))
-        goto fail6;
+        goto fail4;
     cause = "barrier_init";
     if ((r = barrier_init(&c->late_init, 2)))
-        goto fail7;
+        goto fail5;
     pthread_condattr_destroy(&cattr);
     return TypedData_Wrap_Struct(klass, &context_type, c);
-fail7:
-    barrier_destroy(&c->early_init);
-fail6:
-    pthread_cond_destroy(&c->wd.cv);
 fail5:
-    pthread_mutex_destroy(&c->wd.mtx);
+    barrier_destroy(&c->early_init);
 fail4:
     pthread_cond_destroy(&c->cv);
 fail3:
@@ -1553,15 +2682,20 @@ static void context_free(void *arg)
         c->quit = 2; // 2 = v8 thread frees
         pthread_cond_signal(&c->cv);
         pthread_mutex_unlock(&c->mtx);
+        context_wake(c);
     }
 }
 
 static void context_abandon(Context *c)
 {
-    buf_reset(&c->snapshot);
+    watchdog_unregister(c);
+    blob_unref(c->snapshot);
     buf_reset(&c->req);
     buf_reset(&c->res);
     buf_reset(&c->v8_req);
+    ring_destroy(&c->to_v8);
+    ring_destroy(&c->to_ruby);
+    free(c->code_cache_dir);
     ruby_xfree(c);
 }
 
@@ -1572,12 +2706,14 @@ static void context_destroy(Context *c)
     pthread_cond_destroy(&c->cv);
     barrier_destroy(&c->early_init);
     barrier_destroy(&c->late_init);
-    pthread_mutex_destroy(&c->wd.mtx);
-    pthread_cond_destroy(&c->wd.cv);
-    buf_reset(&c->snapshot);
+    watchdog_unregister(c);
+    blob_unref(c->snapshot);
     buf_reset(&c->req);
     buf_reset(&c->res);
     buf_reset(&c->v8_req);
+    ring_destroy(&c->to_v8);
+    ring_destroy(&c->to_ruby);
+    free(c->code_cache_dir);
     ruby_xfree(c);
 }
 
@@ -1587,6 +2723,8 @@ static void context_mark(void *arg)
 
     c = arg;
     rb_gc_mark(c->procs);
+    rb_gc_mark(c->snapshot_procs);
+    rb_gc_mark(c->module_resolver);
     rb_gc_mark(c->exception);
 }
 
@@ -1657,11 +2795,13 @@ static void *context_dispose_do(void *arg)
         pthread_mutex_unlock(&c->mtx);
     } else {
         pthread_mutex_lock(&c->mtx);
-        while (c->req.len || c->res.len)
+        // with the ring transport |res| is private to the v8 thread
+        while (!c->ring && (c->req.len || c->res.len))
             pthread_cond_wait(&c->cv, &c->mtx);
         atomic_store(&c->quit, 1);   // disposed
         pthread_cond_signal(&c->cv); // wake up v8 thread
         pthread_mutex_unlock(&c->mtx);
+        context_wake(c);
     }
     return NULL;
 }
@@ -1704,7 +2844,7 @@ static VALUE context_call_common(int argc, VALUE *argv, VALUE self, char op)
     rb_ary_unshift(args, name);
     // request is (C)all or (D) call_await, [name, args...] array
     ser_init1(&s, op);
-    if (serialize(&s, args)) {
+    if (serialize(&s, args, c->track_refs)) {
         ser_reset(&s);
         rb_raise(runtime_error, "Context.call: %s", s.err);
     }
@@ -1725,35 +2865,320 @@ static VALUE context_call_await(int argc, VALUE *argv, VALUE self)
     return context_call_common(argc, argv, self, 'D');
 }
 
-static VALUE context_eval_common(int argc, VALUE *argv, VALUE self, char op)
+static VALUE context_call_many(VALUE self, VALUE calls)
 {
-    VALUE a, e, source, filename, kwargs;
+    VALUE a, e, r, pair, slot;
     Context *c;
+    DesCtx d;
+    long i, n;
     Ser s;
 
     TypedData_Get_Struct(self, Context, &context_type, c);
-    filename = Qnil;
-    rb_scan_args(argc, argv, "1:", &source, &kwargs);
-    Check_Type(source, T_STRING);
-    if (!NIL_P(kwargs))
-        filename = rb_hash_aref(kwargs, rb_id2sym(rb_intern("filename")));
-    if (NIL_P(filename))
-        filename = rb_str_new_cstr("<eval>");
-    Check_Type(filename, T_STRING);
-    // request is (E)val or (F) eval_await, [filename, source] array
-    ser_init1(&s, op);
-    ser_array_begin(&s, 2);
-    add_string(&s, filename);
-    add_string(&s, source);
-    ser_array_end(&s, 2);
-    // response is [result, errname] array
+    Check_Type(calls, T_ARRAY);
+    for (i = 0, n = RARRAY_LEN(calls); i < n; i++) {
+        a = rb_ary_entry(calls, i);
+        if (!RB_TYPE_P(a, T_ARRAY) || !RARRAY_LEN(a) || !RB_TYPE_P(rb_ary_entry(a, 0), T_STRING))
+            rb_raise(rb_eArgError, "Context.call_many: expected [name, args...] at index %ld", i);
+    }
+    // request is (B)atch call, [[name, args...], ...] array
+    ser_init1(&s, 'B');
+    if (serialize(&s, calls, c->track_refs)) {
+        ser_reset(&s);
+        rb_raise(runtime_error, "Context.call_many: %s", s.err);
+    }
+    // response is [[slot, ...], err] array, each slot a string with
+    // a serialized [result, err] pair so that one result that can't
+    // be cloned doesn't take the others down, see serialize_slot()
     a = rendezvous(c, &s.b); // takes ownership of |s.b|
     e = rb_ary_pop(a);
     handle_exception(e);
-    return rb_ary_pop(a);
+    r = rb_ary_pop(a);
+    Check_Type(r, T_ARRAY);
+    for (i = 0, n = RARRAY_LEN(r); i < n; i++) {
+        slot = rb_ary_entry(r, i);
+        Check_Type(slot, T_STRING);
+        DesCtx_init(&d);
+        d.symbolize_keys = c->symbolize_keys;
+        pair = deserialize1(&d, (const uint8_t *)RSTRING_PTR(slot), RSTRING_LEN(slot));
+        Check_Type(pair, T_ARRAY);
+        e = new_exception(rb_ary_entry(pair, 1));
+        rb_ary_store(r, i, NIL_P(e) ? rb_ary_entry(pair, 0) : e);
+    }
+    return r;
 }
 
-static VALUE context_eval(int argc, VALUE *argv, VALUE self)
+static VALUE context_function(VALUE self, VALUE name)
+{
+    VALUE a, e, h;
+    Context *c;
+    Ser s;
+
+    TypedData_Get_Struct(self, Context, &context_type, c);
+    Check_Type(name, T_STRING);
+    // request is (R)esolve function, [name] array
+    ser_init1(&s, 'R');
+    if (serialize(&s, rb_ary_new_from_args(1, name), 0)) {
+        ser_reset(&s);
+        rb_raise(runtime_error, "Context.function: %s", s.err);
+    }
+    // response is [id, err] array
+    a = rendezvous(c, &s.b); // takes ownership of |s.b|
+    e = rb_ary_pop(a);
+    handle_exception(e);
+    h = rb_obj_alloc(function_handle_class);
+    rb_iv_set(h, "@context", self);
+    rb_iv_set(h, "@name", rb_str_freeze(rb_str_dup(name)));
+    rb_iv_set(h, "@id", rb_ary_pop(a));
+    return h;
+}
+
+static VALUE function_handle_call_common(int argc, VALUE *argv, VALUE self, char op)
+{
+    VALUE a, e, args;
+    Context *c;
+    Ser s;
+
+    TypedData_Get_Struct(rb_iv_get(self, "@context"), Context, &context_type, c);
+    if (NIL_P(rb_iv_get(self, "@id")))
+        rb_raise(runtime_error, "disposed function handle");
+    args = rb_ary_new_from_values(argc, argv);
+    rb_ary_unshift(args, rb_iv_get(self, "@id"));
+    // request is (I)nvoke or (J) invoke_await, [id, args...] array
+    ser_init1(&s, op);
+    if (serialize(&s, args, c->track_refs)) {
+        ser_reset(&s);
+        rb_raise(runtime_error, "FunctionHandle.call: %s", s.err);
+    }
+    // response is [result, err] array
+    a = rendezvous(c, &s.b); // takes ownership of |s.b|
+    e = rb_ary_pop(a);
+    handle_exception(e);
+    return rb_ary_pop(a);
+}
+
+// drops the V8 side's reference to the function and its receiver,
+// which otherwise lives as long as the context
+static VALUE function_handle_dispose(VALUE self)
+{
+    VALUE id;
+    Context *c;
+    Ser s;
+
+    TypedData_Get_Struct(rb_iv_get(self, "@context"), Context, &context_type, c);
+    id = rb_iv_get(self, "@id");
+    if (NIL_P(id))
+        return Qnil;
+    rb_iv_set(self, "@id", Qnil);
+    if (atomic_load(&c->quit))
+        return Qnil; // gone with the context
+    // request is (U)nreference function handle, id
+    ser_init1(&s, 'U');
+    ser_int(&s, NUM2INT(id));
+    return rendezvous(c, &s.b); // takes ownership of |s.b|, returns nil
+}
+
+static VALUE function_handle_call(int argc, VALUE *argv, VALUE self)
+{
+    return function_handle_call_common(argc, argv, self, 'I');
+}
+
+static VALUE function_handle_call_await(int argc, VALUE *argv, VALUE self)
+{
+    return function_handle_call_common(argc, argv, self, 'J');
+}
+
+// per-call timeout prefix, overrides Context's timeout; 0 disables it
+// timeouts are milliseconds, any Numeric; fractions round up so
+// that a tiny timeout doesn't turn into no timeout at all
+static int64_t timeout_ms(VALUE v)
+{
+    double d;
+
+    if (!rb_obj_is_kind_of(v, rb_cNumeric))
+        rb_raise(rb_eTypeError, "wrong argument type %"PRIsVALUE" (expected Numeric)",
+                 rb_obj_class(v));
+    d = NUM2DBL(v);
+    if (!(d >= 0 && d <= INT32_MAX)) // also catches NaN
+        rb_raise(rb_eArgError, "bad timeout");
+    return (int64_t)ceil(d);
+}
+
+static void ser_timeout(Ser *s, VALUE timeout)
+{
+    if (NIL_P(timeout))
+        return;
+    w_byte(s, 't');
+    w_varint(s, FIX2LONG(timeout));
+}
+
+struct eval_background
+{
+    Context *c;
+    Compile *cp;
+    VALUE filename, source, timeout;
+    uint8_t flags;
+    int await;
+};
+
+static void *compile_wait_nogvl(void *arg)
+{
+    Compile *cp;
+
+    cp = arg;
+    pthread_mutex_lock(&cp->mtx);
+    while (!cp->done && !cp->interrupted)
+        pthread_cond_wait(&cp->cv, &cp->mtx);
+    pthread_mutex_unlock(&cp->mtx);
+    return NULL;
+}
+
+static void compile_wait_ubf(void *arg)
+{
+    Compile *cp;
+
+    cp = arg;
+    pthread_mutex_lock(&cp->mtx);
+    cp->interrupted = 1;
+    pthread_cond_broadcast(&cp->cv);
+    pthread_mutex_unlock(&cp->mtx);
+}
+
+static VALUE eval_background_body(VALUE arg)
+{
+    struct eval_background *a;
+    VALUE r, e;
+    uint32_t n;
+    int done;
+    Ser s;
+
+    a = (void *)arg;
+    // request is (K) start background compile, see v8_compile_start
+    ser_init0(&s);
+    w_byte(&s, 'K');
+    w(&s, &a->cp, sizeof(a->cp));
+    w_byte(&s, a->flags);
+    n = RSTRING_LEN(a->filename);
+    w(&s, &n, sizeof(n));
+    w(&s, RSTRING_PTR(a->filename), n);
+    w(&s, RSTRING_PTR(a->source), RSTRING_LEN(a->source));
+    // response is [undefined, err] array
+    r = rendezvous(a->c, &s.b); // takes ownership of |s.b|
+    handle_exception(rb_ary_pop(r));
+    // the v8 thread is free to serve other ruby threads while
+    // a worker thread parses the script
+    for (;;) {
+        pthread_mutex_lock(&a->cp->mtx);
+        a->cp->interrupted = 0;
+        done = a->cp->done;
+        pthread_mutex_unlock(&a->cp->mtx);
+        if (done)
+            break;
+        rb_nogvl(compile_wait_nogvl, a->cp, compile_wait_ubf, a->cp, RB_NOGVL_INTR_FAIL);
+        rb_thread_check_ints();
+    }
+    // request is (k) finish background compile, <Compile*> <await>
+    ser_init0(&s);
+    ser_timeout(&s, a->timeout);
+    w_byte(&s, 'k');
+    w(&s, &a->cp, sizeof(a->cp));
+    w_byte(&s, a->await);
+    // response is [result, errname] array
+    r = rendezvous(a->c, &s.b); // takes ownership of |s.b|
+    e = rb_ary_pop(r);
+    handle_exception(e);
+    return rb_ary_pop(r);
+}
+
+static VALUE eval_background_ensure(VALUE arg)
+{
+    struct eval_background *a;
+
+    a = (void *)arg;
+    v8_compile_release(a->cp);
+    return Qnil;
+}
+
+// parses the script on a v8 platform worker thread, then runs it
+static VALUE context_eval_background(Context *c, VALUE filename, VALUE source,
+                                     VALUE timeout, int eager, int await)
+{
+    struct eval_background a;
+    int one_byte;
+
+    a.c = c;
+    a.timeout = timeout;
+    a.await = await;
+    a.flags = eager ? COMPILE_EAGER : 0;
+    source = str_for_v8(source, &one_byte);
+    if (one_byte)
+        a.flags |= COMPILE_ONE_BYTE;
+    filename = str_for_v8(filename, NULL);
+    if (RSTRING_LEN(filename) > UINT32_MAX)
+        rb_raise(rb_eArgError, "filename too long");
+    a.filename = filename;
+    a.source = source;
+    a.cp = malloc(sizeof(*a.cp));
+    if (!a.cp)
+        rb_raise(rb_eNoMemError, "out of memory");
+    pthread_mutex_init(&a.cp->mtx, NULL);
+    pthread_cond_init(&a.cp->cv, NULL);
+    // one for us, one for the v8 thread; leaks if the context is
+    // disposed before the v8 thread sees the request
+    a.cp->refs = 2;
+    a.cp->done = 0;
+    a.cp->interrupted = 0;
+    return rb_ensure(eval_background_body, (VALUE)&a, eval_background_ensure, (VALUE)&a);
+}
+
+static VALUE context_eval_common(int argc, VALUE *argv, VALUE self, char op)
+{
+    VALUE a, e, source, filename, timeout, compile, kwargs;
+    Context *c;
+    int eager;
+    Ser s;
+
+    TypedData_Get_Struct(self, Context, &context_type, c);
+    filename = Qnil;
+    timeout = Qnil;
+    compile = Qnil;
+    eager = 0;
+    rb_scan_args(argc, argv, "1:", &source, &kwargs);
+    Check_Type(source, T_STRING);
+    if (!NIL_P(kwargs)) {
+        filename = rb_hash_aref(kwargs, rb_id2sym(rb_intern("filename")));
+        timeout = rb_hash_aref(kwargs, rb_id2sym(rb_intern("timeout")));
+        compile = rb_hash_aref(kwargs, rb_id2sym(rb_intern("compile")));
+        eager = RTEST(rb_hash_aref(kwargs, rb_id2sym(rb_intern("eager"))));
+    }
+    if (NIL_P(filename))
+        filename = rb_str_new_cstr("<eval>");
+    Check_Type(filename, T_STRING);
+    if (!NIL_P(timeout))
+        timeout = LONG2FIX(timeout_ms(timeout));
+    if (!NIL_P(compile) && compile != rb_id2sym(rb_intern("foreground"))) {
+        if (compile != rb_id2sym(rb_intern("background")))
+            rb_raise(rb_eArgError, "bad compile option");
+        return context_eval_background(c, filename, source, timeout, eager, op == 'F');
+    }
+    ser_init0(&s);
+    ser_timeout(&s, timeout);
+    // request is (E)val or (F) eval_await, [filename, source, eager?] array
+    w_byte(&s, op);
+    w(&s, "\xFF\x0F", 2);
+    ser_array_begin(&s, 2 + eager);
+    add_string(&s, filename);
+    add_string(&s, source);
+    if (eager)
+        ser_bool(&s, 1);
+    ser_array_end(&s, 2 + eager);
+    // response is [result, errname] array
+    a = rendezvous(c, &s.b); // takes ownership of |s.b|
+    e = rb_ary_pop(a);
+    handle_exception(e);
+    return rb_ary_pop(a);
+}
+
+static VALUE context_eval(int argc, VALUE *argv, VALUE self)
 {
     return context_eval_common(argc, argv, self, 'E');
 }
@@ -1763,26 +3188,48 @@ static VALUE context_eval_await(int argc, VALUE *argv, VALUE self)
     return context_eval_common(argc, argv, self, 'F');
 }
 
+static VALUE context_load_module(int argc, VALUE *argv, VALUE self)
+{
+    VALUE a, e, name, source, resolver;
+    Context *c;
+    Ser s;
+
+    TypedData_Get_Struct(self, Context, &context_type, c);
+    rb_scan_args(argc, argv, "11&", &name, &source, &resolver);
+    Check_Type(name, T_STRING);
+    if (!NIL_P(source))
+        Check_Type(source, T_STRING);
+    // kept for later loads, imports already resolved aren't asked again
+    if (!NIL_P(resolver))
+        c->module_resolver = resolver;
+    // request is (G)et module, [name, source] array
+    ser_init1(&s, 'G');
+    ser_array_begin(&s, 2);
+    add_string(&s, name);
+    if (NIL_P(source))
+        ser_undefined(&s);
+    else
+        add_string(&s, source);
+    ser_array_end(&s, 2);
+    // response is [exports, err] array
+    a = rendezvous(c, &s.b); // takes ownership of |s.b|
+    e = rb_ary_pop(a);
+    handle_exception(e);
+    return rb_ary_pop(a);
+}
+
 static VALUE context_heap_stats(VALUE self)
 {
-    VALUE a, h, k, v;
     Context *c;
-    int i, n;
+    DesCtx d;
     Buf b;
 
     TypedData_Get_Struct(self, Context, &context_type, c);
     buf_init(&b);
-    buf_putc(&b, 'S');     // (S)tats, returns object
-    h = rendezvous(c, &b); // takes ownership of |b|
-    a = rb_ary_new();
-    rb_hash_foreach(h, collect, a);
-    for (i = 0, n = RARRAY_LENINT(a); i < n; i += 2) {
-        k = rb_ary_entry(a, i+0);
-        v = rb_ary_entry(a, i+1);
-        rb_hash_delete(h, k);
-        rb_hash_aset(h, rb_str_intern(k), v); // turn "key" into :key
-    }
-    return h;
+    buf_putc(&b, 'S');  // (S)tats, returns object
+    DesCtx_init(&d);
+    d.symbolize_keys = 1; // turn "key" into :key
+    return rendezvous1(c, &b, &d); // takes ownership of |b|
 }
 
 static VALUE buf_reset_ensure(VALUE arg)
@@ -1812,6 +3259,31 @@ static VALUE context_heap_snapshot(VALUE self)
                      buf_reset_ensure, (VALUE)&res);
 }
 
+// streams the snapshot to |fd| from the V8 thread, see write_heap_snapshot
+static VALUE context_write_heap_snapshot_fd(VALUE self, VALUE fd_v, VALUE gzip)
+{
+    Context *c;
+    int fd, err;
+    VALUE r;
+    Buf req;
+
+    TypedData_Get_Struct(self, Context, &context_type, c);
+    fd = NUM2INT(fd_v);
+    buf_init(&req);
+    buf_putc(&req, 'O');
+    buf_put(&req, &fd, sizeof(fd));
+    buf_putc(&req, RTEST(gzip));
+    r = rendezvous(c, &req); // takes ownership of |req|, returns errno
+    if (!FIXNUM_P(r))
+        rb_raise(runtime_error, "bad heap snapshot reply");
+    err = FIX2INT(r);
+    if (err == ENOTSUP)
+        rb_raise(rb_eNotImpError, "built without zlib, can't gzip");
+    if (err)
+        rb_syserr_fail(err, "write_heap_snapshot");
+    return Qnil;
+}
+
 static VALUE context_perform_microtask_checkpoint(VALUE self)
 {
     Context *c;
@@ -1823,6 +3295,26 @@ static VALUE context_perform_microtask_checkpoint(VALUE self)
     return rendezvous(c, &b); // takes ownership of |b|
 }
 
+static VALUE context_reset(VALUE self)
+{
+    Context *c;
+    VALUE e;
+    Buf b;
+
+    TypedData_Get_Struct(self, Context, &context_type, c);
+    buf_init(&b);
+    buf_putc(&b, 'N');     // (N)ew context, returns err or empty string
+    e = rendezvous(c, &b); // takes ownership of |b|
+    handle_exception(e);
+    // attached functions went with the old context,
+    // the snapshot's are back in the new one
+    if (NIL_P(c->snapshot_procs))
+        rb_ary_clear(c->procs);
+    else
+        rb_ary_replace(c->procs, c->snapshot_procs);
+    return Qnil;
+}
+
 static VALUE context_pump_message_loop(VALUE self)
 {
     Context *c;
@@ -2010,26 +3502,69 @@ static VALUE context_initialize(int argc, VALUE *argv, VALUE self)
         } else if (!strcmp(s, "marshal_stack_depth")) { // backcompat, ignored
             Check_Type(v, T_FIXNUM);
         } else if (!strcmp(s, "timeout")) {
-            Check_Type(v, T_FIXNUM);
-            c->timeout = FIX2LONG(v);
-            if (c->timeout < 0 || c->timeout > INT32_MAX)
-                rb_raise(rb_eArgError, "bad timeout");
+            c->timeout = timeout_ms(v);
         } else if (!strcmp(s, "snapshot")) {
             if (NIL_P(v))
                 continue;
             TypedData_Get_Struct(v, Snapshot, &snapshot_type, ss);
-            if (buf_put(&c->snapshot, RSTRING_PTR(ss->blob), RSTRING_LENINT(ss->blob)))
-                rb_raise(runtime_error, "out of memory");
+            // shared, not copied; warmup! swaps in a new blob
+            blob_unref(c->snapshot);
+            c->snapshot = blob_ref(ss->blob);
+            // functions attached in Snapshot.build come back with it
+            c->snapshot_procs = ss->procs;
+            if (!NIL_P(ss->procs))
+                rb_ary_replace(c->procs, ss->procs);
         } else if (!strcmp(s, "verbose_exceptions")) {
             c->verbose_exceptions = !(v == Qfalse || v == Qnil);
+        } else if (!strcmp(s, "spin")) {
+            Check_Type(v, T_FIXNUM);
+            c->spin_max = FIX2LONG(v);
+            if (c->spin_max < 0 || c->spin_max > 1000*1000)
+                rb_raise(rb_eArgError, "bad spin");
+            c->spin_max *= 1000; // microseconds -> nanoseconds
+            atomic_store(&c->call_ewma, c->spin_max / 2);
+            atomic_store(&c->idle_ewma, c->spin_max / 2);
+        } else if (!strcmp(s, "symbolize_keys")) {
+            c->symbolize_keys = RTEST(v);
+        } else if (!strcmp(s, "track_refs")) {
+            c->track_refs = RTEST(v);
+        } else if (!strcmp(s, "transport")) {
+            if (v == ID2SYM(rb_intern("ring")))
+                c->ring = 1;
+            else if (v == ID2SYM(rb_intern("mutex")))
+                c->ring = 0;
+            else
+                rb_raise(rb_eArgError, "bad transport");
+        } else if (!strcmp(s, "code_cache")) {
+            c->code_cache = RTEST(v);
+            if (!rb_obj_is_kind_of(v, code_cache_class))
+                continue;
+            v = rb_ivar_get(v, rb_intern("@dir"));
+            free(c->code_cache_dir);
+            c->code_cache_dir = strdup(StringValueCStr(v));
+            if (!c->code_cache_dir)
+                rb_raise(runtime_error, "out of memory");
         } else {
             rb_raise(runtime_error, "bad keyword: %s", s);
         }
     }
 init:
+    // the single-threaded runner is woken by |cv|, keep it on the mutex path
+    if (c->ring && !single_threaded) {
+        cause = "ring_init";
+        if ((r = ring_init(&c->to_v8)))
+            goto fail;
+        if ((r = ring_init(&c->to_ruby)))
+            goto fail;
+    } else {
+        c->ring = 0;
+    }
     if (single_threaded) {
         v8_once_init();
-        c->pst = v8_thread_init(c, c->snapshot.buf, c->snapshot.len, c->max_memory, c->verbose_exceptions);
+        c->pst = v8_thread_init(c, c->snapshot ? c->snapshot->data : NULL,
+                                c->snapshot ? c->snapshot->len : 0, c->max_memory,
+                                c->verbose_exceptions, c->code_cache, c->code_cache_dir,
+                                c->snapshot_builder);
     } else {
         cause = "pthread_attr_init";
         if ((r = pthread_attr_init(&attr)))
@@ -2056,13 +3591,19 @@ static VALUE snapshot_alloc(VALUE klass)
     Snapshot *ss;
 
     ss = ruby_xmalloc(sizeof(*ss));
-    ss->blob = rb_enc_str_new("", 0, rb_ascii8bit_encoding());
+    ss->blob = NULL;
+    ss->procs = Qnil;
+    ss->verbose_exceptions = 0;
     return TypedData_Wrap_Struct(klass, &snapshot_type, ss);
 }
 
 static void snapshot_free(void *arg)
 {
-    ruby_xfree(arg);
+    Snapshot *ss;
+
+    ss = arg;
+    blob_unref(ss->blob);
+    ruby_xfree(ss);
 }
 
 static void snapshot_mark(void *arg)
@@ -2070,7 +3611,7 @@ static void snapshot_mark(void *arg)
     Snapshot *ss;
 
     ss = arg;
-    rb_gc_mark(ss->blob);
+    rb_gc_mark(ss->procs);
 }
 
 static size_t snapshot_size(const void *arg)
@@ -2078,75 +3619,366 @@ static size_t snapshot_size(const void *arg)
     const Snapshot *ss;
 
     ss = arg;
-    return sizeof(*ss) + RSTRING_LENINT(ss->blob);
+    // mapped blobs are backed by the file, not the heap
+    if (ss->blob && ss->blob->kind != BLOB_MAPPED)
+        return sizeof(*ss) + ss->blob->len;
+    return sizeof(*ss);
+}
+
+// replaces the blob with a copy of |str|; contexts made from
+// the snapshot before keep the old one
+static void snapshot_set_blob(Snapshot *ss, VALUE str)
+{
+    Blob *b;
+
+    Check_Type(str, T_STRING);
+    b = blob_new(RSTRING_PTR(str), RSTRING_LEN(str));
+    if (!b && RSTRING_LEN(str))
+        rb_raise(runtime_error, "out of memory");
+    blob_unref(ss->blob);
+    ss->blob = b;
+}
+
+// |p| is <cause> <message>, see reply_snapshot and v8_snapshot_build
+static void raise_snapshot_error(const uint8_t *p, size_t n)
+{
+    VALUE e;
+
+    if (!n || *p == NO_ERROR)
+        rb_raise(snapshot_error, "unexpected failure");
+    e = rb_utf8_str_new((const char *)p, n);
+    raise_exception_with_message(*p == TERMINATED_ERROR ? terminated_error : snapshot_error, e);
+}
+
+// one snapshot to build, see snapshot_build_many; only touched by the
+// builder thread that picked it between snapshot_build_nogvl starting
+// and joining the builder threads
+struct snapshot_build
+{
+    Snapshot *ss;       // gets |result| once all builds succeeded
+    Blob *blob;         // warmup! only, the snapshot to start from
+    uint8_t *code;      // UTF-8, malloc'd, ruby may move string contents
+    size_t code_len;
+    int cause;
+    uint8_t *out;       // see v8_snapshot_build
+    size_t out_len;
+    Blob *result;
+};
+
+struct snapshot_builds
+{
+    struct snapshot_build *b;
+    long n;
+    atomic_long next;   // index of the next build to pick
+    int warmup, verbose_exceptions;
+    int err;            // errno from pthread_create when no builder started
+    struct SnapshotJob *job;
+};
+
+// builder thread, picks builds until there are none left
+static void *snapshot_build_do(void *arg)
+{
+    struct snapshot_builds *a;
+    struct snapshot_build *b;
+    long i;
+
+    a = arg;
+    while ((i = atomic_fetch_add(&a->next, 1)) < a->n) {
+        b = &a->b[i];
+        b->cause = v8_snapshot_build(a->job, a->warmup, a->verbose_exceptions,
+                                     b->blob ? b->blob->data : NULL,
+                                     b->blob ? b->blob->len : 0, b->code,
+                                     b->code_len, &b->out, &b->out_len);
+    }
+    return NULL;
+}
+
+// builds snapshots on threads that only own a SnapshotCreator's isolate,
+// one per CPU at most; in single-threaded mode one after another on this
+// thread instead
+static void *snapshot_build_nogvl(void *arg)
+{
+    struct snapshot_builds *a;
+    pthread_attr_t attr;
+    pthread_t *thr;
+    long i, n;
+    int r;
+
+    a = arg;
+    v8_once_init();
+    if (single_threaded)
+        return snapshot_build_do(a);
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)
+        n = 1;
+    if (n > a->n)
+        n = a->n;
+    thr = malloc((n ? n : 1) * sizeof(*thr));
+    if (!thr) {
+        a->err = ENOMEM;
+        return NULL;
+    }
+    if ((r = pthread_attr_init(&attr))) {
+        a->err = r;
+        goto out;
+    }
+    pthread_attr_setstacksize(&attr, 2<<20); // 2 MiB, like v8 threads
+    for (i = 0; i < n; i++)
+        if ((r = pthread_create(&thr[i], &attr, snapshot_build_do, a)))
+            break;
+    // the ones that did start pick up the rest
+    if (!i && n)
+        a->err = r;
+    n = i;
+    for (i = 0; i < n; i++)
+        pthread_join(thr[i], NULL);
+    pthread_attr_destroy(&attr);
+out:
+    free(thr);
+    return NULL;
+}
+
+// ruby interrupt, terminates the builds that run and fails the rest
+static void snapshot_build_ubf(void *arg)
+{
+    struct snapshot_builds *a;
+
+    a = arg;
+    v8_snapshot_job_cancel(a->job);
+}
+
+static VALUE snapshot_build_body(VALUE arg)
+{
+    struct snapshot_builds *a;
+    struct snapshot_build *b;
+    long i;
+
+    a = (void *)arg;
+    rb_nogvl(snapshot_build_nogvl, a, snapshot_build_ubf, a, 0);
+    // raises if the builds were cancelled because of a pending interrupt
+    rb_thread_check_ints();
+    if (a->err)
+        rb_raise(runtime_error, "pthread_create: %s", strerror(a->err));
+    // failures are reported once every build is done
+    for (i = 0; i < a->n; i++) {
+        b = &a->b[i];
+        if (b->cause != NO_ERROR)
+            raise_snapshot_error(b->out, b->out_len);
+    }
+    for (i = 0; i < a->n; i++) {
+        b = &a->b[i];
+        b->result = blob_adopt(b->out, b->out_len);
+        b->out = NULL; // freed by blob_adopt on error
+        if (!b->result)
+            rb_raise(rb_eNoMemError, "out of memory");
+    }
+    for (i = 0; i < a->n; i++) {
+        b = &a->b[i];
+        blob_unref(b->ss->blob);
+        b->ss->blob = b->result;
+        b->result = NULL;
+    }
+    return Qnil;
+}
+
+static VALUE snapshot_build_ensure(VALUE arg)
+{
+    struct snapshot_builds *a;
+    struct snapshot_build *b;
+    long i;
+
+    a = (void *)arg;
+    for (i = 0; i < a->n; i++) {
+        b = &a->b[i];
+        blob_unref(b->blob);
+        blob_unref(b->result);
+        free(b->code);
+        if (b->out)
+            v8_snapshot_free(b->out);
+    }
+    free(a->b);
+    if (a->job)
+        v8_snapshot_job_free(a->job);
+    return Qnil;
+}
+
+// builds a snapshot from each of |codes| (UTF-8, see str_for_v8) into the
+// Snapshot at the same index of |snapshots|, starting from its current
+// blob if |warmup|; raises the first error, if any, and leaves all of
+// |snapshots| untouched then
+static void snapshot_build_many(const VALUE *snapshots, const VALUE *codes, long n,
+                                int warmup, int verbose_exceptions)
+{
+    struct snapshot_builds a;
+    struct snapshot_build *b;
+    long i;
+
+    memset(&a, 0, sizeof(a));
+    a.n = n;
+    a.warmup = warmup;
+    a.verbose_exceptions = verbose_exceptions;
+    atomic_init(&a.next, 0);
+    a.b = calloc(n ? n : 1, sizeof(*a.b));
+    if (!a.b)
+        rb_raise(rb_eNoMemError, "out of memory");
+    a.job = v8_snapshot_job_new();
+    for (i = 0; i < n; i++) {
+        b = &a.b[i];
+        b->ss = rb_check_typeddata(snapshots[i], &snapshot_type);
+        b->code_len = RSTRING_LEN(codes[i]);
+        b->code = malloc(b->code_len ? b->code_len : 1);
+        if (!b->code) {
+            snapshot_build_ensure((VALUE)&a);
+            rb_raise(rb_eNoMemError, "out of memory");
+        }
+        memcpy(b->code, RSTRING_PTR(codes[i]), b->code_len);
+        // a reference of our own, another thread can swap in
+        // a new blob while this one is read from
+        if (warmup)
+            b->blob = blob_ref(b->ss->blob);
+    }
+    rb_ensure(snapshot_build_body, (VALUE)&a, snapshot_build_ensure, (VALUE)&a);
+}
+
+// verbose_exceptions: keyword argument of Snapshot.new and .build_many
+static int snapshot_verbose_exceptions(VALUE kwargs)
+{
+    VALUE v;
+
+    if (NIL_P(kwargs))
+        return 0;
+    v = rb_hash_aref(kwargs, rb_id2sym(rb_intern("verbose_exceptions")));
+    return !(v == Qfalse || v == Qnil);
 }
 
 static VALUE snapshot_initialize(int argc, VALUE *argv, VALUE self)
 {
-    VALUE a, e, code, cv;
+    VALUE code, kwargs;
     Snapshot *ss;
-    Context *c;
-    DesCtx d;
-    Ser s;
 
     TypedData_Get_Struct(self, Snapshot, &snapshot_type, ss);
-    rb_scan_args(argc, argv, "01", &code);
+    rb_scan_args(argc, argv, "01:", &code, &kwargs);
     if (NIL_P(code))
         code = rb_str_new_cstr("");
-    Check_Type(code, T_STRING);
-    cv = context_alloc(context_class);
-    context_initialize(0, NULL, cv);
-    TypedData_Get_Struct(cv, Context, &context_type, c);
-    // request is snapsho(T), "code"
-    ser_init1(&s, 'T');
-    add_string(&s, code);
-    // response is [arraybuffer, error]
-    DesCtx_init(&d);
-    d.transcode_latin1 = 0; // don't mangle snapshot binary data
-    a = rendezvous1(c, &s.b, &d);
-    e = rb_ary_pop(a);
-    context_dispose(cv);
-    raise_exception_with_message(snapshot_error, e);
-    ss->blob = rb_ary_pop(a);
+    code = str_for_v8(code, NULL);
+    ss->verbose_exceptions = snapshot_verbose_exceptions(kwargs);
+    snapshot_build_many(&self, &code, 1, /*warmup*/0, ss->verbose_exceptions);
     return Qnil;
 }
 
-static VALUE snapshot_warmup(VALUE self, VALUE arg)
+static VALUE snapshot_warmup(VALUE self, VALUE code)
 {
-    VALUE a, e, cv;
     Snapshot *ss;
-    Context *c;
-    DesCtx d;
-    Ser s;
 
     TypedData_Get_Struct(self, Snapshot, &snapshot_type, ss);
-    Check_Type(arg, T_STRING);
-    cv = context_alloc(context_class);
-    context_initialize(0, NULL, cv);
-    TypedData_Get_Struct(cv, Context, &context_type, c);
-    // request is (W)armup, [snapshot, "warmup code"]
-    ser_init1(&s, 'W');
-    ser_array_begin(&s, 2);
-    ser_string8(&s, (const uint8_t *)RSTRING_PTR(ss->blob), RSTRING_LENINT(ss->blob));
-    add_string(&s, arg);
-    ser_array_end(&s, 2);
-    // response is [arraybuffer, error]
-    DesCtx_init(&d);
-    d.transcode_latin1 = 0; // don't mangle snapshot binary data
-    a = rendezvous1(c, &s.b, &d);
-    e = rb_ary_pop(a);
-    context_dispose(cv);
-    raise_exception_with_message(snapshot_error, e);
-    ss->blob = rb_ary_pop(a);
+    code = str_for_v8(code, NULL);
+    snapshot_build_many(&self, &code, 1, /*warmup*/1, ss->verbose_exceptions);
     return self;
 }
 
+// Snapshot.build_many(["code", ...], verbose_exceptions: false) builds
+// the snapshots in parallel, returns them in the same order
+static VALUE snapshot_s_build_many(int argc, VALUE *argv, VALUE klass)
+{
+    VALUE sources, kwargs, codes, snapshots;
+    int verbose_exceptions;
+    Snapshot *ss;
+    long i, n;
+
+    rb_scan_args(argc, argv, "1:", &sources, &kwargs);
+    Check_Type(sources, T_ARRAY);
+    verbose_exceptions = snapshot_verbose_exceptions(kwargs);
+    n = RARRAY_LEN(sources);
+    codes = rb_ary_new_capa(n);
+    snapshots = rb_ary_new_capa(n);
+    for (i = 0; i < n; i++) {
+        rb_ary_push(codes, str_for_v8(RARRAY_AREF(sources, i), NULL));
+        rb_ary_push(snapshots, snapshot_alloc(klass));
+        TypedData_Get_Struct(RARRAY_AREF(snapshots, i), Snapshot, &snapshot_type, ss);
+        ss->verbose_exceptions = verbose_exceptions;
+    }
+    snapshot_build_many(RARRAY_CONST_PTR(snapshots), RARRAY_CONST_PTR(codes), n,
+                        /*warmup*/0, verbose_exceptions);
+    RB_GC_GUARD(codes);
+    return snapshots;
+}
+
+struct snapshot_builder
+{
+    VALUE self, context;
+};
+
+static VALUE snapshot_builder_body(VALUE arg)
+{
+    struct snapshot_builder *a;
+    Buf req, res;
+    Snapshot *ss;
+    Context *c;
+    VALUE e;
+    Blob *b;
+
+    a = (void *)arg;
+    TypedData_Get_Struct(a->self, Snapshot, &snapshot_type, ss);
+    TypedData_Get_Struct(a->context, Context, &context_type, c);
+    rb_yield(a->context);
+    buf_init(&req);
+    buf_putc(&req, 'Z');     // seal, returns err or empty string
+    e = rendezvous(c, &req); // takes ownership of |req|
+    handle_exception(e);
+    buf_init(&req);
+    buf_putc(&req, 'z'); // returns <cause> <blob or error message>
+    rendezvous_no_des(c, &req, &res);
+    if (!res.len || *res.buf != NO_ERROR) {
+        e = rb_str_new((char *)res.buf, res.len);
+        buf_reset(&res);
+        raise_snapshot_error((uint8_t *)RSTRING_PTR(e), RSTRING_LEN(e));
+    }
+    b = blob_new(res.buf+1, res.len-1);
+    buf_reset(&res);
+    if (!b)
+        rb_raise(rb_eNoMemError, "out of memory");
+    ss->blob = b;
+    ss->procs = rb_obj_freeze(rb_ary_dup(c->procs));
+    ss->verbose_exceptions = c->verbose_exceptions;
+    return a->self;
+}
+
+static VALUE snapshot_builder_ensure(VALUE arg)
+{
+    struct snapshot_builder *a;
+
+    a = (void *)arg;
+    return context_dispose(a->context);
+}
+
+// Snapshot.build(**context_options) { |context| ... } snapshots what the
+// block leaves in |context|, which lives in the SnapshotCreator's isolate;
+// functions attached in the block work in contexts made from the snapshot
+// without attaching them again
+static VALUE snapshot_s_build(int argc, VALUE *argv, VALUE klass)
+{
+    struct snapshot_builder a;
+    Context *c;
+
+    rb_need_block();
+    a.self = snapshot_alloc(klass);
+    a.context = context_alloc(context_class);
+    TypedData_Get_Struct(a.context, Context, &context_type, c);
+    c->snapshot_builder = 1;
+    context_initialize(argc, argv, a.context);
+    return rb_ensure(snapshot_builder_body, (VALUE)&a,
+                     snapshot_builder_ensure, (VALUE)&a);
+}
+
 static VALUE snapshot_dump(VALUE self)
 {
     Snapshot *ss;
 
     TypedData_Get_Struct(self, Snapshot, &snapshot_type, ss);
-    return ss->blob;
+    if (!ss->blob)
+        return rb_enc_str_new("", 0, rb_ascii8bit_encoding());
+    return rb_enc_str_new((const char *)ss->blob->data, ss->blob->len,
+                          rb_ascii8bit_encoding());
 }
 
 static VALUE snapshot_load(VALUE klass, VALUE blob)
@@ -2157,9 +3989,30 @@ static VALUE snapshot_load(VALUE klass, VALUE blob)
     Check_Type(blob, T_STRING);
     self = snapshot_alloc(klass);
     TypedData_Get_Struct(self, Snapshot, &snapshot_type, ss);
-    ss->blob = rb_str_dup(blob);
-    rb_enc_associate(ss->blob, rb_ascii8bit_encoding());
-    ENC_CODERANGE_SET(ss->blob, ENC_CODERANGE_VALID);
+    snapshot_set_blob(ss, blob);
+    return self;
+}
+
+// like Snapshot.load but maps the file instead of reading it into memory;
+// contexts made from the snapshot share the mapping
+static VALUE snapshot_mmap(VALUE klass, VALUE path)
+{
+    Snapshot *ss;
+    VALUE self;
+    Blob *b;
+    int fd, r;
+
+    FilePathValue(path);
+    self = snapshot_alloc(klass);
+    TypedData_Get_Struct(self, Snapshot, &snapshot_type, ss);
+    fd = rb_cloexec_open(StringValueCStr(path), O_RDONLY, 0);
+    if (fd < 0)
+        rb_sys_fail_str(path);
+    r = blob_mmap(fd, &b);
+    close(fd);
+    if (r)
+        rb_syserr_fail_str(r, path);
+    ss->blob = b;
     return self;
 }
 
@@ -2168,7 +4021,258 @@ static VALUE snapshot_size0(VALUE self)
     Snapshot *ss;
 
     TypedData_Get_Struct(self, Snapshot, &snapshot_type, ss);
-    return LONG2FIX(RSTRING_LENINT(ss->blob));
+    return SIZET2NUM(ss->blob ? ss->blob->len : 0);
+}
+
+static VALUE code_cache_stats(VALUE klass)
+{
+    struct CodeCacheStats st;
+    VALUE h;
+
+    (void)&klass;
+    v8_code_cache_stats(&st);
+    h = rb_hash_new();
+    rb_hash_aset(h, ID2SYM(rb_intern("hits")), ULL2NUM(st.hits));
+    rb_hash_aset(h, ID2SYM(rb_intern("misses")), ULL2NUM(st.misses));
+    rb_hash_aset(h, ID2SYM(rb_intern("rejected")), ULL2NUM(st.rejected));
+    rb_hash_aset(h, ID2SYM(rb_intern("entries")), ULL2NUM(st.entries));
+    rb_hash_aset(h, ID2SYM(rb_intern("bytes")), ULL2NUM(st.bytes));
+    rb_hash_aset(h, ID2SYM(rb_intern("disk_hits")), ULL2NUM(st.disk_hits));
+    rb_hash_aset(h, ID2SYM(rb_intern("disk_writes")), ULL2NUM(st.disk_writes));
+    return h;
+}
+
+static VALUE code_cache_clear(VALUE klass)
+{
+    (void)&klass;
+    v8_code_cache_clear();
+    return Qnil;
+}
+
+static void pool_mark(void *arg)
+{
+    Pool *p;
+
+    p = arg;
+    rb_gc_mark(p->idle);
+    rb_gc_mark(p->kwargs);
+}
+
+static size_t pool_size(const void *arg)
+{
+    const Pool *p = arg;
+    return sizeof(*p);
+}
+
+static VALUE pool_alloc(VALUE klass)
+{
+    Pool *p;
+
+    p = ruby_xmalloc(sizeof(*p));
+    memset(p, 0, sizeof(*p));
+    p->idle = Qnil;
+    p->kwargs = Qnil;
+    return TypedData_Wrap_Struct(klass, &pool_type, p);
+}
+
+static VALUE pool_new_context(VALUE self)
+{
+    VALUE kwargs, ctx;
+    Context *c;
+    Pool *p;
+
+    TypedData_Get_Struct(self, Pool, &pool_type, p);
+    kwargs = p->kwargs;
+    if (RHASH_SIZE(kwargs) == 0)
+        ctx = rb_class_new_instance(0, NULL, context_class);
+    else
+        ctx = rb_class_new_instance_kw(1, &kwargs, context_class, RB_PASS_KEYWORDS);
+    TypedData_Get_Struct(ctx, Context, &context_type, c);
+    c->track_heap = (p->max_heap != 0);
+    return ctx;
+}
+
+// runs on a ruby thread of its own so checkouts don't wait for isolate
+// creation; a failure is handed to the next checkout as an exception
+static VALUE pool_replace(void *arg)
+{
+    VALUE self, v;
+    Pool *p;
+    int exc;
+
+    self = (VALUE)arg;
+    TypedData_Get_Struct(self, Pool, &pool_type, p);
+    v = rb_protect(pool_new_context, self, &exc);
+    if (exc) {
+        v = rb_errinfo();
+        rb_set_errinfo(Qnil);
+    } else {
+        p->created++;
+    }
+    if (p->closed) {
+        if (!exc)
+            context_dispose(v);
+        return Qnil;
+    }
+    rb_funcall(p->idle, rb_intern("push"), 1, v);
+    return Qnil;
+}
+
+static VALUE pool_initialize(int argc, VALUE *argv, VALUE self)
+{
+    VALUE kwargs, a, k, v, q;
+    Pool *p;
+    char *s;
+    long i;
+
+    TypedData_Get_Struct(self, Pool, &pool_type, p);
+    rb_scan_args(argc, argv, ":", &kwargs);
+    p->size = 1;
+    p->kwargs = rb_hash_new();
+    if (!NIL_P(kwargs)) {
+        a = rb_ary_new();
+        rb_hash_foreach(kwargs, collect, a);
+        while (RARRAY_LENINT(a)) {
+            v = rb_ary_pop(a);
+            k = rb_ary_pop(a);
+            s = RSTRING_PTR(rb_sym2str(k));
+            if (!strcmp(s, "size")) {
+                Check_Type(v, T_FIXNUM);
+                p->size = FIX2LONG(v);
+                if (p->size < 1 || p->size > 1024)
+                    rb_raise(rb_eArgError, "bad size");
+            } else if (!strcmp(s, "max_calls")) {
+                if (NIL_P(v))
+                    continue;
+                Check_Type(v, T_FIXNUM);
+                p->max_calls = FIX2LONG(v);
+                if (p->max_calls < 0)
+                    rb_raise(rb_eArgError, "bad max_calls");
+            } else if (!strcmp(s, "max_heap")) {
+                if (NIL_P(v))
+                    continue;
+                p->max_heap = NUM2LL(v);
+                if (p->max_heap < 0)
+                    rb_raise(rb_eArgError, "bad max_heap");
+            } else {
+                rb_hash_aset(p->kwargs, k, v); // for Context#initialize
+            }
+        }
+    }
+    rb_obj_freeze(p->kwargs);
+    q = rb_const_get(rb_cThread, rb_intern("Queue"));
+    p->idle = rb_class_new_instance(0, NULL, q);
+    // prewarm synchronously so bad options raise here and the
+    // first checkouts don't wait for isolate creation
+    for (i = 0; i < p->size; i++) {
+        rb_funcall(p->idle, rb_intern("push"), 1, pool_new_context(self));
+        p->created++;
+    }
+    return Qnil;
+}
+
+static VALUE pool_checkout(VALUE self)
+{
+    int64_t t;
+    Pool *p;
+    VALUE v;
+
+    TypedData_Get_Struct(self, Pool, &pool_type, p);
+    if (p->closed)
+        rb_raise(context_disposed_error, "closed context pool");
+    t = clock_ns();
+    v = rb_funcall(p->idle, rb_intern("pop"), 0); // blocks while empty
+    p->wait_ns += clock_ns() - t;
+    p->checkouts++;
+    if (NIL_P(v)) // queue closed while waiting
+        rb_raise(context_disposed_error, "closed context pool");
+    if (rb_obj_is_kind_of(v, rb_eException)) {
+        rb_thread_create(pool_replace, (void *)self); // try again
+        rb_exc_raise(v);
+    }
+    return v;
+}
+
+// |err| is the exception that escaped the block or Qnil
+static void pool_checkin(VALUE self, VALUE ctx, VALUE err)
+{
+    Context *c;
+    int recycle;
+    Pool *p;
+
+    TypedData_Get_Struct(self, Pool, &pool_type, p);
+    TypedData_Get_Struct(ctx, Context, &context_type, c);
+    recycle = atomic_load(&c->quit)
+           || rb_obj_is_kind_of(err, memory_error)
+           || (p->max_calls && c->calls >= (uint64_t)p->max_calls)
+           || (p->max_heap && atomic_load(&c->used_heap) > p->max_heap);
+    if (p->closed) {
+        context_dispose(ctx);
+        return;
+    }
+    if (!recycle) {
+        rb_funcall(p->idle, rb_intern("push"), 1, ctx);
+        return;
+    }
+    p->recycles++;
+    context_dispose(ctx);
+    rb_thread_create(pool_replace, (void *)self);
+}
+
+static VALUE pool_yield(VALUE ctx)
+{
+    return rb_yield(ctx);
+}
+
+static VALUE pool_with(VALUE self)
+{
+    VALUE ctx, r, err;
+    int exc;
+
+    rb_need_block();
+    ctx = pool_checkout(self);
+    r = rb_protect(pool_yield, ctx, &exc);
+    err = exc ? rb_errinfo() : Qnil;
+    pool_checkin(self, ctx, err);
+    if (exc)
+        rb_jump_tag(exc);
+    return r;
+}
+
+static VALUE pool_stats(VALUE self)
+{
+    Pool *p;
+    VALUE h;
+
+    TypedData_Get_Struct(self, Pool, &pool_type, p);
+    h = rb_hash_new();
+    rb_hash_aset(h, ID2SYM(rb_intern("size")), LONG2NUM(p->size));
+    rb_hash_aset(h, ID2SYM(rb_intern("idle")), rb_funcall(p->idle, rb_intern("size"), 0));
+    rb_hash_aset(h, ID2SYM(rb_intern("waiters")), rb_funcall(p->idle, rb_intern("num_waiting"), 0));
+    rb_hash_aset(h, ID2SYM(rb_intern("checkouts")), ULL2NUM(p->checkouts));
+    rb_hash_aset(h, ID2SYM(rb_intern("wait_time")), DBL2NUM(p->wait_ns / 1e9));
+    rb_hash_aset(h, ID2SYM(rb_intern("recycles")), ULL2NUM(p->recycles));
+    rb_hash_aset(h, ID2SYM(rb_intern("created")), ULL2NUM(p->created));
+    return h;
+}
+
+// disposes idle contexts now and checked out ones when they come back
+static VALUE pool_shutdown(VALUE self)
+{
+    Pool *p;
+    VALUE v;
+
+    TypedData_Get_Struct(self, Pool, &pool_type, p);
+    if (p->closed)
+        return Qnil;
+    p->closed = 1;
+    rb_funcall(p->idle, rb_intern("close"), 0); // wakes up waiters
+    while (RTEST(rb_funcall(p->idle, rb_intern("size"), 0))) {
+        v = rb_funcall(p->idle, rb_intern("pop"), 0);
+        if (rb_obj_is_kind_of(v, context_class))
+            context_dispose(v);
+    }
+    return Qnil;
 }
 
 static VALUE script_error_cause(VALUE self)
@@ -2204,12 +4308,17 @@ void Init_mini_racer_extension(void)
     rb_define_method(c, "stop", context_stop, 0);
     rb_define_method(c, "call", context_call, -1);
     rb_define_method(c, "call_await", context_call_await, -1);
+    rb_define_method(c, "call_many", context_call_many, 1);
+    rb_define_method(c, "function", context_function, 1);
     rb_define_method(c, "eval", context_eval, -1);
     rb_define_method(c, "eval_await", context_eval_await, -1);
+    rb_define_method(c, "load_module", context_load_module, -1);
     rb_define_method(c, "heap_stats", context_heap_stats, 0);
     rb_define_method(c, "heap_snapshot", context_heap_snapshot, 0);
+    rb_define_private_method(c, "write_heap_snapshot_fd", context_write_heap_snapshot_fd, 2);
     rb_define_method(c, "perform_microtask_checkpoint", context_perform_microtask_checkpoint, 0);
     rb_define_method(c, "pump_message_loop", context_pump_message_loop, 0);
+    rb_define_method(c, "reset!", context_reset, 0);
     rb_define_method(c, "low_memory_notification", context_low_memory_notification, 0);
     rb_define_alloc_func(c, context_alloc);
 
@@ -2219,12 +4328,33 @@ void Init_mini_racer_extension(void)
     rb_define_method(c, "dump", snapshot_dump, 0);
     rb_define_method(c, "size", snapshot_size0, 0);
     rb_define_singleton_method(c, "load", snapshot_load, 1);
+    rb_define_singleton_method(c, "mmap", snapshot_mmap, 1);
+    rb_define_singleton_method(c, "build_many", snapshot_s_build_many, -1);
+    rb_define_singleton_method(c, "build", snapshot_s_build, -1);
     rb_define_alloc_func(c, snapshot_alloc);
 
+    c = code_cache_class = rb_define_class_under(m, "CodeCache", rb_cObject);
+    rb_define_singleton_method(c, "stats", code_cache_stats, 0);
+    rb_define_singleton_method(c, "clear", code_cache_clear, 0);
+
+    c = function_handle_class = rb_define_class_under(m, "FunctionHandle", rb_cObject);
+    rb_define_method(c, "call", function_handle_call, -1);
+    rb_define_method(c, "call_await", function_handle_call_await, -1);
+    rb_define_method(c, "dispose", function_handle_dispose, 0);
+
+    c = rb_define_class_under(m, "ContextPool", rb_cObject);
+    rb_define_method(c, "initialize", pool_initialize, -1);
+    rb_define_method(c, "with", pool_with, 0);
+    rb_define_method(c, "stats", pool_stats, 0);
+    rb_define_method(c, "shutdown", pool_shutdown, 0);
+    rb_define_alloc_func(c, pool_alloc);
+
     c = rb_define_class_under(m, "Platform", rb_cObject);
     rb_define_singleton_method(c, "set_flags!", platform_set_flags, -1);
 
     date_time_class = Qnil; // lazy init
     binary_class = Qnil; // lazy init
+    typed_array_class = Qnil; // lazy init
     js_function_class = rb_define_class_under(m, "JavaScriptFunction", rb_cObject);
+    utf16le_encoding = rb_enc_find("UTF-16LE");
 }
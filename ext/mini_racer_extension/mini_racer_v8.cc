@@ -2,8 +2,15 @@
 #include "v8-profiler.h"
 #include "libplatform/libplatform.h"
 #include "mini_racer_v8.h"
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <cassert>
 #include <cstdarg>
@@ -12,14 +19,24 @@
 #include <cstdlib>
 #include <cstring>
 #include <limits>
+#include <string>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
 
 // note: the filter function gets called inside the safe context,
 // i.e., the context that has not been tampered with by user JS
 // convention: $-prefixed identifiers signify objects from the
 // user JS context and should be handled with special care
 static const char safe_context_script_source[] = R"js(
-;(function($globalThis) {
-    const {Map: $Map, Set: $Set} = $globalThis
+;(function($globals) {
+    const {Map: $Map, Set: $Set} = $globals
     const sentinel = {}
     return function filter(v) {
         if (typeof v === "function")
@@ -63,10 +80,26 @@ static const char safe_context_script_source[] = R"js(
 })
 )js";
 
-struct Callback
+// a function and its receiver, resolved once by Context#function
+struct FunctionHandle
 {
-    struct State *st;
-    int32_t id;
+    v8::Global<v8::Function> function;
+    v8::Global<v8::Object> recv;
+};
+
+// a script compiled by v8_compile_start; streamed ones are parsed on
+// a platform worker thread, the rest on the v8 thread by v8_compile_finish
+struct BackgroundCompile
+{
+    std::unique_ptr<v8::ScriptCompiler::StreamedSource> source;
+    std::unique_ptr<v8::ScriptCompiler::ScriptStreamingTask> task;
+    v8::Global<v8::String> full_source;
+    v8::Global<v8::String> filename;
+    struct Compile *cp;
+    uint64_t key; // code cache key or 0
+    bool eager;
+    bool done; // protected by State::compile_mtx
+    ~BackgroundCompile() { v8_compile_release(cp); }
 };
 
 enum : unsigned
@@ -87,13 +120,14 @@ struct State
     // declaring as Local is safe because we take special care
     // to ensure it's rooted in a HandleScope before being used
     v8::Local<v8::Context> context;
-    // extra context for when we need access to built-ins like Array
-    // and want to be sure they haven't been tampered with by JS code
-    v8::Local<v8::Context> safe_context;
-    v8::Local<v8::Function> safe_context_function;
+    // extra context for when we need access to built-ins like Map
+    // and want to be sure they haven't been tampered with by JS code;
+    // only needed when a reply fails to serialize, see filter_function()
+    v8::Persistent<v8::Context> safe_context;
+    v8::Persistent<v8::Function> safe_context_function;
+    // the user context's Map and Set before user code got to run
+    v8::Persistent<v8::Value> user_map, user_set;
     v8::Persistent<v8::Context> persistent_context;         // single-thread mode only
-    v8::Persistent<v8::Context> persistent_safe_context;    // single-thread mode only
-    v8::Persistent<v8::Function> persistent_safe_context_function;  // single-thread mode only
     v8::Persistent<v8::Value> ruby_exception;
     Context *ruby_context;
     int64_t max_memory;
@@ -107,11 +141,53 @@ struct State
     // instead of deadlocking and nested pumps preserve outer termination.
     int javascript_call_depth;
     bool verbose_exceptions;
-    std::vector<Callback*> callbacks;
+    bool code_cache;
+    // mixed into code cache keys; cached code is only valid for the
+    // snapshot the isolate was created from
+    uint64_t code_cache_salt;
+    std::string code_cache_dir; // empty if not persisted to disk
+    std::vector<FunctionHandle> functions;
+    std::vector<int32_t> free_functions; // slots of disposed handles
+    // tags the functions attached to the current context, see
+    // v8_api_callback; new with every context
+    uint32_t epoch;
+    int32_t callbacks; // highest callback id attached to it, plus one
+    // the functions Snapshot.build attached, ids below |snapshot_callbacks|
+    uint32_t snapshot_epoch;
+    int32_t snapshot_callbacks;
+    // in-flight background compiles, v8 thread only; worker threads
+    // flip BackgroundCompile::done and decrement |compiles_running|
+    // with |compile_mtx| held and then signal |compile_cv|
+    std::unordered_map<struct Compile*, std::unique_ptr<BackgroundCompile>> compiles;
+    // ES modules of the current context by name, see v8_load_module;
+    // |module_names| maps identity hashes back to names, |module_imports|
+    // caches the resolver's answers by "referrer\0specifier"
+    std::unordered_map<std::string, v8::Global<v8::Module>> modules;
+    std::unordered_multimap<int, std::string> module_names;
+    std::unordered_map<std::string, std::string> module_imports;
+    std::mutex compile_mtx;
+    std::condition_variable compile_cv;
+    int compiles_running;
     std::unique_ptr<v8::ArrayBuffer::Allocator> allocator;
+    // Snapshot.build only; the creator doesn't own the isolate, see
+    // ~State(); once v8_snapshot_seal has run there is no context left
+    // and |snapshot_blob| holds the result of CreateBlob
+    std::unique_ptr<v8::SnapshotCreator> snapshot_creator;
+    bool snapshot_requested;
+    v8::StartupData snapshot_blob;
     inline ~State();
 };
 
+// the builds of one Snapshot.build_many (or Snapshot.new or warmup!) call;
+// cancelling terminates the ones that run and fails the ones that haven't
+// started, see v8_snapshot_job_cancel
+struct SnapshotJob
+{
+    std::mutex mtx;
+    std::vector<v8::Isolate*> isolates; // builds in progress
+    bool cancelled = false;
+};
+
 namespace {
 
 // deliberately leaked on program exit,
@@ -139,6 +215,268 @@ struct Serialized
     }
 };
 
+bool write_all(int fd, const void *data, size_t n)
+{
+    auto p = static_cast<const uint8_t*>(data);
+    while (n > 0) {
+        ssize_t k = write(fd, p, n);
+        if (k < 0 && errno == EINTR) continue;
+        if (k <= 0) return false;
+        p += k;
+        n -= k;
+    }
+    return true;
+}
+
+// not a cryptographic hash, only used for code cache keys
+uint64_t hash64(const void *data, size_t n, uint64_t h)
+{
+    const uint64_t k = 0x9E3779B97F4A7C15ull;
+    auto p = static_cast<const uint8_t*>(data);
+    for (; n >= 8; n -= 8, p += 8) {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * k;
+        h ^= h >> 29;
+    }
+    for (; n > 0; n--, p++)
+        h = (h ^ *p) * k;
+    h ^= h >> 32;
+    return h;
+}
+
+// immutable compiled code, either owned bytes or a read-only file mapping
+struct CodeCacheEntry
+{
+    std::vector<uint8_t> bytes;
+    void *map = nullptr;
+    size_t map_size = 0;
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+    CodeCacheEntry(const uint8_t *p, size_t n) : bytes(p, p + n)
+    {
+        data = bytes.data();
+        size = bytes.size();
+    }
+
+    CodeCacheEntry(void *map, size_t map_size, size_t offset)
+        : map(map), map_size(map_size)
+    {
+        data = static_cast<const uint8_t*>(map) + offset;
+        size = map_size - offset;
+    }
+
+    ~CodeCacheEntry()
+    {
+        if (map) munmap(map, map_size);
+    }
+};
+
+// process-wide cache of compiled scripts, shared by every context
+// that opts in with `code_cache:`; entries are immutable and reference
+// counted so compilation can proceed without holding |mtx|; evicts
+// the least recently used entries first
+struct CodeCache
+{
+    typedef std::shared_ptr<const CodeCacheEntry> Entry;
+
+    struct Slot
+    {
+        Entry entry;
+        std::list<uint64_t>::iterator pos; // in |order|
+    };
+
+    // caching tiny scripts costs more than it saves
+    static constexpr size_t min_source_size = 1024;
+    static constexpr size_t max_bytes = 64 << 20;
+
+    std::mutex mtx;
+    std::unordered_map<uint64_t, Slot> entries; // protected by |mtx|
+    std::list<uint64_t> order;  // protected by |mtx|, least recently used first
+    size_t bytes = 0;           // protected by |mtx|
+    uint64_t salt = 0;          // V8 version and flags, set once at init
+    std::atomic<uint64_t> hits{0}, misses{0}, rejected{0};
+    std::atomic<uint64_t> disk_hits{0}, disk_writes{0};
+
+    Entry get(uint64_t key)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = entries.find(key);
+        if (it == entries.end()) return Entry();
+        order.splice(order.end(), order, it->second.pos);
+        return it->second.entry;
+    }
+
+    void put(uint64_t key, Entry entry)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        erase_locked(key);
+        if (entry->size > max_bytes) return;
+        while (bytes + entry->size > max_bytes && !order.empty())
+            erase_locked(order.front());
+        bytes += entry->size;
+        auto pos = order.insert(order.end(), key);
+        entries.emplace(key, Slot{std::move(entry), pos});
+    }
+
+    void erase(uint64_t key)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        erase_locked(key);
+    }
+
+    void erase_locked(uint64_t key)
+    {
+        auto it = entries.find(key);
+        if (it == entries.end()) return;
+        bytes -= it->second.entry->size;
+        order.erase(it->second.pos);
+        entries.erase(it);
+    }
+};
+
+// deliberately leaked, V8 threads of detached contexts
+// can still be using it after main() returns
+CodeCache& code_cache = *new CodeCache;
+
+// on-disk layout of a MiniRacer::CodeCache file, followed by the code;
+// 40 bytes so the code that follows stays pointer aligned when mapped
+struct CodeCacheFileHeader
+{
+    char magic[8];
+    uint64_t salt;      // V8 version and flags of the writer
+    uint64_t key;
+    uint64_t size;      // of the code that follows
+    uint64_t checksum;  // of the code that follows
+};
+
+const char code_cache_magic[8] = {'M', 'R', 'C', 'C', 0, 0, 0, 1};
+
+std::string code_cache_path(const std::string& dir, uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.v8cc", static_cast<unsigned long long>(key));
+    return dir + name;
+}
+
+CodeCache::Entry code_cache_read(const std::string& dir, uint64_t key)
+{
+    auto path = code_cache_path(dir, key);
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return CodeCache::Entry();
+    struct stat s;
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &s) && static_cast<size_t>(s.st_size) > sizeof(CodeCacheFileHeader))
+        map = mmap(nullptr, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return CodeCache::Entry();
+    auto entry = std::make_shared<const CodeCacheEntry>(map, s.st_size, sizeof(CodeCacheFileHeader));
+    CodeCacheFileHeader h;
+    memcpy(&h, map, sizeof(h));
+    // a different V8 build or set of flags wrote it, or a partial write
+    // survived a crash; either way it can't be used
+    if (memcmp(h.magic, code_cache_magic, sizeof(h.magic)) ||
+        h.salt != code_cache.salt || h.key != key || h.size != entry->size ||
+        h.checksum != hash64(entry->data, entry->size, key)) {
+        unlink(path.c_str());
+        return CodeCache::Entry();
+    }
+    return entry;
+}
+
+// writes to a temporary file first and renames it into place
+// so that concurrent readers never observe a partial file
+void code_cache_write(const std::string& dir, uint64_t key, const CodeCacheEntry& entry)
+{
+    static std::atomic<unsigned> counter{0};
+    auto path = code_cache_path(dir, key);
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".%ld.%u.tmp",
+             static_cast<long>(getpid()), counter.fetch_add(1));
+    auto tmp = path + suffix;
+    int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd < 0) return;
+    CodeCacheFileHeader h;
+    memcpy(h.magic, code_cache_magic, sizeof(h.magic));
+    h.salt = code_cache.salt;
+    h.key = key;
+    h.size = entry.size;
+    h.checksum = hash64(entry.data, entry.size, key);
+    bool ok = write_all(fd, &h, sizeof(h)) && write_all(fd, entry.data, entry.size);
+    ok = !close(fd) && ok;
+    if (ok && !rename(tmp.c_str(), path.c_str())) {
+        code_cache.disk_writes++;
+        return;
+    }
+    unlink(tmp.c_str());
+}
+
+CodeCache::Entry code_cache_get(State& st, uint64_t key)
+{
+    auto entry = code_cache.get(key);
+    if (entry || st.code_cache_dir.empty()) return entry;
+    entry = code_cache_read(st.code_cache_dir, key);
+    if (!entry) return entry;
+    code_cache.disk_hits++;
+    code_cache.put(key, entry);
+    return entry;
+}
+
+// consumes cached code for |key| if the cache has it; sets |*produce|
+// when the caller should add the script to the cache after running it;
+// |eager| compiles all functions upfront instead of on first call
+bool compile_script(State& st, v8::Local<v8::String> source,
+                    v8::ScriptOrigin& origin, uint64_t key, bool eager,
+                    bool *produce, v8::Local<v8::Script> *script)
+{
+    *produce = false;
+    auto entry = key ? code_cache_get(st, key) : CodeCache::Entry();
+    if (!entry) {
+        if (key) {
+            code_cache.misses++;
+            *produce = true;
+        }
+        if (!eager) return v8::Script::Compile(st.context, source, &origin).ToLocal(script);
+        v8::ScriptCompiler::Source script_source(source, origin);
+        auto options = v8::ScriptCompiler::kEagerCompile;
+        return v8::ScriptCompiler::Compile(st.context, &script_source, options).ToLocal(script);
+    }
+    // |entry| outlives |cached_data|, which doesn't own the bytes
+    auto cached_data = new v8::ScriptCompiler::CachedData(
+        entry->data, static_cast<int>(entry->size),
+        v8::ScriptCompiler::CachedData::BufferNotOwned);
+    v8::ScriptCompiler::Source script_source(source, origin, cached_data);
+    auto options = v8::ScriptCompiler::kConsumeCodeCache;
+    if (!v8::ScriptCompiler::Compile(st.context, &script_source, options).ToLocal(script))
+        return false;
+    if (script_source.GetCachedData()->rejected) {
+        // e.g. V8 disagrees with our flags hash; replace it with fresh code
+        code_cache.rejected++;
+        code_cache.erase(key);
+        *produce = true;
+    } else {
+        code_cache.hits++;
+    }
+    return true;
+}
+
+// takes ownership of |data|
+void put_code_cache(State& st, uint64_t key, v8::ScriptCompiler::CachedData *data)
+{
+    std::unique_ptr<v8::ScriptCompiler::CachedData> cached_data(data);
+    if (!cached_data || cached_data->length <= 0) return;
+    auto entry = std::make_shared<const CodeCacheEntry>(cached_data->data, cached_data->length);
+    if (!st.code_cache_dir.empty())
+        code_cache_write(st.code_cache_dir, key, *entry);
+    code_cache.put(key, std::move(entry));
+}
+
+void produce_code_cache(State& st, v8::Local<v8::Script> script, uint64_t key)
+{
+    put_code_cache(st, key, v8::ScriptCompiler::CreateCodeCache(script->GetUnboundScript()));
+}
+
 void append_bytes(std::vector<char>& out, const char *p, size_t n)
 {
     out.insert(out.end(), p, p + n);
@@ -208,6 +546,17 @@ bool set_error_message(std::vector<char>& out, int cause, const v8::String::Utf8
     return append_utf8(out, message);
 }
 
+// <cause> <message> of a snapshot that couldn't be made, unless
+// snapshot() left a more specific message in |errbuf|
+void set_snapshot_error(std::vector<char>& errbuf, int cause)
+{
+    if (!errbuf.empty()) return;
+    const char *message = "unexpected failure";
+    if (cause == MEMORY_ERROR) message = "out of memory";
+    if (cause == TERMINATED_ERROR) message = "terminated";
+    set_error_message(errbuf, cause, message);
+}
+
 void set_fallback_error(State& st, v8::TryCatch *try_catch, int cause,
                         std::vector<char>& out)
 {
@@ -239,13 +588,18 @@ bool read_path_key(State& st, const char *&p, const char *pe,
     return true;
 }
 
-bool bubble_up_ruby_exception(State& st, v8::TryCatch *try_catch)
+// true when |exception| is the one a js->ruby callback raised
+bool is_ruby_exception(State& st, v8::Local<v8::Value> exception)
 {
-    auto exception = try_catch->Exception();
     if (exception.IsEmpty()) return false;
     auto ruby_exception = v8::Local<v8::Value>::New(st.isolate, st.ruby_exception);
     if (ruby_exception.IsEmpty()) return false;
-    if (!ruby_exception->SameValue(exception)) return false;
+    return ruby_exception->SameValue(exception);
+}
+
+bool bubble_up_ruby_exception(State& st, v8::TryCatch *try_catch)
+{
+    if (!is_ruby_exception(st, try_catch->Exception())) return false;
     // signal that the ruby thread should reraise the exception
     // that it caught earlier when executing a js->ruby callback
     uint8_t c = 'e';
@@ -253,6 +607,86 @@ bool bubble_up_ruby_exception(State& st, v8::TryCatch *try_catch)
     return true;
 }
 
+// compiles and runs safe_context_script_source in |context|,
+// returns the function that makes the filter function; empty with
+// an exception pending when terminated or out of memory
+v8::Local<v8::Function> safe_context_factory(v8::Isolate *isolate, v8::Local<v8::Context> context)
+{
+    v8::Context::Scope context_scope(context);
+    auto source = v8::String::NewFromUtf8Literal(isolate, safe_context_script_source);
+    auto filename = v8::String::NewFromUtf8Literal(isolate, "safe_context_script.js");
+    v8::ScriptOrigin origin(filename);
+    v8::Local<v8::Script> script;
+    if (!v8::Script::Compile(context, source, &origin).ToLocal(&script))
+        return v8::Local<v8::Function>();
+    v8::Local<v8::Value> function_v;
+    if (!script->Run(context).ToLocal(&function_v))
+        return v8::Local<v8::Function>();
+    return v8::Local<v8::Function>::Cast(function_v);
+}
+
+// the safe context is created on first use, which is in the middle of
+// a request, so like safe_context_factory() it can come back empty;
+// snapshots made by snapshot() carry it as context #0 with the factory
+// attached so that it doesn't need compiling either
+v8::Local<v8::Function> filter_function(State& st)
+{
+    if (!st.safe_context_function.IsEmpty())
+        return v8::Local<v8::Function>::New(st.isolate, st.safe_context_function);
+    v8::Local<v8::Context> context;
+    v8::Local<v8::Function> factory;
+    // no snapshot, or one from an older version
+    if (!v8::Context::FromSnapshot(st.isolate, 0).ToLocal(&context) ||
+        !context->GetDataFromSnapshotOnce<v8::Function>(0).ToLocal(&factory)) {
+        context = v8::Context::New(st.isolate);
+        if (context.IsEmpty()) return v8::Local<v8::Function>();
+        factory = safe_context_factory(st.isolate, context);
+        if (factory.IsEmpty()) return v8::Local<v8::Function>();
+    }
+    v8::Context::Scope context_scope(context);
+    // made in the safe context so it can read them without
+    // access to the user context's globalThis
+    auto globals = v8::Object::New(st.isolate);
+    auto map = v8::Local<v8::Value>::New(st.isolate, st.user_map);
+    auto set = v8::Local<v8::Value>::New(st.isolate, st.user_set);
+    auto map_key = v8::String::NewFromUtf8Literal(st.isolate, "Map");
+    auto set_key = v8::String::NewFromUtf8Literal(st.isolate, "Set");
+    if (globals->CreateDataProperty(context, map_key, map).IsNothing() ||
+        globals->CreateDataProperty(context, set_key, set).IsNothing())
+        return v8::Local<v8::Function>();
+    auto recv = v8::Undefined(st.isolate);
+    v8::Local<v8::Value> arg = globals;
+    v8::Local<v8::Value> function_v;
+    if (!factory->Call(context, recv, 1, &arg).ToLocal(&function_v))
+        return v8::Local<v8::Function>();
+    auto function = v8::Local<v8::Function>::Cast(function_v);
+    st.safe_context.Reset(st.isolate, context);
+    st.safe_context_function.Reset(st.isolate, function);
+    return function;
+}
+
+// context #0 is the safe context, with the function that makes the
+// filter function as its data #0, see filter_function(); taken from
+// the snapshot the isolate started from if that has one; when making
+// it fails the snapshot goes without, filter_function() then builds
+// the safe context itself
+bool add_safe_context(v8::SnapshotCreator& creator, v8::Isolate *isolate, bool from_snapshot)
+{
+    v8::Local<v8::Context> safe_context;
+    v8::Local<v8::Function> factory;
+    if (!from_snapshot ||
+        !v8::Context::FromSnapshot(isolate, 0).ToLocal(&safe_context) ||
+        !safe_context->GetDataFromSnapshotOnce<v8::Function>(0).ToLocal(&factory)) {
+        safe_context = v8::Context::New(isolate);
+        if (safe_context.IsEmpty()) return false;
+        factory = safe_context_factory(isolate, safe_context);
+        if (factory.IsEmpty()) return false;
+    }
+    creator.AddData(safe_context, factory);
+    creator.AddContext(safe_context);
+    return true;
+}
+
 // throws JS exception on serialization error
 bool reply(State& st, v8::Local<v8::Value> v)
 {
@@ -269,7 +703,13 @@ bool reply(State& st, v8::Local<v8::Value> v)
         return false;
     }
     auto recv = v8::Undefined(st.isolate);
-    if (!st.safe_context_function->Call(st.safe_context, recv, 1, &v).ToLocal(&v)) {
+    auto filter = filter_function(st);
+    if (filter.IsEmpty()) {
+        try_catch.ReThrow();
+        return false;
+    }
+    auto safe_context = v8::Local<v8::Context>::New(st.isolate, st.safe_context);
+    if (!filter->Call(safe_context, recv, 1, &v).ToLocal(&v)) {
         try_catch.ReThrow();
         return false;
     }
@@ -283,13 +723,10 @@ bool reply(State& st, v8::Local<v8::Value> result, v8::Local<v8::Value> err)
 {
     v8::TryCatch try_catch(st.isolate);
     try_catch.SetVerbose(st.verbose_exceptions);
-    v8::Local<v8::Array> response;
-    {
-        v8::Context::Scope context_scope(st.safe_context);
-        response = v8::Array::New(st.isolate, 2);
-    }
-    response->Set(st.context, 0, result).Check();
-    response->Set(st.context, 1, err).Check();
+    // Array::New(elements) and CreateDataProperty don't consult the
+    // prototype chain, setters installed by user JS can't interfere
+    v8::Local<v8::Value> elements[] = {result, err};
+    auto response = v8::Array::New(st.isolate, elements, 2);
     if (reply(st, response)) return true;
     if (!try_catch.CanContinue()) { // termination exception?
         try_catch.ReThrow();
@@ -304,18 +741,14 @@ bool reply(State& st, v8::Local<v8::Value> result, v8::Local<v8::Value> err)
         return false;
     }
     // return an {"error": "foo could not be cloned"} object
-    v8::Local<v8::Object> error;
-    {
-        v8::Context::Scope context_scope(st.safe_context);
-        error = v8::Object::New(st.isolate);
-    }
+    auto error = v8::Object::New(st.isolate);
     auto key = v8::String::NewFromUtf8Literal(st.isolate, "error");
     v8::Local<v8::String> val;
     if (!v8::String::NewFromUtf8(st.isolate, message).ToLocal(&val)) {
         val = v8::String::NewFromUtf8Literal(st.isolate, "unexpected error");
     }
-    error->Set(st.context, key, val).Check();
-    response->Set(st.context, 0, error).Check();
+    error->CreateDataProperty(st.context, key, val).Check();
+    response->CreateDataProperty(st.context, 0, error).Check();
     if (!reply(st, response)) {
         try_catch.ReThrow();
         return false;
@@ -407,10 +840,12 @@ extern "C" void v8_global_init(void)
     size_t n;
 
     v8_get_flags(&p, &n);
+    code_cache.salt = hash64(v8::V8::GetVersion(), strlen(v8::V8::GetVersion()), 0);
     if (p) {
         for (char *s = p; s < p+n; s += 1 + strlen(s)) {
             v8::V8::SetFlagsFromString(s);
         }
+        code_cache.salt = hash64(p, n, code_cache.salt);
         free(p);
     }
     v8::V8::InitializeICU();
@@ -436,85 +871,146 @@ void v8_gc_callback(v8::Isolate*, v8::GCType, v8::GCCallbackFlags, void *data)
     }
 }
 
+// embedder data slot of the default context that holds the epoch and
+// count of the functions attached in Snapshot.build, see v8_snapshot_seal
+enum { CALLBACKS_SLOT = 1 };
+
+// random start so epochs from snapshots made by other processes
+// are unlikely to collide; zero is never handed out
+uint32_t new_epoch()
+{
+    static std::atomic<uint32_t> next{std::random_device{}()};
+    uint32_t epoch;
+    do epoch = next.fetch_add(1, std::memory_order_relaxed); while (!epoch);
+    return epoch;
+}
+
+// creates the user context in the current handle scope; new contexts
+// start from the snapshot's default context
+void new_contexts(State& st)
+{
+    st.context = v8::Context::New(st.isolate);
+    // not the snapshot's epoch, ids past its callbacks get reused
+    // by every context made from it
+    st.epoch = new_epoch();
+    st.callbacks = 0;
+    if (st.context->GetNumberOfEmbedderDataFields() > CALLBACKS_SLOT) {
+        auto v = st.context->GetEmbedderData(CALLBACKS_SLOT);
+        if (v->IsBigInt()) {
+            uint64_t tag = v.As<v8::BigInt>()->Uint64Value();
+            st.snapshot_epoch = static_cast<uint32_t>(tag >> 32);
+            st.snapshot_callbacks = static_cast<int32_t>(tag);
+        }
+    }
+    st.safe_context_function.Reset();
+    st.safe_context.Reset();
+    {
+        v8::Context::Scope context_scope(st.context);
+        auto global = st.context->Global();
+        auto map = v8::String::NewFromUtf8Literal(st.isolate, "Map");
+        auto set = v8::String::NewFromUtf8Literal(st.isolate, "Set");
+        st.user_map.Reset(st.isolate, global->Get(st.context, map).ToLocalChecked());
+        st.user_set.Reset(st.isolate, global->Get(st.context, set).ToLocalChecked());
+    }
+    if (single_threaded) {
+        st.persistent_context.Reset(st.isolate, st.context);
+    }
+}
+
+void v8_api_callback(const v8::FunctionCallbackInfo<v8::Value>& info);
+v8::MaybeLocal<v8::Promise> import_module_dynamically(v8::Local<v8::Context> context,
+                                                      v8::Local<v8::Data> host_defined_options,
+                                                      v8::Local<v8::Value> resource_name,
+                                                      v8::Local<v8::String> specifier,
+                                                      v8::Local<v8::FixedArray> import_attributes);
+
+// native functions that JS objects can point to; snapshots refer to
+// them by index into this list, all isolates are created with it
+const intptr_t external_references[] = {
+    reinterpret_cast<intptr_t>(v8_api_callback),
+    0,
+};
+
+// the second half of Snapshot.build, see v8_snapshot_seal; CreateBlob
+// doesn't work from inside a handle scope
+void create_snapshot_blob(State& st)
+{
+    // keep compiled code, contexts made from the snapshot come back warm
+    auto mode = v8::SnapshotCreator::FunctionCodeHandling::kKeep;
+    st.snapshot_blob = st.snapshot_creator->CreateBlob(mode);
+}
+
 extern "C" State *v8_thread_init(Context *c, const uint8_t *snapshot_buf,
                                  size_t snapshot_len, int64_t max_memory,
-                                 int verbose_exceptions)
+                                 int verbose_exceptions, int use_code_cache,
+                                 const char *code_cache_dir, int snapshot_builder)
 {
     State *pst = new State{};
     State& st = *pst;
     st.verbose_exceptions = (verbose_exceptions != 0);
+    st.code_cache = (use_code_cache != 0);
+    if (code_cache_dir) st.code_cache_dir = code_cache_dir;
+    // the blob's header carries its checksum, no need to hash all of it
+    st.code_cache_salt = hash64(snapshot_buf, std::min<size_t>(snapshot_len, 256),
+                                code_cache.salt ^ snapshot_len);
     st.ruby_context = c;
     st.allocator.reset(v8::ArrayBuffer::Allocator::NewDefaultAllocator());
     v8::StartupData blob{nullptr, 0};
     v8::Isolate::CreateParams params;
     params.array_buffer_allocator = st.allocator.get();
+    params.external_references = external_references;
     if (snapshot_len) {
         blob.data = reinterpret_cast<const char*>(snapshot_buf);
         blob.raw_size = snapshot_len;
         params.snapshot_blob = &blob;
     }
-    st.isolate = v8::Isolate::New(params);
+    if (snapshot_builder) {
+        st.isolate = v8::Isolate::Allocate();
+        st.snapshot_creator.reset(new v8::SnapshotCreator(st.isolate, params));
+        // entered where it's used, like other isolates; in single-threaded
+        // mode that's not necessarily this thread, see ~State()
+        st.isolate->Exit();
+    } else {
+        st.isolate = v8::Isolate::New(params);
+    }
+    st.isolate->SetData(0, pst); // for callbacks that only get the isolate
+    st.isolate->SetHostImportModuleDynamicallyCallback(import_module_dynamically);
     st.max_memory = max_memory;
     if (st.max_memory > 0)
         st.isolate->AddGCEpilogueCallback(v8_gc_callback, pst);
     {
         v8::Locker locker(st.isolate);
         v8::Isolate::Scope isolate_scope(st.isolate);
-        v8::HandleScope handle_scope(st.isolate);
-        st.safe_context = v8::Context::New(st.isolate);
-        st.context = v8::Context::New(st.isolate);
-        v8::Context::Scope context_scope(st.context);
-        {
-            v8::Context::Scope context_scope(st.safe_context);
-            auto source = v8::String::NewFromUtf8Literal(st.isolate, safe_context_script_source);
-            auto filename = v8::String::NewFromUtf8Literal(st.isolate, "safe_context_script.js");
-            v8::ScriptOrigin origin(filename);
-            auto script =
-                v8::Script::Compile(st.safe_context, source, &origin)
-                .ToLocalChecked();
-            auto function_v = script->Run(st.safe_context).ToLocalChecked();
-            auto function = v8::Function::Cast(*function_v);
-            auto recv = v8::Undefined(st.isolate);
-            v8::Local<v8::Value> arg = st.context->Global();
-            // grant the safe context access to the user context's globalThis
-            st.safe_context->SetSecurityToken(st.context->GetSecurityToken());
-            function_v =
-                function->Call(st.safe_context, recv, 1, &arg)
-                .ToLocalChecked();
-            // revoke access again now that the script did its one-time setup
-            st.safe_context->UseDefaultSecurityToken();
-            st.safe_context_function = v8::Local<v8::Function>::Cast(function_v);
+        // v8_thread_main returns early when Context#reset! wants fresh
+        // contexts; the old ones die with their handle scope
+        while (!st.snapshot_requested) {
+            v8::HandleScope handle_scope(st.isolate);
+            new_contexts(st);
+            if (single_threaded)
+                return pst; // intentionally returning early and keeping alive
+            v8::Context::Scope context_scope(st.context);
+            if (!v8_thread_main(c, pst))
+                break;
         }
-        if (single_threaded) {
-            st.persistent_safe_context_function.Reset(st.isolate, st.safe_context_function);
-            st.persistent_safe_context.Reset(st.isolate, st.safe_context);
-            st.persistent_context.Reset(st.isolate, st.context);
-            return pst; // intentionally returning early and keeping alive
+        // or when Snapshot.build is done with the context; what's left
+        // is handing out the blob, see v8_snapshot_blob
+        if (st.snapshot_requested) {
+            create_snapshot_blob(st);
+            v8_thread_main(c, pst);
         }
-        v8_thread_main(c, pst);
     }
     delete pst;
     return nullptr;
 }
 
-void v8_api_callback(const v8::FunctionCallbackInfo<v8::Value>& info)
+// sends |request| to the ruby thread as a callback request and waits for
+// the answer, serving nested requests in the meantime; false means an
+// exception is pending
+bool call_ruby(State& st, v8::Local<v8::Value> request, v8::Local<v8::Value> *result)
 {
-    auto ext = v8::External::Cast(*info.Data());
-    Callback *cb = static_cast<Callback*>(ext->Value());
-    State& st = *cb->st;
-    v8::Local<v8::Array> request;
-    {
-        v8::Context::Scope context_scope(st.safe_context);
-        request = v8::Array::New(st.isolate, 1 + info.Length());
-    }
-    for (int i = 0, n = info.Length(); i < n; i++) {
-        request->Set(st.context, i, sanitize(st, info[i])).Check();
-    }
-    auto id = v8::Int32::New(st.isolate, cb->id);
-    request->Set(st.context, info.Length(), id).Check(); // callback id
     {
         Serialized serialized(st, request);
-        if (!serialized.data) return; // exception pending
+        if (!serialized.data) return false; // exception pending
         uint8_t marker = 'c'; // callback marker
         v8_reply(st.ruby_context, &marker, 1);
         v8_reply(st.ruby_context, serialized.data, serialized.size);
@@ -534,14 +1030,44 @@ void v8_api_callback(const v8::FunctionCallbackInfo<v8::Value>& info)
             auto exception = v8::Exception::Error(message);
             st.ruby_exception.Reset(st.isolate, exception);
             st.isolate->ThrowException(exception);
-            return;
+            return false;
         }
         v8_dispatch(st.ruby_context);
     }
     v8::ValueDeserializer des(st.isolate, p+1, n-1);
     des.ReadHeader(st.context).Check();
+    return des.ReadValue(st.context).ToLocal(result); // false: exception pending
+}
+
+void v8_api_callback(const v8::FunctionCallbackInfo<v8::Value>& info)
+{
+    auto isolate = info.GetIsolate();
+    auto pst = static_cast<State*>(isolate->GetData(0));
+    if (!pst) { // Snapshot#warmup!'s isolate, there's no ruby to call
+        isolate->ThrowError(v8::String::NewFromUtf8Literal(isolate, "attached function called during warmup"));
+        return;
+    }
+    State& st = *pst;
+    // the function outlived its context (pending tasks can still run it
+    // after Context#reset!) and its id may belong to another callback now;
+    // ones from the snapshot are good for as long as the isolate lives
+    uint64_t tag = info.Data().As<v8::BigInt>()->Uint64Value();
+    auto epoch = static_cast<uint32_t>(tag >> 32);
+    auto id = static_cast<int32_t>(tag);
+    bool from_snapshot = (epoch == st.snapshot_epoch && id >= 0 && id < st.snapshot_callbacks);
+    if (epoch != st.epoch && !from_snapshot) {
+        isolate->ThrowError(v8::String::NewFromUtf8Literal(isolate, "context was reset"));
+        return;
+    }
+    std::vector<v8::Local<v8::Value>> elements;
+    elements.reserve(1 + info.Length());
+    for (int i = 0, n = info.Length(); i < n; i++) {
+        elements.push_back(sanitize(st, info[i]));
+    }
+    elements.push_back(v8::Int32::New(st.isolate, id)); // callback id
+    auto request = v8::Array::New(st.isolate, elements.data(), elements.size());
     v8::Local<v8::Value> result;
-    if (!des.ReadValue(st.context).ToLocal(&result)) return; // exception pending
+    if (!call_ruby(st, request, &result)) return; // exception pending
     info.GetReturnValue().Set(result);
 }
 
@@ -588,11 +1114,12 @@ extern "C" void v8_attach(State *pst, const uint8_t *p, size_t n)
             }
             obj = val.As<v8::Object>();
         }
-        std::unique_ptr<Callback> cb(new Callback{pst, id});
-        v8::Local<v8::External> ext = v8::External::New(st.isolate, cb.get());
+        // the id and not a pointer, so that snapshots can carry the function
+        uint64_t tag = static_cast<uint64_t>(st.epoch) << 32 | static_cast<uint32_t>(id);
+        auto data = v8::BigInt::NewFromUnsigned(st.isolate, tag);
+        st.callbacks = std::max(st.callbacks, id + 1);
         v8::Local<v8::Function> function;
-        if (!v8::Function::New(st.context, v8_api_callback, ext).ToLocal(&function)) goto fail;
-        st.callbacks.push_back(cb.release());
+        if (!v8::Function::New(st.context, v8_api_callback, data).ToLocal(&function)) goto fail;
         if (!obj->Set(st.context, key, function).FromMaybe(false)) goto fail;
     }
     cause = NO_ERROR;
@@ -670,8 +1197,69 @@ void restore_termination(State& st, bool suspended)
         st.isolate->TerminateExecution();
 }
 
+// resolves foo.bar.baz paths relative to globalThis;
+// false means an exception is pending
+bool resolve_function(State& st, v8::Local<v8::Value> name_v,
+                      v8::Local<v8::Object> *recv, v8::Local<v8::Function> *function)
+{
+    v8::Local<v8::String> name;
+    if (!name_v->ToString(st.context).ToLocal(&name)) return false;
+    v8::String::Utf8Value path(st.isolate, name);
+    if (!*path) return false;
+    const char *p = *path;
+    const char *pe = p + path.length();
+    v8::Local<v8::Object> obj = st.context->Global();
+    v8::Local<v8::String> key;
+    for (;;) {
+        bool last;
+        if (!read_path_key(st, p, pe, &key, &last)) return false;
+        if (last) break;
+        v8::Local<v8::Value> val;
+        if (!obj->Get(st.context, key).ToLocal(&val)) return false;
+        if (!val->ToObject(st.context).ToLocal(&obj)) return false;
+    }
+    v8::Local<v8::Value> function_v;
+    if (!obj->Get(st.context, key).ToLocal(&function_v)) return false;
+    if (!function_v->IsFunction()) {
+        // XXX it's technically possible for |function_v| to be a callable
+        // object but those are effectively extinct; regexp objects used
+        // to be callable but not anymore
+        auto message = v8::String::NewFromUtf8Literal(st.isolate, "not a function");
+        auto exception = v8::Exception::TypeError(message);
+        st.isolate->ThrowException(exception);
+        return false;
+    }
+    *recv = obj;
+    *function = function_v.As<v8::Function>();
+    return true;
+}
+
+// false means an exception is pending
+bool lookup_function_handle(State& st, v8::Local<v8::Value> id_v,
+                            v8::Local<v8::Object> *recv, v8::Local<v8::Function> *function)
+{
+    if (!id_v->IsInt32() || id_v.As<v8::Int32>()->Value() < 0 ||
+        static_cast<size_t>(id_v.As<v8::Int32>()->Value()) >= st.functions.size() ||
+        st.functions[id_v.As<v8::Int32>()->Value()].function.IsEmpty()) { // reset!
+        auto message = v8::String::NewFromUtf8Literal(st.isolate, "bad function handle");
+        st.isolate->ThrowException(v8::Exception::Error(message));
+        return false;
+    }
+    auto& handle = st.functions[id_v.As<v8::Int32>()->Value()];
+    *recv = handle.recv.Get(st.isolate);
+    *function = handle.function.Get(st.isolate);
+    return true;
+}
+
+enum CallTarget
+{
+    CALL_BY_NAME,   // request is [name, args...]
+    CALL_BY_HANDLE, // request is [id, args...]
+    MAKE_HANDLE,    // request is [name], response is the handle's id
+};
+
 // response is errback [result, err] array
-void v8_call_impl(State *pst, const uint8_t *p, size_t n, bool await)
+void v8_call_impl(State *pst, const uint8_t *p, size_t n, bool await, CallTarget target)
 {
     State& st = *pst;
     v8::TryCatch try_catch(st.isolate);
@@ -695,38 +1283,31 @@ void v8_call_impl(State *pst, const uint8_t *p, size_t n, bool await)
         if (!des.ReadValue(st.context).ToLocal(&request_v)) goto fail;
         v8::Local<v8::Object> request;
         if (!request_v->ToObject(st.context).ToLocal(&request)) goto fail;
-        v8::Local<v8::Value> name_v;
-        if (!request->Get(st.context, 0).ToLocal(&name_v)) goto fail;
-        v8::Local<v8::String> name;
-        if (!name_v->ToString(st.context).ToLocal(&name)) goto fail;
+        v8::Local<v8::Value> target_v;
+        if (!request->Get(st.context, 0).ToLocal(&target_v)) goto fail;
         cause = RUNTIME_ERROR;
-        // support foo.bar.baz paths
-        v8::String::Utf8Value path(st.isolate, name);
-        if (!*path) goto fail;
-        const char *p = *path;
-        const char *pe = p + path.length();
-        v8::Local<v8::Object> obj = st.context->Global();
-        v8::Local<v8::String> key;
-        for (;;) {
-            bool last;
-            if (!read_path_key(st, p, pe, &key, &last)) goto fail;
-            if (last) break;
-            v8::Local<v8::Value> val;
-            if (!obj->Get(st.context, key).ToLocal(&val)) goto fail;
-            if (!val->ToObject(st.context).ToLocal(&obj)) goto fail;
+        v8::Local<v8::Object> recv;
+        v8::Local<v8::Function> function;
+        if (target == CALL_BY_HANDLE) {
+            if (!lookup_function_handle(st, target_v, &recv, &function)) goto fail;
+        } else {
+            if (!resolve_function(st, target_v, &recv, &function)) goto fail;
         }
-        v8::Local<v8::Value> function_v;
-        if (!obj->Get(st.context, key).ToLocal(&function_v)) goto fail;
-        if (!function_v->IsFunction()) {
-            // XXX it's technically possible for |function_v| to be a callable
-            // object but those are effectively extinct; regexp objects used
-            // to be callable but not anymore
-            auto message = v8::String::NewFromUtf8Literal(st.isolate, "not a function");
-            auto exception = v8::Exception::TypeError(message);
-            st.isolate->ThrowException(exception);
-            goto fail;
+        if (target == MAKE_HANDLE) {
+            FunctionHandle handle{
+                v8::Global<v8::Function>(st.isolate, function),
+                v8::Global<v8::Object>(st.isolate, recv),
+            };
+            if (st.free_functions.empty()) {
+                result = v8::Int32::New(st.isolate, st.functions.size());
+                st.functions.push_back(std::move(handle));
+            } else {
+                result = v8::Int32::New(st.isolate, st.free_functions.back());
+                st.functions[st.free_functions.back()] = std::move(handle);
+                st.free_functions.pop_back();
+            }
+            goto done;
         }
-        auto function = v8::Function::Cast(*function_v);
         assert(request->IsArray());
         int n = v8::Array::Cast(*request)->Length();
         for (int i = 1; i < n; i++) {
@@ -734,12 +1315,13 @@ void v8_call_impl(State *pst, const uint8_t *p, size_t n, bool await)
             if (!request->Get(st.context, i).ToLocal(&val)) goto fail;
             args.push_back(val);
         }
-        auto maybe_result_v = function->Call(st.context, obj, args.size(), args.data());
+        auto maybe_result_v = function->Call(st.context, recv, args.size(), args.data());
         v8::Local<v8::Value> result_v;
         if (!maybe_result_v.ToLocal(&result_v)) goto fail;
         if (await && !await_promise(st, &result_v)) goto fail;
         result = sanitize(st, result_v);
     }
+done:
     cause = NO_ERROR;
 fail:
     preserve_termination = suspend_termination(st, nested, cause);
@@ -759,57 +1341,235 @@ fail:
 
 extern "C" void v8_call(State *pst, const uint8_t *p, size_t n)
 {
-    v8_call_impl(pst, p, n, false);
+    v8_call_impl(pst, p, n, false, CALL_BY_NAME);
 }
 
 extern "C" void v8_call_await(State *pst, const uint8_t *p, size_t n)
 {
-    v8_call_impl(pst, p, n, true);
+    v8_call_impl(pst, p, n, true, CALL_BY_NAME);
 }
 
-// response is errback [result, err] array
-void v8_eval_impl(State *pst, const uint8_t *p, size_t n, bool await)
+extern "C" void v8_function(State *pst, const uint8_t *p, size_t n)
+{
+    v8_call_impl(pst, p, n, false, MAKE_HANDLE);
+}
+
+extern "C" void v8_invoke(State *pst, const uint8_t *p, size_t n)
+{
+    v8_call_impl(pst, p, n, false, CALL_BY_HANDLE);
+}
+
+extern "C" void v8_invoke_await(State *pst, const uint8_t *p, size_t n)
+{
+    v8_call_impl(pst, p, n, true, CALL_BY_HANDLE);
+}
+
+// request is the handle's id, response is undefined; the slot is up
+// for reuse unless reset! emptied it, see v8_reset
+extern "C" void v8_function_dispose(State *pst, const uint8_t *p, size_t n)
+{
+    State& st = *pst;
+    v8::TryCatch try_catch(st.isolate);
+    v8::HandleScope handle_scope(st.isolate);
+    v8::ValueDeserializer des(st.isolate, p, n);
+    des.ReadHeader(st.context).Check();
+    v8::Local<v8::Value> id_v;
+    if (des.ReadValue(st.context).ToLocal(&id_v) && id_v->IsInt32()) {
+        int32_t id = id_v.As<v8::Int32>()->Value();
+        if (id >= 0 && static_cast<size_t>(id) < st.functions.size() &&
+            !st.functions[id].function.IsEmpty()) {
+            st.functions[id].function.Reset();
+            st.functions[id].recv.Reset();
+            st.free_functions.push_back(id);
+        }
+    }
+    reply_retry(st, v8::Undefined(st.isolate));
+}
+
+// false with an exception pending when |v| doesn't serialize
+bool serialize_to_array_buffer(State& st, v8::Local<v8::Value> v, v8::Local<v8::Value> *buf)
+{
+    Serialized serialized(st, v);
+    if (!serialized.data) return false;
+    auto array_buffer = v8::ArrayBuffer::New(st.isolate, serialized.size);
+    memcpy(array_buffer->Data(), serialized.data, serialized.size);
+    *buf = array_buffer;
+    return true;
+}
+
+// serializes the [result, err] pair of one v8_call_many call on its own
+// so that a result that can't be cloned only fails its own slot: it's
+// run through the filter function like in reply() and, if that doesn't
+// help, replaced by the error; false with an exception pending when
+// terminated or when a ruby callback raised
+bool serialize_slot(State& st, v8::Local<v8::Value> result, v8::Local<v8::Value> err,
+                    v8::Local<v8::Value> *slot)
+{
+    v8::TryCatch try_catch(st.isolate);
+    try_catch.SetVerbose(st.verbose_exceptions);
+    v8::Local<v8::Value> pair[] = {result, err};
+    v8::Local<v8::Value> v = v8::Array::New(st.isolate, pair, 2);
+    if (serialize_to_array_buffer(st, v, slot)) return true;
+    if (try_catch.CanContinue() && !is_ruby_exception(st, try_catch.Exception())) {
+        auto recv = v8::Undefined(st.isolate);
+        auto filter = filter_function(st);
+        auto safe_context = v8::Local<v8::Context>::New(st.isolate, st.safe_context);
+        if (!filter.IsEmpty() && filter->Call(safe_context, recv, 1, &v).ToLocal(&v) &&
+            serialize_to_array_buffer(st, v, slot))
+            return true;
+    }
+    if (try_catch.CanContinue() && !is_ruby_exception(st, try_catch.Exception())) {
+        pair[0] = v8::Undefined(st.isolate);
+        pair[1] = to_error(st, &try_catch, RUNTIME_ERROR);
+        v = v8::Array::New(st.isolate, pair, 2);
+        if (serialize_to_array_buffer(st, v, slot)) return true;
+    }
+    try_catch.ReThrow();
+    return false;
+}
+
+// request is [[name, args...], ...] array, calls run back to back;
+// response is errback [slots, err] array where each slot is an
+// ArrayBuffer with a serialized [result, err] pair, see serialize_slot(),
+// and the outer err is only set when the batch as a whole failed
+// (termination, OOM, ruby exception)
+extern "C" void v8_call_many(State *pst, const uint8_t *p, size_t n)
 {
     State& st = *pst;
     v8::TryCatch try_catch(st.isolate);
     try_catch.SetVerbose(st.verbose_exceptions);
     v8::HandleScope handle_scope(st.isolate);
     v8::ValueDeserializer des(st.isolate, p, n);
+    std::vector<v8::Local<v8::Value>> args;
     des.ReadHeader(st.context).Check();
     v8::Local<v8::Value> result;
     int cause = INTERNAL_ERROR;
     bool preserve_termination = false;
     bool nested = st.javascript_call_depth > 0;
     JavascriptCallScope call_scope(st.javascript_call_depth);
-    if (await && nested) {
-        throw_nested_await_call(st);
-        cause = RUNTIME_ERROR;
-        goto fail;
-    }
     {
         v8::Local<v8::Value> request_v;
         if (!des.ReadValue(st.context).ToLocal(&request_v)) goto fail;
-        v8::Local<v8::Object> request; // [filename, source]
-        if (!request_v->ToObject(st.context).ToLocal(&request)) goto fail;
-        v8::Local<v8::Value> filename;
-        if (!request->Get(st.context, 0).ToLocal(&filename)) goto fail;
-        v8::Local<v8::Value> source_v;
-        if (!request->Get(st.context, 1).ToLocal(&source_v)) goto fail;
-        v8::Local<v8::String> source;
-        if (!source_v->ToString(st.context).ToLocal(&source)) goto fail;
-        v8::ScriptOrigin origin(filename);
-        v8::Local<v8::Script> script;
-        cause = PARSE_ERROR;
-        if (!v8::Script::Compile(st.context, source, &origin).ToLocal(&script)) goto fail;
-        v8::Local<v8::Value> result_v;
-        cause = RUNTIME_ERROR;
-        auto maybe_result_v = script->Run(st.context);
-        if (!maybe_result_v.ToLocal(&result_v)) goto fail;
-        if (await && !await_promise(st, &result_v)) goto fail;
-        result = sanitize(st, result_v);
-    }
-    cause = NO_ERROR;
-fail:
+        if (!request_v->IsArray()) goto fail;
+        auto request = request_v.As<v8::Array>();
+        uint32_t count = request->Length();
+        std::vector<v8::Local<v8::Value>> results;
+        results.reserve(count);
+        for (uint32_t i = 0; i < count; i++) {
+            v8::Local<v8::Value> call_v;
+            if (!request->Get(st.context, i).ToLocal(&call_v)) goto fail;
+            if (!call_v->IsArray()) goto fail;
+            auto call = call_v.As<v8::Array>();
+            v8::Local<v8::Value> name_v;
+            if (!call->Get(st.context, 0).ToLocal(&name_v)) goto fail;
+            args.clear();
+            for (uint32_t j = 1, k = call->Length(); j < k; j++) {
+                v8::Local<v8::Value> val;
+                if (!call->Get(st.context, j).ToLocal(&val)) goto fail;
+                args.push_back(val);
+            }
+            v8::Local<v8::Value> result_v, err_v;
+            {
+                v8::TryCatch call_try_catch(st.isolate);
+                call_try_catch.SetVerbose(st.verbose_exceptions);
+                v8::Local<v8::Object> recv;
+                v8::Local<v8::Function> function;
+                if (resolve_function(st, name_v, &recv, &function)) {
+                    auto maybe_result_v = function->Call(st.context, recv, args.size(), args.data());
+                    if (maybe_result_v.ToLocal(&result_v)) result_v = sanitize(st, result_v);
+                }
+                if (call_try_catch.HasCaught()) {
+                    // termination and uncaught ruby exceptions abort the batch
+                    if (!call_try_catch.CanContinue() ||
+                        is_ruby_exception(st, call_try_catch.Exception())) {
+                        call_try_catch.ReThrow();
+                        cause = RUNTIME_ERROR;
+                        goto fail;
+                    }
+                    result_v = v8::Undefined(st.isolate);
+                    err_v = to_error(st, &call_try_catch, RUNTIME_ERROR);
+                } else {
+                    err_v = v8::String::Empty(st.isolate);
+                }
+            }
+            v8::Local<v8::Value> slot;
+            if (!serialize_slot(st, result_v, err_v, &slot)) {
+                cause = RUNTIME_ERROR;
+                goto fail;
+            }
+            results.push_back(slot);
+        }
+        result = v8::Array::New(st.isolate, results.data(), results.size());
+    }
+    cause = NO_ERROR;
+fail:
+    preserve_termination = suspend_termination(st, nested, cause);
+    if (bubble_up_ruby_exception(st, &try_catch)) {
+        restore_termination(st, preserve_termination);
+        return;
+    }
+    if (!cause && try_catch.HasCaught()) cause = RUNTIME_ERROR;
+    if (cause) result = v8::Undefined(st.isolate);
+    auto err = to_error(st, &try_catch, cause);
+    if (!reply(st, result, err)) {
+        assert(try_catch.HasCaught());
+        goto fail; // retry; can be termination exception
+    }
+    restore_termination(st, preserve_termination);
+}
+
+// response is errback [result, err] array
+void v8_eval_impl(State *pst, const uint8_t *p, size_t n, bool await)
+{
+    State& st = *pst;
+    v8::TryCatch try_catch(st.isolate);
+    try_catch.SetVerbose(st.verbose_exceptions);
+    v8::HandleScope handle_scope(st.isolate);
+    v8::ValueDeserializer des(st.isolate, p, n);
+    des.ReadHeader(st.context).Check();
+    v8::Local<v8::Value> result;
+    int cause = INTERNAL_ERROR;
+    bool preserve_termination = false;
+    bool nested = st.javascript_call_depth > 0;
+    JavascriptCallScope call_scope(st.javascript_call_depth);
+    if (await && nested) {
+        throw_nested_await_call(st);
+        cause = RUNTIME_ERROR;
+        goto fail;
+    }
+    {
+        v8::Local<v8::Value> request_v;
+        if (!des.ReadValue(st.context).ToLocal(&request_v)) goto fail;
+        v8::Local<v8::Object> request; // [filename, source, eager?]
+        if (!request_v->ToObject(st.context).ToLocal(&request)) goto fail;
+        v8::Local<v8::Value> filename;
+        if (!request->Get(st.context, 0).ToLocal(&filename)) goto fail;
+        v8::Local<v8::Value> source_v;
+        if (!request->Get(st.context, 1).ToLocal(&source_v)) goto fail;
+        v8::Local<v8::String> source;
+        if (!source_v->ToString(st.context).ToLocal(&source)) goto fail;
+        v8::Local<v8::Value> eager; // optional
+        if (!request->Get(st.context, 2).ToLocal(&eager)) goto fail;
+        v8::ScriptOrigin origin(filename);
+        v8::Local<v8::Script> script;
+        // the request holds the filename and the source with its encoding
+        uint64_t key = 0;
+        if (st.code_cache && n >= CodeCache::min_source_size)
+            key = hash64(p, n, st.code_cache_salt) | 1; // never zero
+        bool produce;
+        cause = PARSE_ERROR;
+        if (!compile_script(st, source, origin, key, eager->IsTrue(), &produce, &script)) goto fail;
+        v8::Local<v8::Value> result_v;
+        cause = RUNTIME_ERROR;
+        auto maybe_result_v = script->Run(st.context);
+        if (!maybe_result_v.ToLocal(&result_v)) goto fail;
+        // after running so functions compiled lazily by the run are included
+        if (produce) produce_code_cache(st, script, key);
+        if (await && !await_promise(st, &result_v)) goto fail;
+        result = sanitize(st, result_v);
+    }
+    cause = NO_ERROR;
+fail:
     preserve_termination = suspend_termination(st, nested, cause);
     if (bubble_up_ruby_exception(st, &try_catch)) {
         restore_termination(st, preserve_termination);
@@ -835,6 +1595,663 @@ extern "C" void v8_eval_await(State *pst, const uint8_t *p, size_t n)
     v8_eval_impl(pst, p, n, true);
 }
 
+// the whole source in one chunk; the point of streaming here is that
+// parsing happens on a worker thread, not that the source trickles in
+struct SourceChunk : public v8::ScriptCompiler::ExternalSourceStream
+{
+    uint8_t *data;
+    size_t size;
+
+    SourceChunk(const uint8_t *p, size_t n) : data(new uint8_t[n]), size(n)
+    {
+        memcpy(data, p, n);
+    }
+
+    ~SourceChunk() { delete[] data; }
+
+    size_t GetMoreData(const uint8_t **src) final
+    {
+        size_t n = size;
+        *src = nullptr;
+        if (n) {
+            *src = data; // V8 takes ownership
+            data = nullptr;
+            size = 0;
+        }
+        return n;
+    }
+};
+
+// runs on a platform worker thread
+struct StreamingTask : public v8::Task
+{
+    State *st;
+    BackgroundCompile *bc;
+
+    StreamingTask(State *st, BackgroundCompile *bc) : st(st), bc(bc) {}
+
+    void Run() final
+    {
+        bc->task->Run();
+        v8_compile_done(bc->cp);
+        std::lock_guard<std::mutex> lock(st->compile_mtx);
+        bc->done = true; // v8 thread can free |bc| once we unlock
+        st->compiles_running--;
+        st->compile_cv.notify_all();
+    }
+};
+
+// request is <Compile*> <flags> <filename length:u32> <filename> <source>,
+// filename is UTF-8, source is UTF-8 or Latin-1 (COMPILE_ONE_BYTE);
+// response is errback [undefined, err] array; v8_compile_done(Compile*)
+// is called when the script is ready for v8_compile_finish
+extern "C" void v8_compile_start(State *pst, const uint8_t *p, size_t n)
+{
+    State& st = *pst;
+    v8::TryCatch try_catch(st.isolate);
+    try_catch.SetVerbose(st.verbose_exceptions);
+    v8::HandleScope handle_scope(st.isolate);
+    v8::Local<v8::Value> result = v8::Undefined(st.isolate);
+    const uint8_t *pe = p + n;
+    int cause = INTERNAL_ERROR;
+    bool preserve_termination = false;
+    bool nested = st.javascript_call_depth > 0;
+    auto bc = std::make_unique<BackgroundCompile>();
+    const uint8_t *keyed;
+    uint32_t filename_len;
+    uint8_t flags;
+    {
+        // the ruby threads that started these went away without
+        // finishing them, e.g. because they were interrupted
+        std::lock_guard<std::mutex> lock(st.compile_mtx);
+        for (auto it = st.compiles.begin(); it != st.compiles.end();) {
+            if (it->second->done && v8_compile_abandoned(it->first)) {
+                it = st.compiles.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    memcpy(&bc->cp, p, sizeof(bc->cp));
+    p += sizeof(bc->cp);
+    keyed = p;
+    flags = *p++;
+    memcpy(&filename_len, p, sizeof(filename_len));
+    p += sizeof(filename_len);
+    bc->eager = (flags & COMPILE_EAGER) != 0;
+    {
+        if (filename_len > static_cast<size_t>(pe - p)) goto fail;
+        auto filename = reinterpret_cast<const char*>(p);
+        auto source = p + filename_len;
+        size_t source_len = pe - source;
+        if (source_len > static_cast<size_t>(v8::String::kMaxLength)) goto fail;
+        auto type = v8::NewStringType::kNormal;
+        v8::Local<v8::String> filename_s;
+        if (!v8::String::NewFromUtf8(st.isolate, filename, type, filename_len).ToLocal(&filename_s))
+            goto fail;
+        v8::Local<v8::String> source_s;
+        bool ok;
+        if (flags & COMPILE_ONE_BYTE) {
+            ok = v8::String::NewFromOneByte(st.isolate, source, type,
+                                            static_cast<int>(source_len)).ToLocal(&source_s);
+        } else {
+            ok = v8::String::NewFromUtf8(st.isolate, reinterpret_cast<const char*>(source), type,
+                                         static_cast<int>(source_len)).ToLocal(&source_s);
+        }
+        if (!ok) goto fail;
+        bc->filename.Reset(st.isolate, filename_s);
+        bc->full_source.Reset(st.isolate, source_s);
+        // flags go into the key, the source is decoded differently
+        // and eagerly compiled code is cached separately
+        if (st.code_cache && source_len >= CodeCache::min_source_size)
+            bc->key = hash64(keyed, pe - keyed, st.code_cache_salt) | 1; // never zero
+        // cached code is quicker to load on the v8 thread than to parse
+        // anywhere, and the single-threaded platform has no worker threads
+        if (!single_threaded && !(bc->key && code_cache_get(st, bc->key))) {
+            auto encoding = (flags & COMPILE_ONE_BYTE)
+                ? v8::ScriptCompiler::StreamedSource::ONE_BYTE
+                : v8::ScriptCompiler::StreamedSource::UTF8;
+            bc->source = std::make_unique<v8::ScriptCompiler::StreamedSource>(
+                std::make_unique<SourceChunk>(source, source_len), encoding);
+            auto options = bc->eager ? v8::ScriptCompiler::kEagerCompile
+                                     : v8::ScriptCompiler::kNoCompileOptions;
+            bc->task.reset(v8::ScriptCompiler::StartStreaming(
+                st.isolate, bc->source.get(), v8::ScriptType::kClassic, options));
+        }
+        if (bc->task) {
+            if (bc->key) code_cache.misses++;
+            {
+                std::lock_guard<std::mutex> lock(st.compile_mtx);
+                st.compiles_running++;
+            }
+            platform->CallOnWorkerThread(std::make_unique<StreamingTask>(pst, bc.get()));
+        } else {
+            bc->source.reset();
+            bc->done = true;
+            v8_compile_done(bc->cp);
+        }
+        auto cp = bc->cp;
+        st.compiles.emplace(cp, std::move(bc));
+    }
+    cause = NO_ERROR;
+fail:
+    preserve_termination = suspend_termination(st, nested, cause);
+    if (cause) result = v8::Undefined(st.isolate);
+    auto err = to_error(st, &try_catch, cause);
+    if (!reply(st, result, err)) {
+        assert(try_catch.HasCaught());
+        goto fail; // retry; can be termination exception
+    }
+    restore_termination(st, preserve_termination);
+}
+
+// runs the script started by v8_compile_start; request is <Compile*> <await>,
+// response is errback [result, err] array like v8_eval's
+extern "C" void v8_compile_finish(State *pst, const uint8_t *p, size_t n)
+{
+    State& st = *pst;
+    v8::TryCatch try_catch(st.isolate);
+    try_catch.SetVerbose(st.verbose_exceptions);
+    v8::HandleScope handle_scope(st.isolate);
+    v8::Local<v8::Value> result;
+    int cause = INTERNAL_ERROR;
+    bool preserve_termination = false;
+    bool nested = st.javascript_call_depth > 0;
+    JavascriptCallScope call_scope(st.javascript_call_depth);
+    std::unique_ptr<BackgroundCompile> bc;
+    struct Compile *cp;
+    assert(n == sizeof(cp) + 1);
+    memcpy(&cp, p, sizeof(cp));
+    bool await = p[sizeof(cp)] != 0;
+    if (await && nested) {
+        throw_nested_await_call(st);
+        cause = RUNTIME_ERROR;
+        goto fail;
+    }
+    {
+        auto it = st.compiles.find(cp);
+        if (it == st.compiles.end()) goto fail;
+        bc = std::move(it->second);
+        st.compiles.erase(it);
+        {
+            // normally finished already, the ruby thread waits for that
+            std::unique_lock<std::mutex> lock(st.compile_mtx);
+            st.compile_cv.wait(lock, [&] { return bc->done; });
+        }
+        auto source = bc->full_source.Get(st.isolate);
+        v8::ScriptOrigin origin(bc->filename.Get(st.isolate));
+        v8::Local<v8::Script> script;
+        bool produce = false;
+        cause = PARSE_ERROR;
+        if (bc->source) {
+            auto maybe_script =
+                v8::ScriptCompiler::Compile(st.context, bc->source.get(), source, origin);
+            if (!maybe_script.ToLocal(&script)) goto fail;
+            produce = (bc->key != 0);
+        } else {
+            if (!compile_script(st, source, origin, bc->key, bc->eager, &produce, &script))
+                goto fail;
+        }
+        v8::Local<v8::Value> result_v;
+        cause = RUNTIME_ERROR;
+        auto maybe_result_v = script->Run(st.context);
+        if (!maybe_result_v.ToLocal(&result_v)) goto fail;
+        if (produce) produce_code_cache(st, script, bc->key);
+        if (await && !await_promise(st, &result_v)) goto fail;
+        result = sanitize(st, result_v);
+    }
+    cause = NO_ERROR;
+fail:
+    preserve_termination = suspend_termination(st, nested, cause);
+    if (bubble_up_ruby_exception(st, &try_catch)) {
+        restore_termination(st, preserve_termination);
+        return;
+    }
+    if (!cause && try_catch.HasCaught()) cause = RUNTIME_ERROR;
+    if (cause) result = v8::Undefined(st.isolate);
+    auto err = to_error(st, &try_catch, cause);
+    if (!reply(st, result, err)) {
+        assert(try_catch.HasCaught());
+        goto fail; // retry; can be termination exception
+    }
+    restore_termination(st, preserve_termination);
+}
+
+// a module compiled by the current v8_load_module request
+struct LoadedModule
+{
+    v8::Local<v8::Module> module;
+    std::string name;
+    uint64_t key; // add to the code cache after evaluating, or 0
+};
+
+std::string utf8_string(State& st, v8::Local<v8::Value> v)
+{
+    v8::String::Utf8Value s(st.isolate, v);
+    return *s ? std::string(*s, s.length()) : std::string();
+}
+
+void throw_error(State& st, const std::string& message)
+{
+    std::vector<char> buf(message.begin(), message.end());
+    st.isolate->ThrowException(v8::Exception::Error(string_from_bytes(st.isolate, buf)));
+}
+
+// compiles |source| as module |name| and adds it to the module map;
+// the code cache key covers the name because import specifiers are
+// resolved relative to it
+bool compile_module(State& st, const std::string& name, v8::Local<v8::String> source,
+                    LoadedModule *loaded)
+{
+    auto type = v8::NewStringType::kNormal;
+    v8::Local<v8::String> name_s;
+    if (!v8::String::NewFromUtf8(st.isolate, name.data(), type, name.size()).ToLocal(&name_s))
+        return false;
+    v8::ScriptOrigin origin(name_s, 0, 0, false, -1, v8::Local<v8::Value>(),
+                            false, false, /*is_module*/true);
+    uint64_t key = 0;
+    if (st.code_cache && static_cast<size_t>(source->Length()) >= CodeCache::min_source_size) {
+        v8::String::Utf8Value s(st.isolate, source);
+        if (*s) key = hash64(*s, s.length(), hash64(name.c_str(), name.size() + 1,
+                                                    st.code_cache_salt ^ 'M')) | 1;
+    }
+    loaded->name = name;
+    loaded->key = 0;
+    auto entry = key ? code_cache_get(st, key) : CodeCache::Entry();
+    if (!entry) {
+        if (key) {
+            code_cache.misses++;
+            loaded->key = key;
+        }
+        v8::ScriptCompiler::Source module_source(source, origin);
+        if (!v8::ScriptCompiler::CompileModule(st.isolate, &module_source).ToLocal(&loaded->module))
+            return false;
+    } else {
+        // |entry| outlives |cached_data|, which doesn't own the bytes
+        auto cached_data = new v8::ScriptCompiler::CachedData(
+            entry->data, static_cast<int>(entry->size),
+            v8::ScriptCompiler::CachedData::BufferNotOwned);
+        v8::ScriptCompiler::Source module_source(source, origin, cached_data);
+        auto options = v8::ScriptCompiler::kConsumeCodeCache;
+        if (!v8::ScriptCompiler::CompileModule(st.isolate, &module_source, options).ToLocal(&loaded->module))
+            return false;
+        if (module_source.GetCachedData()->rejected) {
+            code_cache.rejected++;
+            code_cache.erase(key);
+            loaded->key = key;
+        } else {
+            code_cache.hits++;
+        }
+    }
+    st.modules[name].Reset(st.isolate, loaded->module);
+    st.module_names.emplace(loaded->module->GetIdentityHash(), name);
+    return true;
+}
+
+// asks the ruby resolver for |specifier|, imported by |referrer| or
+// loaded directly when that's empty; the answer is the source, an
+// array of [name, source] to put it in the module map under another
+// name, or nil; |*source| is left empty for nil
+bool ask_module_resolver(State& st, v8::Local<v8::String> specifier, const std::string& referrer,
+                         std::string *name, v8::Local<v8::Value> *source)
+{
+    v8::Local<v8::Value> referrer_v = v8::Null(st.isolate);
+    auto type = v8::NewStringType::kNormal;
+    if (!referrer.empty() &&
+        !v8::String::NewFromUtf8(st.isolate, referrer.data(), type, referrer.size()).ToLocal(&referrer_v))
+        return false;
+    v8::Local<v8::Value> elements[] = {
+        specifier, referrer_v, v8::Int32::New(st.isolate, MODULE_RESOLVER),
+    };
+    auto request = v8::Array::New(st.isolate, elements, 3);
+    v8::Local<v8::Value> answer;
+    if (!call_ruby(st, request, &answer)) return false;
+    *name = utf8_string(st, specifier);
+    *source = answer;
+    if (answer->IsArray()) {
+        auto pair = answer.As<v8::Array>();
+        v8::Local<v8::Value> name_v;
+        if (!pair->Get(st.context, 0).ToLocal(&name_v)) return false;
+        if (!pair->Get(st.context, 1).ToLocal(source)) return false;
+        if (!name_v->IsString()) {
+            throw_error(st, "module resolver returned a bad name for '" + *name + "'");
+            return false;
+        }
+        *name = utf8_string(st, name_v);
+    }
+    if (!(*source)->IsString()) *source = v8::Local<v8::Value>();
+    return true;
+}
+
+// compiles the modules that the modules in |loaded| import, directly or
+// indirectly, and that aren't in the module map yet; the resolver is
+// asked once per referrer and specifier, its answers are kept in
+// st.module_imports for resolve_module
+bool load_imports(State& st, std::vector<LoadedModule>& loaded, int& cause)
+{
+    std::unordered_set<std::string> seen;
+    for (const LoadedModule& m : loaded)
+        seen.insert(m.name);
+    for (size_t i = 0; i < loaded.size(); i++) {
+        auto module = loaded[i].module;
+        std::string referrer = loaded[i].name; // |loaded| can move
+        auto requests = module->GetModuleRequests();
+        for (int j = 0, n = requests->Length(); j < n; j++) {
+            auto request = requests->Get(st.context, j).As<v8::ModuleRequest>();
+            auto specifier = request->GetSpecifier();
+            std::string edge = referrer + '\0' + utf8_string(st, specifier);
+            std::string name;
+            auto it = st.module_imports.find(edge);
+            if (it != st.module_imports.end()) {
+                name = it->second;
+            } else {
+                v8::Local<v8::Value> source;
+                cause = RUNTIME_ERROR;
+                if (!ask_module_resolver(st, specifier, referrer, &name, &source)) return false;
+                if (!st.modules.count(name)) {
+                    if (source.IsEmpty()) {
+                        throw_error(st, "cannot resolve module '" + utf8_string(st, specifier) +
+                                        "' imported from '" + referrer + "'");
+                        return false;
+                    }
+                    LoadedModule m;
+                    cause = PARSE_ERROR;
+                    if (!compile_module(st, name, source.As<v8::String>(), &m)) return false;
+                    seen.insert(name);
+                    loaded.push_back(m);
+                }
+                st.module_imports.emplace(edge, name);
+            }
+            // left behind by an earlier load that failed halfway
+            auto target = st.modules.find(name);
+            if (target == st.modules.end() || seen.count(name)) continue;
+            auto target_module = target->second.Get(st.isolate);
+            if (target_module->GetStatus() != v8::Module::kUninstantiated) continue;
+            seen.insert(name);
+            loaded.push_back(LoadedModule{target_module, name, 0});
+        }
+    }
+    return true;
+}
+
+// InstantiateModule callback; everything was resolved by load_imports
+v8::MaybeLocal<v8::Module> resolve_module(v8::Local<v8::Context> context,
+                                          v8::Local<v8::String> specifier,
+                                          v8::Local<v8::FixedArray> import_attributes,
+                                          v8::Local<v8::Module> referrer)
+{
+    auto isolate = context->GetIsolate();
+    State& st = *static_cast<State*>(isolate->GetData(0));
+    auto spec = utf8_string(st, specifier);
+    auto range = st.module_names.equal_range(referrer->GetIdentityHash());
+    for (auto it = range.first; it != range.second; ++it) {
+        auto m = st.modules.find(it->second);
+        if (m == st.modules.end() || m->second != referrer) continue;
+        auto edge = st.module_imports.find(it->second + '\0' + spec);
+        if (edge == st.module_imports.end()) break;
+        auto target = st.modules.find(edge->second);
+        if (target == st.modules.end()) break;
+        return target->second.Get(isolate);
+    }
+    throw_error(st, "cannot resolve module '" + spec + "'");
+    return v8::MaybeLocal<v8::Module>();
+}
+
+// import() callback; asking the ruby resolver from here would mean
+// compiling and evaluating modules from inside whatever JS is running,
+// so only modules that v8_load_module has evaluated can be imported,
+// by their name or by the specifier their importer resolved earlier
+v8::MaybeLocal<v8::Promise> import_module_dynamically(v8::Local<v8::Context> context,
+                                                      v8::Local<v8::Data> host_defined_options,
+                                                      v8::Local<v8::Value> resource_name,
+                                                      v8::Local<v8::String> specifier,
+                                                      v8::Local<v8::FixedArray> import_attributes)
+{
+    auto isolate = context->GetIsolate();
+    State& st = *static_cast<State*>(isolate->GetData(0));
+    v8::Local<v8::Promise::Resolver> resolver;
+    if (!v8::Promise::Resolver::New(context).ToLocal(&resolver))
+        return v8::MaybeLocal<v8::Promise>();
+    auto spec = utf8_string(st, specifier);
+    auto name = spec;
+    if (resource_name->IsString()) {
+        auto edge = st.module_imports.find(utf8_string(st, resource_name) + '\0' + spec);
+        if (edge != st.module_imports.end()) name = edge->second;
+    }
+    v8::Local<v8::Value> result;
+    bool ok = false;
+    auto it = st.modules.find(name);
+    if (it != st.modules.end()) {
+        auto module = it->second.Get(isolate);
+        if (module->GetStatus() == v8::Module::kEvaluated) {
+            result = module->GetModuleNamespace();
+            ok = true;
+        } else if (module->GetStatus() == v8::Module::kErrored) {
+            result = module->GetException();
+        }
+    }
+    if (result.IsEmpty()) {
+        std::string message = "cannot import module '" + spec +
+                              "', dynamic import() only finds modules loaded with Context#load_module";
+        std::vector<char> buf(message.begin(), message.end());
+        result = v8::Exception::Error(string_from_bytes(isolate, buf));
+    }
+    if (ok ? resolver->Resolve(context, result).IsNothing()
+           : resolver->Reject(context, result).IsNothing())
+        return v8::MaybeLocal<v8::Promise>();
+    return resolver->GetPromise();
+}
+
+// request is [name, source] array, source is undefined to ask the
+// resolver for it; a module that's already loaded is not loaded again;
+// response is errback [exports, err] array, exports is a plain
+// object copy of the module namespace
+extern "C" void v8_load_module(State *pst, const uint8_t *p, size_t n)
+{
+    State& st = *pst;
+    v8::TryCatch try_catch(st.isolate);
+    try_catch.SetVerbose(st.verbose_exceptions);
+    v8::HandleScope handle_scope(st.isolate);
+    v8::ValueDeserializer des(st.isolate, p, n);
+    des.ReadHeader(st.context).Check();
+    v8::Local<v8::Value> result;
+    int cause = INTERNAL_ERROR;
+    bool preserve_termination = false;
+    bool nested = st.javascript_call_depth > 0;
+    JavascriptCallScope call_scope(st.javascript_call_depth);
+    if (nested) { // evaluating may have to wait for top-level await
+        throw_nested_await_call(st);
+        cause = RUNTIME_ERROR;
+        goto fail;
+    }
+    {
+        v8::Local<v8::Value> request_v;
+        if (!des.ReadValue(st.context).ToLocal(&request_v)) goto fail;
+        v8::Local<v8::Object> request; // [name, source]
+        if (!request_v->ToObject(st.context).ToLocal(&request)) goto fail;
+        v8::Local<v8::Value> name_v;
+        if (!request->Get(st.context, 0).ToLocal(&name_v)) goto fail;
+        v8::Local<v8::Value> source_v;
+        if (!request->Get(st.context, 1).ToLocal(&source_v)) goto fail;
+        if (!name_v->IsString()) goto fail;
+        std::string name = utf8_string(st, name_v);
+        std::vector<LoadedModule> loaded;
+        v8::Local<v8::Module> module;
+        auto it = st.modules.find(name);
+        if (it != st.modules.end()) {
+            module = it->second.Get(st.isolate);
+            if (module->GetStatus() == v8::Module::kUninstantiated)
+                loaded.push_back(LoadedModule{module, name, 0});
+        } else {
+            cause = RUNTIME_ERROR;
+            if (!source_v->IsString()) {
+                std::string ignored; // loaded under the name it was asked for
+                if (!ask_module_resolver(st, name_v.As<v8::String>(), std::string(),
+                                         &ignored, &source_v)) goto fail;
+                if (source_v.IsEmpty()) {
+                    throw_error(st, "cannot resolve module '" + name + "'");
+                    goto fail;
+                }
+            }
+            LoadedModule m;
+            cause = PARSE_ERROR;
+            if (!compile_module(st, name, source_v.As<v8::String>(), &m)) goto fail;
+            module = m.module;
+            loaded.push_back(m);
+        }
+        if (!load_imports(st, loaded, cause)) goto fail;
+        cause = RUNTIME_ERROR;
+        if (module->GetStatus() == v8::Module::kUninstantiated &&
+            !module->InstantiateModule(st.context, resolve_module).FromMaybe(false))
+            goto fail;
+        v8::Local<v8::Value> result_v;
+        if (!module->Evaluate(st.context).ToLocal(&result_v)) goto fail;
+        if (!await_promise(st, &result_v)) goto fail;
+        // after evaluating so functions compiled lazily by it are included
+        for (const LoadedModule& m : loaded) {
+            if (!m.key) continue;
+            put_code_cache(st, m.key,
+                           v8::ScriptCompiler::CreateCodeCache(m.module->GetUnboundModuleScript()));
+        }
+        // namespace objects are exotic, the serializer doesn't take them
+        auto ns = module->GetModuleNamespace().As<v8::Object>();
+        v8::Local<v8::Array> keys;
+        if (!ns->GetOwnPropertyNames(st.context).ToLocal(&keys)) goto fail;
+        auto exports = v8::Object::New(st.isolate);
+        for (uint32_t i = 0, k = keys->Length(); i < k; i++) {
+            v8::Local<v8::Value> key, value;
+            if (!keys->Get(st.context, i).ToLocal(&key)) goto fail;
+            if (!ns->Get(st.context, key).ToLocal(&value)) goto fail;
+            if (!exports->CreateDataProperty(st.context, key.As<v8::Name>(), value).FromMaybe(false)) goto fail;
+        }
+        result = exports;
+    }
+    cause = NO_ERROR;
+fail:
+    preserve_termination = suspend_termination(st, nested, cause);
+    if (bubble_up_ruby_exception(st, &try_catch)) {
+        restore_termination(st, preserve_termination);
+        return;
+    }
+    if (!cause && try_catch.HasCaught()) cause = RUNTIME_ERROR;
+    if (cause) result = v8::Undefined(st.isolate);
+    auto err = to_error(st, &try_catch, cause);
+    if (!reply(st, result, err)) {
+        assert(try_catch.HasCaught());
+        goto fail; // retry; can be termination exception
+    }
+    restore_termination(st, preserve_termination);
+}
+
+// response is err or empty string; returns true if the caller
+// should replace the contexts before dispatching the next request
+extern "C" int v8_reset(State *pst)
+{
+    State& st = *pst;
+    v8::TryCatch try_catch(st.isolate);
+    v8::HandleScope handle_scope(st.isolate);
+    if (st.javascript_call_depth > 0) {
+        // can't swap out the context while JS is still running in it
+        auto message = v8::String::NewFromUtf8Literal(st.isolate, "reset! called from a callback");
+        st.isolate->ThrowException(v8::Exception::Error(message));
+        reply_retry(st, to_error(st, &try_catch, RUNTIME_ERROR));
+        return false;
+    }
+    // handles point into the old context; keep the handle
+    // slots so stale ids fail instead of hitting new functions
+    for (FunctionHandle& handle : st.functions) {
+        handle.function.Reset();
+        handle.recv.Reset();
+    }
+    st.ruby_exception.Reset();
+    // modules are bound to the old context
+    st.modules.clear();
+    st.module_names.clear();
+    st.module_imports.clear();
+    if (single_threaded) {
+        // v8_single_threaded_enter picks them up on the next request
+        v8::HandleScope handle_scope(st.isolate);
+        new_contexts(st);
+    }
+    reply_retry(st, to_error(st, &try_catch, NO_ERROR));
+    return !single_threaded;
+}
+
+// response is err or empty string; returns true if the context is gone,
+// only v8_snapshot_blob is left then; v8_thread_init (or, in single-threaded
+// mode, v8_single_threaded_enter) makes the blob once the handle scopes
+// around this are closed
+extern "C" int v8_snapshot_seal(State *pst)
+{
+    State& st = *pst;
+    v8::TryCatch try_catch(st.isolate);
+    v8::HandleScope handle_scope(st.isolate);
+    const char *error = nullptr;
+    if (!st.snapshot_creator)
+        error = "not a snapshot builder";
+    else if (st.javascript_call_depth > 0)
+        error = "snapshot sealed from a callback";
+    else if (!st.modules.empty())
+        error = "ES modules can't be snapshotted";
+    if (error) {
+        throw_error(st, error);
+        reply_retry(st, to_error(st, &try_catch, RUNTIME_ERROR));
+        return false;
+    }
+    {
+        // streaming tasks use the isolate, let them run to completion
+        std::unique_lock<std::mutex> lock(st.compile_mtx);
+        st.compile_cv.wait(lock, [&st] { return st.compiles_running == 0; });
+    }
+    // for the contexts made from the snapshot, see new_contexts
+    uint64_t tag = static_cast<uint64_t>(st.epoch) << 32 | static_cast<uint32_t>(st.callbacks);
+    st.context->SetEmbedderData(CALLBACKS_SLOT, v8::BigInt::NewFromUnsigned(st.isolate, tag));
+    st.snapshot_creator->SetDefaultContext(st.context);
+    add_safe_context(*st.snapshot_creator, st.isolate, /*from_snapshot*/true);
+    reply_retry(st, to_error(st, &try_catch, NO_ERROR));
+    // the creator holds on to what goes in the snapshot,
+    // CreateBlob insists that no other handles are left
+    st.compiles.clear();
+    st.functions.clear();
+    st.free_functions.clear();
+    st.ruby_exception.Reset();
+    st.safe_context_function.Reset();
+    st.safe_context.Reset();
+    st.user_map.Reset();
+    st.user_set.Reset();
+    st.persistent_context.Reset();
+    st.snapshot_requested = true;
+    return true;
+}
+
+// the response is <cause> followed by the blob, or by the error message
+// when cause isn't NO_ERROR, the same as v8_snapshot_build's; not
+// serialized, the blob is too big to go through the JS heap and the
+// serializer
+void reply_snapshot(State& st, int cause, v8::StartupData blob, std::vector<char>& errbuf)
+{
+    if (cause) {
+        set_snapshot_error(errbuf, cause);
+        v8_reply(st.ruby_context, reinterpret_cast<const uint8_t*>(errbuf.data()), errbuf.size());
+        return;
+    }
+    const uint8_t ok = NO_ERROR;
+    v8_reply(st.ruby_context, &ok, 1);
+    if (blob.raw_size > 0) {
+        auto data = reinterpret_cast<const uint8_t*>(blob.data);
+        v8_reply(st.ruby_context, data, blob.raw_size); // appends
+    }
+}
+
+// response is <cause> <blob or error message>, see reply_snapshot
+extern "C" void v8_snapshot_blob(State *pst)
+{
+    State& st = *pst;
+    std::vector<char> errbuf;
+    int cause = st.snapshot_blob.data ? NO_ERROR : INTERNAL_ERROR;
+    reply_snapshot(st, cause, st.snapshot_blob, errbuf);
+}
+
 extern "C" void v8_heap_stats(State *pst)
 {
     State& st = *pst;
@@ -892,6 +2309,125 @@ extern "C" void v8_heap_snapshot(State *pst)
     v8_reply(st.ruby_context, os.buf.data(), os.buf.size()); // not serialized because big
 }
 
+// writes chunks straight to a file descriptor as V8 produces them,
+// so memory use doesn't grow with the size of the heap
+struct FdOutputStream : public v8::OutputStream
+{
+    State& st;
+    int fd;
+    int err = 0;
+    bool gzip;
+#ifdef HAVE_ZLIB_H
+    z_stream zs{};
+    std::unique_ptr<uint8_t[]> out;
+#endif
+
+    FdOutputStream(State& st, int fd, bool gzip) : st(st), fd(fd), gzip(gzip)
+    {
+#ifdef HAVE_ZLIB_H
+        if (!gzip) return;
+        out.reset(new uint8_t[65536]);
+        // fastest level, snapshots are hundreds of MB of repetitive JSON
+        // and still compress several times over; 16+ selects gzip framing
+        if (deflateInit2(&zs, Z_BEST_SPEED, Z_DEFLATED, 16+MAX_WBITS, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            err = ENOMEM;
+        }
+#else
+        if (gzip) err = ENOTSUP;
+#endif
+    }
+
+    ~FdOutputStream()
+    {
+#ifdef HAVE_ZLIB_H
+        if (gzip) deflateEnd(&zs);
+#endif
+    }
+
+    bool write_all(const uint8_t *p, size_t n)
+    {
+        while (n > 0) {
+            ssize_t r = write(fd, p, n);
+            if (r < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    // ruby makes pipes and sockets non-blocking; wake up
+                    // now and then in case Context#stop or a ruby interrupt
+                    // wants us to give up on a reader that went away
+                    struct pollfd pfd = {fd, POLLOUT, 0};
+                    if (st.terminate_requested.load()) {
+                        err = ECANCELED;
+                        return false;
+                    }
+                    poll(&pfd, 1, 100);
+                    continue;
+                }
+                err = errno;
+                return false;
+            }
+            p += r;
+            n -= r;
+        }
+        return true;
+    }
+
+#ifdef HAVE_ZLIB_H
+    bool compress(const uint8_t *p, size_t n, int flush)
+    {
+        zs.next_in = const_cast<Bytef*>(p);
+        zs.avail_in = n;
+        do {
+            zs.next_out = out.get();
+            zs.avail_out = 65536;
+            if (deflate(&zs, flush) == Z_STREAM_ERROR) {
+                err = EIO;
+                return false;
+            }
+            if (!write_all(out.get(), 65536 - zs.avail_out)) return false;
+        } while (zs.avail_out == 0);
+        return true;
+    }
+#endif
+
+    void EndOfStream() final
+    {
+#ifdef HAVE_ZLIB_H
+        if (gzip && !err) compress(nullptr, 0, Z_FINISH);
+#endif
+    }
+
+    int GetChunkSize() final { return 65536; }
+
+    WriteResult WriteAsciiChunk(char* data, int size) final
+    {
+        const uint8_t *p = reinterpret_cast<uint8_t*>(data);
+        if (err) return WriteResult::kAbort;
+#ifdef HAVE_ZLIB_H
+        if (gzip) {
+            return compress(p, size, Z_NO_FLUSH) ?
+                WriteResult::kContinue : WriteResult::kAbort;
+        }
+#endif
+        return write_all(p, size) ? WriteResult::kContinue : WriteResult::kAbort;
+    }
+};
+
+// response is the errno, zero on success
+extern "C" void v8_write_heap_snapshot(State *pst, int fd, int gzip)
+{
+    State& st = *pst;
+    v8::HandleScope handle_scope(st.isolate);
+    FdOutputStream os(st, fd, gzip != 0);
+    if (!os.err) {
+        auto snapshot = st.isolate->GetHeapProfiler()->TakeHeapSnapshot();
+        snapshot->Serialize(&os, v8::HeapSnapshot::kJSON);
+        const_cast<v8::HeapSnapshot*>(snapshot)->Delete();
+    }
+    // serialized, raw bytes could start with a callback marker
+    reply_retry(st, v8::Integer::New(st.isolate, os.err));
+}
+
 extern "C" void v8_perform_microtask_checkpoint(State *pst)
 {
     // Leave any termination active so the enclosing v8_call/v8_eval frame
@@ -936,15 +2472,43 @@ fail:
     reply_retry(st, result);
 }
 
-int snapshot(bool is_warmup, bool verbose_exceptions,
-             const v8::String::Utf8Value& code,
+// registers |isolate| with |job| while it runs the snapshot's code;
+// a cancel can land after the code finished, |*cancelled| tells the
+// caller to stop there, with the termination that it left behind
+// cancelled so it doesn't fail what comes next
+struct SnapshotJobScope
+{
+    SnapshotJob& job;
+    v8::Isolate *isolate;
+    bool *cancelled;
+
+    SnapshotJobScope(SnapshotJob& job, v8::Isolate *isolate, bool *cancelled)
+        : job(job), isolate(isolate), cancelled(cancelled)
+    {
+        std::lock_guard<std::mutex> lock(job.mtx);
+        if (job.cancelled) isolate->TerminateExecution();
+        job.isolates.push_back(isolate);
+    }
+
+    ~SnapshotJobScope()
+    {
+        std::lock_guard<std::mutex> lock(job.mtx);
+        auto& v = job.isolates;
+        v.erase(std::find(v.begin(), v.end(), isolate));
+        *cancelled = job.cancelled;
+        if (job.cancelled) isolate->CancelTerminateExecution();
+    }
+};
+
+int snapshot(SnapshotJob& job, bool is_warmup, bool verbose_exceptions,
+             const char *code, size_t code_len,
              v8::StartupData blob, v8::StartupData *result,
              std::vector<char> *errbuf)
 {
     // SnapshotCreator takes ownership of isolate
     v8::Isolate *isolate = v8::Isolate::Allocate();
     v8::StartupData *existing_blob = is_warmup ? &blob : nullptr;
-    v8::SnapshotCreator snapshot_creator(isolate, nullptr, existing_blob);
+    v8::SnapshotCreator snapshot_creator(isolate, external_references, existing_blob);
     v8::Isolate::Scope isolate_scope(isolate);
     v8::HandleScope handle_scope(isolate);
     v8::TryCatch try_catch(isolate);
@@ -956,12 +2520,15 @@ int snapshot(bool is_warmup, bool verbose_exceptions,
         ? v8::SnapshotCreator::FunctionCodeHandling::kKeep
         : v8::SnapshotCreator::FunctionCodeHandling::kClear;
     int cause = INTERNAL_ERROR;
+    bool cancelled = false;
     {
+        SnapshotJobScope job_scope(job, isolate, &cancelled);
         auto context = v8::Context::New(isolate);
         v8::Context::Scope context_scope(context);
         v8::Local<v8::String> source;
         auto type = v8::NewStringType::kNormal;
-        if (!v8::String::NewFromUtf8(isolate, *code, type, code.length()).ToLocal(&source)) {
+        if (code_len > static_cast<size_t>(std::numeric_limits<int>::max()) ||
+            !v8::String::NewFromUtf8(isolate, code, type, static_cast<int>(code_len)).ToLocal(&source)) {
             v8::String::Utf8Value s(isolate, try_catch.Exception());
             if (!set_error_message(*errbuf, cause, s))
                 set_error_message(*errbuf, cause, "unexpected failure");
@@ -976,6 +2543,11 @@ int snapshot(bool is_warmup, bool verbose_exceptions,
         cause = RUNTIME_ERROR;
         if (script->Run(context).IsEmpty()) {
         err:
+            if (try_catch.HasTerminated()) { // v8_snapshot_job_cancel
+                cause = TERMINATED_ERROR;
+                set_error_message(*errbuf, cause, "terminated");
+                goto fail;
+            }
             auto m = try_catch.Message();
             v8::String::Utf8Value s(isolate, m->Get());
             v8::String::Utf8Value name(isolate, m->GetScriptResourceName());
@@ -996,145 +2568,93 @@ int snapshot(bool is_warmup, bool verbose_exceptions,
         cause = INTERNAL_ERROR;
         if (!is_warmup) snapshot_creator.SetDefaultContext(context);
     }
+    if (cancelled) {
+        cause = TERMINATED_ERROR;
+        set_error_message(*errbuf, cause, "terminated");
+        goto fail;
+    }
     if (is_warmup) {
         isolate->ContextDisposedNotification(false);
         auto context = v8::Context::New(isolate);
         snapshot_creator.SetDefaultContext(context);
     }
+    add_safe_context(snapshot_creator, isolate, is_warmup);
     *result = snapshot_creator.CreateBlob(mode);
     cause = NO_ERROR;
 fail:
     return cause;
 }
 
-// response is errback [result, err] array
+extern "C" SnapshotJob *v8_snapshot_job_new(void)
+{
+    return new SnapshotJob;
+}
+
+extern "C" void v8_snapshot_job_cancel(SnapshotJob *job)
+{
+    std::lock_guard<std::mutex> lock(job->mtx);
+    job->cancelled = true;
+    for (v8::Isolate *isolate : job->isolates)
+        isolate->TerminateExecution();
+}
+
+extern "C" void v8_snapshot_job_free(SnapshotJob *job)
+{
+    delete job;
+}
+
+// runs on the calling thread in an isolate of its own; V8 must be
+// initialized; |blob| is the snapshot to warm up, the caller keeps it
+// alive; |*out| is the new blob, or the error message when the return
+// value isn't NO_ERROR, free it with v8_snapshot_free
 // note: currently needs --stress_snapshot in V8 debug builds
 // to work around a buggy check in the snapshot deserializer
-extern "C" void v8_snapshot(State *pst, const uint8_t *p, size_t n)
+extern "C" int v8_snapshot_build(SnapshotJob *job, int warmup, int verbose_exceptions,
+                                 const uint8_t *blob, size_t blob_len,
+                                 const uint8_t *code, size_t code_len,
+                                 uint8_t **out, size_t *out_len)
 {
-    State& st = *pst;
-    v8::TryCatch try_catch(st.isolate);
-    try_catch.SetVerbose(st.verbose_exceptions);
-    v8::HandleScope handle_scope(st.isolate);
-    v8::ValueDeserializer des(st.isolate, p, n);
-    des.ReadHeader(st.context).Check();
-    v8::Local<v8::Value> result;
-    v8::StartupData blob{nullptr, 0};
-    int cause = INTERNAL_ERROR;
+    v8::StartupData init{nullptr, 0}, result{nullptr, 0};
     std::vector<char> errbuf;
-    {
-        v8::Local<v8::Value> code_v;
-        if (!des.ReadValue(st.context).ToLocal(&code_v)) goto fail;
-        v8::String::Utf8Value code(st.isolate, code_v);
-        if (!*code) goto fail;
-        v8::StartupData init{nullptr, 0};
-        cause = snapshot(/*is_warmup*/false, st.verbose_exceptions, code, init, &blob, &errbuf);
-        if (cause) goto fail;
-    }
-    if (blob.data) {
-        auto data = reinterpret_cast<const uint8_t*>(blob.data);
-        auto type = v8::NewStringType::kNormal;
-        bool ok = v8::String::NewFromOneByte(st.isolate, data, type,
-                                             blob.raw_size).ToLocal(&result);
-        delete[] blob.data;
-        blob = v8::StartupData{nullptr, 0};
-        if (!ok) goto fail;
-    }
-    cause = NO_ERROR;
-fail:
-    if (st.terminate_requested.exchange(0) ||
-        st.isolate->IsExecutionTerminating()) {
-        st.isolate->CancelTerminateExecution();
-        cause = st.err_reason ? st.err_reason : TERMINATED_ERROR;
-        st.err_reason = NO_ERROR;
-    }
-    if (!cause && try_catch.HasCaught()) cause = RUNTIME_ERROR;
-    if (cause) result = v8::Undefined(st.isolate);
-    v8::Local<v8::Value> err;
-    if (!errbuf.empty()) {
-        err = string_from_bytes(st.isolate, errbuf);
-    } else {
-        err = to_error(st, &try_catch, cause);
+    int cause = INTERNAL_ERROR;
+    *out = nullptr;
+    *out_len = 0;
+    if (blob_len <= static_cast<size_t>(std::numeric_limits<int>::max())) {
+        init = v8::StartupData{reinterpret_cast<const char*>(blob), static_cast<int>(blob_len)};
+        cause = snapshot(*job, warmup != 0, verbose_exceptions != 0,
+                         reinterpret_cast<const char*>(code), code_len,
+                         init, &result, &errbuf);
     }
-    if (!reply(st, result, err)) {
-        assert(try_catch.HasCaught());
-        goto fail; // retry; can be termination exception
+    if (cause == NO_ERROR) {
+        *out = reinterpret_cast<uint8_t*>(const_cast<char*>(result.data));
+        *out_len = result.raw_size;
+        return cause;
     }
+    delete[] result.data;
+    set_snapshot_error(errbuf, cause);
+    *out = new uint8_t[errbuf.size()];
+    *out_len = errbuf.size();
+    memcpy(*out, errbuf.data(), errbuf.size());
+    return cause;
 }
 
-extern "C" void v8_warmup(State *pst, const uint8_t *p, size_t n)
+extern "C" void v8_snapshot_free(uint8_t *p)
 {
-    State& st = *pst;
-    v8::TryCatch try_catch(st.isolate);
-    try_catch.SetVerbose(st.verbose_exceptions);
-    v8::HandleScope handle_scope(st.isolate);
-    std::vector<uint8_t> storage;
-    v8::ValueDeserializer des(st.isolate, p, n);
-    des.ReadHeader(st.context).Check();
-    v8::Local<v8::Value> result;
-    v8::StartupData blob{nullptr, 0};
-    int cause = INTERNAL_ERROR;
-    std::vector<char> errbuf;
-    {
-        v8::Local<v8::Value> request_v;
-        if (!des.ReadValue(st.context).ToLocal(&request_v)) goto fail;
-        v8::Local<v8::Object> request; // [snapshot, warmup_code]
-        if (!request_v->ToObject(st.context).ToLocal(&request)) goto fail;
-        v8::Local<v8::Value> blob_data_v;
-        if (!request->Get(st.context, 0).ToLocal(&blob_data_v)) goto fail;
-        v8::Local<v8::String> blob_data;
-        if (!blob_data_v->ToString(st.context).ToLocal(&blob_data)) goto fail;
-        assert(blob_data->IsOneByte());
-        assert(blob_data->ContainsOnlyOneByte());
-        if (const size_t len = blob_data->Length()) {
-            auto flags = v8::String::NO_NULL_TERMINATION
-                       | v8::String::PRESERVE_ONE_BYTE_NULL;
-            storage.resize(len);
-            blob_data->WriteOneByte(st.isolate, storage.data(), 0, len, flags);
-        }
-        v8::Local<v8::Value> code_v;
-        if (!request->Get(st.context, 1).ToLocal(&code_v)) goto fail;
-        v8::String::Utf8Value code(st.isolate, code_v);
-        if (!*code) goto fail;
-        auto data = reinterpret_cast<const char*>(storage.data());
-        auto size = static_cast<int>(storage.size());
-        v8::StartupData init{data, size};
-        cause = snapshot(/*is_warmup*/true, st.verbose_exceptions, code, init, &blob, &errbuf);
-        if (cause) goto fail;
-    }
-    if (blob.data) {
-        auto data = reinterpret_cast<const uint8_t*>(blob.data);
-        auto type = v8::NewStringType::kNormal;
-        bool ok = v8::String::NewFromOneByte(st.isolate, data, type,
-                                             blob.raw_size).ToLocal(&result);
-        delete[] blob.data;
-        blob = v8::StartupData{nullptr, 0};
-        if (!ok) goto fail;
-    }
-    cause = NO_ERROR;
-fail:
-    if (st.terminate_requested.exchange(0) ||
-        st.isolate->IsExecutionTerminating()) {
-        st.isolate->CancelTerminateExecution();
-        cause = st.err_reason ? st.err_reason : TERMINATED_ERROR;
-        st.err_reason = NO_ERROR;
-    }
-    if (!cause && try_catch.HasCaught()) cause = RUNTIME_ERROR;
-    if (cause) result = v8::Undefined(st.isolate);
-    v8::Local<v8::Value> err;
-    if (!errbuf.empty()) {
-        err = string_from_bytes(st.isolate, errbuf);
-    } else {
-        err = to_error(st, &try_catch, cause);
-    }
-    if (!reply(st, result, err)) {
-        assert(try_catch.HasCaught());
-        goto fail; // retry; can be termination exception
-    }
+    delete[] reinterpret_cast<char*>(p);
+}
+
+// cheaper than v8_heap_stats, no reply
+extern "C" int64_t v8_used_heap_size(State *pst)
+{
+    v8::HeapStatistics s;
+    pst->isolate->GetHeapStatistics(&s);
+    return static_cast<int64_t>(s.used_heap_size());
 }
 
 extern "C" void v8_low_memory_notification(State *pst)
 {
+    if (pst->snapshot_requested)
+        return; // the heap is in the blob now, see v8_snapshot_seal
     pst->isolate->LowMemoryNotification();
 }
 
@@ -1190,17 +2710,19 @@ extern "C" void v8_single_threaded_enter(State *pst, Context *c, void (*f)(Conte
     State& st = *pst;
     v8::Locker locker(st.isolate);
     v8::Isolate::Scope isolate_scope(st.isolate);
-    v8::HandleScope handle_scope(st.isolate);
+    if (st.snapshot_requested) {
+        f(c); // no context left, only v8_snapshot_blob
+        return;
+    }
     {
-        st.safe_context_function = v8::Local<v8::Function>::New(st.isolate, st.persistent_safe_context_function);
-        st.safe_context = v8::Local<v8::Context>::New(st.isolate, st.persistent_safe_context);
+        v8::HandleScope handle_scope(st.isolate);
         st.context = v8::Local<v8::Context>::New(st.isolate, st.persistent_context);
         v8::Context::Scope context_scope(st.context);
         f(c);
         st.context = v8::Local<v8::Context>();
-        st.safe_context = v8::Local<v8::Context>();
-        st.safe_context_function = v8::Local<v8::Function>();
     }
+    if (st.snapshot_requested) // see v8_snapshot_seal
+        create_snapshot_blob(st);
 }
 
 extern "C" void v8_single_threaded_dispose(struct State *pst)
@@ -1208,19 +2730,52 @@ extern "C" void v8_single_threaded_dispose(struct State *pst)
     delete pst; // see State::~State() below
 }
 
+extern "C" void v8_code_cache_stats(CodeCacheStats *stats)
+{
+    stats->hits = code_cache.hits.load();
+    stats->misses = code_cache.misses.load();
+    stats->rejected = code_cache.rejected.load();
+    stats->disk_hits = code_cache.disk_hits.load();
+    stats->disk_writes = code_cache.disk_writes.load();
+    std::lock_guard<std::mutex> lock(code_cache.mtx);
+    stats->entries = code_cache.entries.size();
+    stats->bytes = code_cache.bytes;
+}
+
+extern "C" void v8_code_cache_clear(void)
+{
+    std::lock_guard<std::mutex> lock(code_cache.mtx);
+    code_cache.entries.clear();
+    code_cache.order.clear();
+    code_cache.bytes = 0;
+}
+
 } // namespace anonymous
 
 State::~State()
 {
+    {
+        // streaming tasks use the isolate, let them run to completion
+        std::unique_lock<std::mutex> lock(compile_mtx);
+        compile_cv.wait(lock, [this] { return compiles_running == 0; });
+    }
     {
         v8::Locker locker(isolate);
         v8::Isolate::Scope isolate_scope(isolate);
-        persistent_safe_context_function.Reset();
-        persistent_safe_context.Reset();
+        compiles.clear();
+        modules.clear();
+        safe_context_function.Reset();
+        safe_context.Reset();
+        user_map.Reset();
+        user_set.Reset();
         persistent_context.Reset();
         ruby_exception.Reset();
+        functions.clear();
+        if (snapshot_creator) {
+            isolate->Enter(); // the creator exits it once more
+            snapshot_creator.reset();
+        }
     }
     isolate->Dispose();
-    for (Callback *cb : callbacks)
-        delete cb;
+    delete[] snapshot_blob.data;
 }
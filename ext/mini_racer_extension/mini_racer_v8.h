@@ -16,6 +16,19 @@ enum
     TERMINATED_ERROR = 'T',
 };
 
+// flags byte of a background compile request, see v8_compile_start
+enum
+{
+    COMPILE_EAGER    = 1, // compile all functions, not just the top-level code
+    COMPILE_ONE_BYTE = 2, // source is Latin-1 instead of UTF-8
+};
+
+// callback id of Context#load_module's resolver, see v8_load_module
+enum
+{
+    MODULE_RESOLVER = -1,
+};
+
 static const uint16_t js_function_marker[] = {0xBFF,'J','a','v','a','S','c','r','i','p','t','F','u','n','c','t','i','o','n'};
 
 // defined in mini_racer_extension.c, opaque to mini_racer_v8.cc
@@ -24,30 +37,68 @@ struct Context;
 // defined in mini_racer_v8.cc, opaque to mini_racer_extension.c
 struct State;
 
+// defined in mini_racer_extension.c, opaque to mini_racer_v8.cc;
+// completion flag of a background compile
+struct Compile;
+
+// defined in mini_racer_v8.cc, opaque to mini_racer_extension.c;
+// a batch of snapshot builds that can be cancelled as a whole
+struct SnapshotJob;
+
 // defined in mini_racer_extension.c
 extern int single_threaded;
 void v8_get_flags(char **p, size_t *n);
-void v8_thread_main(struct Context *c, struct State *pst);
+int v8_thread_main(struct Context *c, struct State *pst); // 1 after reset! or sealing
 void v8_dispatch(struct Context *c);
 void v8_reply(struct Context *c, const uint8_t *p, size_t n);
 void v8_roundtrip(struct Context *c, const uint8_t **p, size_t *n);
+void v8_compile_done(struct Compile *cp); // any thread
+void v8_compile_release(struct Compile *cp); // any thread
+int v8_compile_abandoned(struct Compile *cp); // any thread
+
+struct CodeCacheStats
+{
+    uint64_t hits, misses, rejected, entries, bytes;
+    uint64_t disk_hits, disk_writes;
+};
 
 // defined in mini_racer_v8.cc
 void v8_global_init(void);
 struct State *v8_thread_init(struct Context *c, const uint8_t *snapshot_buf,
                              size_t snapshot_len, int64_t max_memory,
-                             int verbose_exceptions); // calls v8_thread_main
+                             int verbose_exceptions, int code_cache,
+                             const char *code_cache_dir,
+                             int snapshot_builder); // calls v8_thread_main
 void v8_attach(struct State *pst, const uint8_t *p, size_t n);
 void v8_call(struct State *pst, const uint8_t *p, size_t n);
 void v8_call_await(struct State *pst, const uint8_t *p, size_t n);
+void v8_function(struct State *pst, const uint8_t *p, size_t n);
+void v8_function_dispose(struct State *pst, const uint8_t *p, size_t n);
+void v8_invoke(struct State *pst, const uint8_t *p, size_t n);
+void v8_invoke_await(struct State *pst, const uint8_t *p, size_t n);
+void v8_call_many(struct State *pst, const uint8_t *p, size_t n);
 void v8_eval(struct State *pst, const uint8_t *p, size_t n);
 void v8_eval_await(struct State *pst, const uint8_t *p, size_t n);
+void v8_compile_start(struct State *pst, const uint8_t *p, size_t n);
+void v8_compile_finish(struct State *pst, const uint8_t *p, size_t n);
+void v8_load_module(struct State *pst, const uint8_t *p, size_t n);
+int v8_reset(struct State *pst);
+int v8_snapshot_seal(struct State *pst);
+void v8_snapshot_blob(struct State *pst);
 void v8_heap_stats(struct State *pst);
+int64_t v8_used_heap_size(struct State *pst);
 void v8_heap_snapshot(struct State *pst);
+void v8_write_heap_snapshot(struct State *pst, int fd, int gzip);
 void v8_perform_microtask_checkpoint(struct State *pst);
 void v8_pump_message_loop(struct State *pst);
-void v8_snapshot(struct State *pst, const uint8_t *p, size_t n);
-void v8_warmup(struct State *pst, const uint8_t *p, size_t n);
+struct SnapshotJob *v8_snapshot_job_new(void);
+void v8_snapshot_job_cancel(struct SnapshotJob *job); // any thread
+void v8_snapshot_job_free(struct SnapshotJob *job);
+int v8_snapshot_build(struct SnapshotJob *job, int warmup, int verbose_exceptions,
+                      const uint8_t *blob, size_t blob_len,
+                      const uint8_t *code, size_t code_len,
+                      uint8_t **out, size_t *out_len); // any thread
+void v8_snapshot_free(uint8_t *p);
 void v8_low_memory_notification(struct State *pst);
 void v8_terminate_execution(struct State *pst); // called from ruby thread
 void v8_terminate_watchdog(struct State *pst); // called from watchdog thread
@@ -55,6 +106,8 @@ void v8_cancel_watchdog_termination(struct State *pst); // called from v8 thread
 void v8_cancel_terminate_execution(struct State *pst); // called from ruby thread
 void v8_single_threaded_enter(struct State *pst, struct Context *c, void (*f)(struct Context *c));
 void v8_single_threaded_dispose(struct State *pst);
+void v8_code_cache_stats(struct CodeCacheStats *stats); // any thread
+void v8_code_cache_clear(void); // any thread
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,315 @@
+// single-producer/single-consumer message ring with futex parking
+//
+// messages are length-prefixed records; small messages are copied into the
+// ring, large ones travel as a pointer to their heap buffer so ownership
+// moves without a copy; the consumer spins briefly before parking and the
+// producer only issues a wakeup when the consumer is actually parked
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define RING_SIZE       (64 * 1024) // power of two
+#define RING_INLINE_MAX (4 * 1024)  // larger messages are passed by pointer
+#define RING_SPIN       256         // minimum polls before parking
+
+enum
+{
+    RING_INLINE   = 0,
+    RING_INDIRECT = 1, // record holds a RingIndirect
+    RING_WRAP     = 2, // skip to the start of the ring
+};
+
+typedef struct RingRecord
+{
+    uint32_t kind, len;
+} RingRecord;
+
+typedef struct RingIndirect
+{
+    uint8_t *buf;
+    uint32_t len, cap;
+} RingIndirect;
+
+typedef struct Ring
+{
+    // |head| is written by the producer, |tail| by the consumer;
+    // padded apart so they don't share a cache line
+    _Atomic uint64_t head;
+    char pad0[56];
+    _Atomic uint64_t tail;
+    char pad1[56];
+    // futex word, bumped by every publish and every ring_wake
+    _Atomic uint32_t seq;
+    atomic_int parked; // consumer is (about to be) asleep on |seq|
+#ifndef __linux__
+    pthread_mutex_t mtx;
+    pthread_cond_t cv;
+#endif
+    uint8_t *data;
+} Ring;
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline int64_t ring_clock_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+static inline uint64_t ring_align(uint64_t n)
+{
+    return (n + 7) & ~(uint64_t)7;
+}
+
+static int ring_init(Ring *r)
+{
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->seq, 0);
+    atomic_init(&r->parked, 0);
+    r->data = malloc(RING_SIZE);
+    if (!r->data)
+        return ENOMEM;
+#ifndef __linux__
+    if (pthread_mutex_init(&r->mtx, NULL)) {
+        free(r->data);
+        return ENOMEM;
+    }
+    if (pthread_cond_init(&r->cv, NULL)) {
+        pthread_mutex_destroy(&r->mtx);
+        free(r->data);
+        return ENOMEM;
+    }
+#endif
+    return 0;
+}
+
+// frees heap buffers of undelivered indirect messages
+static void ring_destroy(Ring *r)
+{
+    RingRecord h;
+    RingIndirect ind;
+    uint64_t tail, head;
+
+    if (!r->data)
+        return;
+    tail = atomic_load(&r->tail);
+    head = atomic_load(&r->head);
+    while (tail != head) {
+        memcpy(&h, &r->data[tail & (RING_SIZE-1)], sizeof(h));
+        if (h.kind == RING_INDIRECT) {
+            memcpy(&ind, &r->data[(tail + sizeof(h)) & (RING_SIZE-1)], sizeof(ind));
+            free(ind.buf);
+        }
+        if (h.kind == RING_WRAP)
+            tail += RING_SIZE - (tail & (RING_SIZE-1));
+        else
+            tail += ring_align(sizeof(h) + h.len);
+    }
+#ifndef __linux__
+    pthread_mutex_destroy(&r->mtx);
+    pthread_cond_destroy(&r->cv);
+#endif
+    free(r->data);
+    r->data = NULL;
+}
+
+static inline int ring_empty(Ring *r)
+{
+    return atomic_load_explicit(&r->head, memory_order_acquire)
+        == atomic_load_explicit(&r->tail, memory_order_relaxed);
+}
+
+// wakes the consumer if it's parked; also used to make it
+// re-check external conditions like interrupts and shutdown
+static void ring_wake(Ring *r)
+{
+    atomic_fetch_add(&r->seq, 1);
+    if (!atomic_load(&r->parked))
+        return; // consumer is spinning or busy, it'll see the update
+#ifdef __linux__
+    syscall(SYS_futex, &r->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+    pthread_mutex_lock(&r->mtx);
+    pthread_cond_signal(&r->cv);
+    pthread_mutex_unlock(&r->mtx);
+#endif
+}
+
+// |timeout| in nanoseconds, negative means forever
+static void ring_park(Ring *r, uint32_t seq, int64_t timeout)
+{
+#ifdef __linux__
+    struct timespec ts, *tsp;
+
+    tsp = NULL;
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000000000;
+        ts.tv_nsec = timeout % 1000000000;
+        tsp = &ts;
+    }
+    syscall(SYS_futex, &r->seq, FUTEX_WAIT_PRIVATE, seq, tsp, NULL, 0);
+#else
+    struct timespec ts;
+
+    pthread_mutex_lock(&r->mtx);
+    if (atomic_load(&r->seq) == seq) {
+        if (timeout >= 0) {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += timeout / 1000000000;
+            ts.tv_nsec += timeout % 1000000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_nsec -= 1000000000;
+                ts.tv_sec++;
+            }
+            pthread_cond_timedwait(&r->cv, &r->mtx, &ts);
+        } else {
+            pthread_cond_wait(&r->cv, &r->mtx);
+        }
+    }
+    pthread_mutex_unlock(&r->mtx);
+#endif
+}
+
+// publishes |b| and takes ownership of its contents; producer only
+static void ring_send(Ring *r, Buf *b)
+{
+    RingIndirect ind;
+    RingRecord h;
+    uint64_t head, off, n;
+
+    h.len = b->len;
+    h.kind = RING_INLINE;
+    if (b->len > RING_INLINE_MAX && b->buf != b->buf_s) {
+        h.kind = RING_INDIRECT;
+        h.len = sizeof(ind);
+    }
+    n = ring_align(sizeof(h) + h.len);
+    head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    off = head & (RING_SIZE-1);
+    // a record never straddles the end of the ring
+    if (off + n > RING_SIZE)
+        n += RING_SIZE - off;
+    // the protocol is request/response so the ring is nearly always empty
+    while (head + n - atomic_load_explicit(&r->tail, memory_order_acquire) > RING_SIZE)
+        sched_yield();
+    if (off + ring_align(sizeof(h) + h.len) > RING_SIZE) {
+        RingRecord wrap = {RING_WRAP, 0};
+        memcpy(&r->data[off], &wrap, sizeof(wrap));
+        head += RING_SIZE - off;
+        off = 0;
+    }
+    memcpy(&r->data[off], &h, sizeof(h));
+    if (h.kind == RING_INDIRECT) {
+        ind.buf = b->buf;
+        ind.len = b->len;
+        ind.cap = b->cap;
+        memcpy(&r->data[off + sizeof(h)], &ind, sizeof(ind));
+        buf_init(b); // ownership moved to the consumer
+    } else {
+        memcpy(&r->data[off + sizeof(h)], b->buf, b->len);
+        buf_reset(b);
+    }
+    head += ring_align(sizeof(h) + h.len);
+    atomic_store_explicit(&r->head, head, memory_order_release);
+    ring_wake(r);
+}
+
+// moves the next message into |b|, which must be empty;
+// returns -1 if there is none; consumer only
+static int ring_recv(Ring *r, Buf *b)
+{
+    RingIndirect ind;
+    RingRecord h;
+    uint64_t tail, head, off;
+
+    tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail == head)
+        return -1;
+    off = tail & (RING_SIZE-1);
+    memcpy(&h, &r->data[off], sizeof(h));
+    if (h.kind == RING_WRAP) {
+        tail += RING_SIZE - off;
+        off = 0;
+        memcpy(&h, &r->data[off], sizeof(h));
+    }
+    buf_reset(b);
+    if (h.kind == RING_INDIRECT) {
+        memcpy(&ind, &r->data[off + sizeof(h)], sizeof(ind));
+        b->buf = ind.buf;
+        b->len = ind.len;
+        b->cap = ind.cap;
+    } else if (buf_put(b, &r->data[off + sizeof(h)], h.len)) {
+        abort(); // can't happen, inline messages are small
+    }
+    tail += ring_align(sizeof(h) + h.len);
+    atomic_store_explicit(&r->tail, tail, memory_order_release);
+    return 0;
+}
+
+// waits until a message is available or |*a| or |*b| (if not NULL) become
+// non-zero; polls for at least |spin| nanoseconds before parking;
+// |timeout| in nanoseconds, negative means forever;
+// returns 0 if a message is available, EINTR or ETIMEDOUT otherwise
+static int ring_wait(Ring *r, atomic_int *a, atomic_int *b, int64_t spin, int64_t timeout)
+{
+    int64_t t0, t1;
+    uint32_t seq;
+    int i;
+
+    t0 = spin > 0 ? ring_clock_ns() : 0;
+    for (i = 0;; i++) {
+        if (!ring_empty(r))
+            return 0;
+        if (atomic_load(a) || (b && atomic_load(b)))
+            return EINTR;
+        if (i >= RING_SPIN && (spin <= 0 || ((i & 63) == 0 && ring_clock_ns() - t0 >= spin)))
+            break;
+        cpu_relax();
+    }
+    t0 = ring_clock_ns();
+    for (;;) {
+        seq = atomic_load(&r->seq);
+        atomic_store(&r->parked, 1);
+        if (!ring_empty(r) || atomic_load(a) || (b && atomic_load(b))) {
+            atomic_store(&r->parked, 0);
+            if (!ring_empty(r))
+                return 0;
+            return EINTR;
+        }
+        ring_park(r, seq, timeout);
+        atomic_store(&r->parked, 0);
+        if (!ring_empty(r))
+            return 0;
+        if (atomic_load(a) || (b && atomic_load(b)))
+            return EINTR;
+        if (timeout >= 0) {
+            t1 = ring_clock_ns();
+            if (t1 - t0 >= timeout)
+                return ETIMEDOUT;
+            timeout -= t1 - t0;
+            t0 = t1;
+        }
+    }
+}
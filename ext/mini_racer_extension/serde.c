@@ -24,12 +24,29 @@ static void des_string8(void *arg, const uint8_t *s, size_t n);
 // des_string16: |n| is in bytes, not code points
 static void des_string16(void *arg, const void *s, size_t n);
 static void des_arraybuffer(void *arg, const void *s, size_t n);
-static void des_array_begin(void *arg);
+// des_typed_array: a view of |type| (see des1) on arraybuffer |s|
+// des_typed_array: |off| and |len| are in bytes, not elements
+static void des_typed_array(void *arg, const void *s, size_t n,
+                            int type, uint64_t off, uint64_t len);
+// des_typed_array_ref: same but on an arraybuffer that was seen before
+static void des_typed_array_ref(void *arg, uint32_t id,
+                                int type, uint64_t off, uint64_t len);
+// des_array_begin: |count| is the expected element count, a hint;
+// des_array_begin: zero if not known up front
+static void des_array_begin(void *arg, uint32_t count);
+// des_ints: called instead of des_int for runs of array elements
+// des_ints: |n| is at most 64
+static void des_ints(void *arg, const int64_t *v, size_t n);
+// des_nums: same for des_num
+static void des_nums(void *arg, const double *v, size_t n);
 static void des_array_end(void *arg);
 // called if e.g. an array object has named properties
 static void des_named_props_begin(void *arg);
 static void des_named_props_end(void *arg);
-static void des_object_begin(void *arg);
+// des_object_begin: |count| is the expected property count, a hint;
+// des_object_begin: zero if not known up front, which is always for
+// des_object_begin: plain objects, their count comes at the end
+static void des_object_begin(void *arg, uint32_t count);
 static void des_object_end(void *arg);
 static void des_map_begin(void *arg);
 static void des_map_end(void *arg);
@@ -136,6 +153,19 @@ static inline void w(Ser *s, const void *p, size_t n)
         snprintf(s->err, sizeof(s->err), "out of memory");
 }
 
+// reserves |n| bytes for the caller to fill in; NULL on error
+static inline uint8_t *w_reserve(Ser *s, size_t n)
+{
+    if (*s->err)
+        return NULL;
+    if (buf_grow(&s->b, n)) {
+        snprintf(s->err, sizeof(s->err), "out of memory");
+        return NULL;
+    }
+    s->b.len += n;
+    return &s->b.buf[s->b.len - n];
+}
+
 static inline void w_byte(Ser *s, uint8_t c)
 {
     w(s, &c, 1);
@@ -329,16 +359,21 @@ static void ser_string16(Ser *s, const void *p, size_t n)
     w(s, p, n);
 }
 
-// Uint8Array: ArrayBuffer header + data + typed array view descriptor
-static void ser_uint8array(Ser *s, const void *p, size_t n)
+static void ser_arraybuffer(Ser *s, const void *p, size_t n)
 {
     w_byte(s, 'B');     // ArrayBuffer tag
     w_varint(s, n);     // byte length
     w(s, p, n);         // raw bytes
+}
+
+// typed array view on the arraybuffer (or ref to one) that precedes it;
+// |type| is the view tag, see des1
+static void ser_typed_array(Ser *s, int type, size_t off, size_t len)
+{
     w_byte(s, 'V');     // typed array view tag
-    w_byte(s, 'B');     // Uint8Array type
-    w_varint(s, 0);     // byteOffset
-    w_varint(s, n);     // byteLength
+    w_byte(s, type);
+    w_varint(s, off);   // byteOffset
+    w_varint(s, len);   // byteLength
     w_varint(s, 0);     // flags
 }
 
@@ -354,6 +389,18 @@ static void ser_object_end(Ser *s, uint32_t count)
     w_varint(s, count);
 }
 
+static void ser_map_begin(Ser *s)
+{
+    w_byte(s, ';');
+}
+
+// |count| is the number of keys plus values, twice the entry count
+static void ser_map_end(Ser *s, uint32_t count)
+{
+    w_byte(s, ':');
+    w_varint(s, count);
+}
+
 static void ser_object_ref(Ser *s, uint32_t id)
 {
     w_byte(s, '^');
@@ -391,13 +438,83 @@ static int des1_num(const uint8_t **p, const uint8_t *pe, double *d)
     return 0;
 }
 
+// reads the typed array that follows an arraybuffer or a ref to one;
+// returns 0 if there is none, 1 if there is, -1 on error
+static int des1_view(char (*err)[64], const uint8_t **p, const uint8_t *pe,
+                     int *type, uint64_t *off, uint64_t *len)
+{
+    uint64_t t;
+
+    if (pe-*p < 2)
+        return 0;
+    if (**p != 'V')
+        return 0;
+    (*p)++;
+    *type = *(*p)++;
+    // ? DataView
+    // B Uint8Array
+    // C Uint8ClampedArray
+    // D Uint32Array
+    // F Float64Array
+    // Q BigUint64Array
+    // W Uint16Array
+    // b Int8Array
+    // d Int32Array
+    // f Float32Array
+    // h Float16Array
+    // q BigInt64Array
+    // w Int16Array
+    if (!*type || !strchr("?BCDFQWbdfhqw", *type))
+        return bail(err, "bad typed array");
+    if (r_varint(p, pe, off)) // byteOffset
+        return bail(err, "bad varint");
+    if (r_varint(p, pe, len)) // byteLength
+        return bail(err, "bad varint");
+    if (r_varint(p, pe, &t)) // flags, only non-zero when backed by RAB
+        return bail(err, "bad varint");
+    return 1;
+}
+
+// decodes up to |*n| array elements as long as they're numbers;
+// batches them so each doesn't have to go through des1 and put()
+static int des1_nums(char (*err)[64], const uint8_t **p, const uint8_t *pe,
+                     void *arg, uint64_t *n)
+{
+    int64_t iv[64];
+    double dv[64];
+    size_t k;
+
+    while (*n > 0 && *p < pe) {
+        if (**p == 'I') {
+            for (k = 0; k < 64 && *n > 0 && *p < pe && **p == 'I'; k++, (*n)--) {
+                (*p)++;
+                if (r_zigzag(p, pe, &iv[k]))
+                    return bail(err, "bad varint");
+            }
+            des_ints(arg, iv, k);
+        } else if (**p == 'N') {
+            for (k = 0; k < 64 && *n > 0 && *p < pe && **p == 'N'; k++, (*n)--) {
+                (*p)++;
+                if (des1_num(p, pe, &dv[k]))
+                    return bail(err, "input too short");
+            }
+            des_nums(arg, dv, k);
+        } else {
+            break;
+        }
+    }
+    return 0;
+}
+
 static int des1(char (*err)[64], const uint8_t **p, const uint8_t *pe,
                 void *arg, int depth)
 {
+    const uint8_t *q;
     uint64_t s, t, u;
     uint8_t c;
     int64_t i;
     double d;
+    int k;
 
     if (depth < 0)
         return bail(err, "too much recursion");
@@ -419,10 +536,18 @@ again:
     case '^':
         if (r_varint(p, pe, &u))
             goto bad_varint;
-        des_object_ref(arg, u);
         // object refs can (but need not be) followed by a typed array
-        // that is a view over the arraybufferview
-        goto typed_array;
+        // that is a view over the referenced arraybuffer
+        switch (des1_view(err, p, pe, &k, &s, &t)) {
+        case -1:
+            return -1;
+        case 1:
+            des_typed_array_ref(arg, u, k, s, t);
+            break;
+        default:
+            des_object_ref(arg, u);
+        }
+        break;
     case '0':
         des_null(arg);
         break;
@@ -433,10 +558,17 @@ again:
         if (r_varint(p, pe, &u))
             goto bad_varint;
         t = u;
-        des_array_begin(arg);
-        while (u--) {
+        // every element takes up at least one byte
+        des_array_begin(arg, u < (uint64_t)(pe-*p) ? u : (uint64_t)(pe-*p));
+        while (u > 0) {
             if (*p >= pe)
                 goto too_short;
+            if (**p == 'I' || **p == 'N') {
+                if (des1_nums(err, p, pe, arg, &u))
+                    return -1;
+                continue;
+            }
+            u--;
             // '-' is 'the hole', a marker for representing absent
             // elements that is inserted when a dense array turns
             // sparse during serialization; we replace it with undefined
@@ -482,47 +614,25 @@ again:
                 goto bad_varint;
         if (pe-*p < (int64_t)u)
             goto too_short;
-        des_arraybuffer(arg, *p, u);
+        q = *p;
         *p += u;
         // arraybuffers can (but need not be) followed by a typed array
-        // that is a view over the arraybufferview
-        // typed arrays aren't efficiently representable in ruby, and the
-        // concept of a memory view is wholly unrepresentable, so we
-        // simply skip over them; callers get just the arraybuffer
-    typed_array:
-        if (pe-*p < 2)
-            break;
-        if (**p != 'V')
+        // that is a view over the arraybuffer
+        switch (des1_view(err, p, pe, &k, &s, &t)) {
+        case -1:
+            return -1;
+        case 1:
+            des_typed_array(arg, q, u, k, s, t);
             break;
-        (*p)++;
-        c = *(*p)++;
-        // ? DataView
-        // B Uint8Array
-        // C Uint8ClampedArray
-        // D Uint32Array
-        // F Float64Array
-        // Q BigUint64Array
-        // W Uint16Array
-        // b Int8Array
-        // d Int32Array
-        // f Float32Array
-        // h Float16Array
-        // q BigInt64Array
-        // w Int16Array
-        if (!strchr("?BCDFQWbdfhqw", **p))
-            return bail(err, "bad typed array");
-        if (r_varint(p, pe, &t)) // byteOffset
-            goto bad_varint;
-        if (r_varint(p, pe, &t)) // byteLength
-            goto bad_varint;
-        if (r_varint(p, pe, &t)) // flags, only non-zero when backed by RAB
-            goto bad_varint;
+        default:
+            des_arraybuffer(arg, q, u);
+        }
         break;
     case 'a': // sparse array
         // total element count; ignored because we drop sparse entries
         if (r_varint(p, pe, &t))
             goto bad_varint;
-        des_array_begin(arg);
+        des_array_begin(arg, 0);
         for (u = s = 0;;) {
             if (*p >= pe)
                 goto too_short;
@@ -654,7 +764,7 @@ again:
         *p += u;
         break;
     case 'o':
-        des_object_begin(arg);
+        des_object_begin(arg, 0);
         for (u = 0;; u++) {
             if (pe-*p < 1)
                 goto too_short;
@@ -692,7 +802,7 @@ again:
         des_map_end(arg);
         break;
     case '\'': // Set
-        des_array_begin(arg);
+        des_array_begin(arg, 0);
         for (u = 0; /*empty*/; u++) {
             if (*p >= pe)
                 goto too_short;
@@ -713,7 +823,7 @@ again:
         // longest error is /r[EFRSTU]m<string>c<any>s<string>[.]/ where
         // EFRSTU is one of {Eval,Reference,Range,Syntax,Type,URI}Error
         des_error_begin(arg);
-        des_object_begin(arg);
+        des_object_begin(arg, 0);
         if (*p >= pe)
             goto too_short;
         c = *(*p)++;
@@ -0,0 +1,228 @@
+// Latin-1 and UTF-16LE to UTF-8 conversion for strings coming out of V8,
+// and back for strings going in
+//
+// most strings are pure ASCII, or mostly ASCII with the odd accented or
+// non-latin character; runs of ASCII are detected 16 bytes at a time and
+// copied (latin1) or narrowed (utf16) in one go, the remainder is
+// converted a code unit at a time; strings going into V8 only contain
+// short ASCII runs when they're sent as UTF-16, those aren't worth it
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define TRANSCODE_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON) \
+    && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define TRANSCODE_NEON 1
+#endif
+
+// length of the leading run of ASCII bytes in |s|
+static size_t ascii_len8(const uint8_t *s, size_t n)
+{
+    size_t i;
+
+    i = 0;
+#if defined(TRANSCODE_SSE2)
+    for (; i + 16 <= n; i += 16)
+        if (_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)&s[i])))
+            break;
+#elif defined(TRANSCODE_NEON)
+    for (; i + 16 <= n; i += 16)
+        if (vmaxvq_u8(vld1q_u8(&s[i])) > 127)
+            break;
+#else
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, &s[i], 8);
+        if (w & 0x8080808080808080ull)
+            break;
+    }
+#endif
+    for (; i < n && s[i] < 128; i++);
+    return i;
+}
+
+// copies the leading ASCII bytes of |s| to |d|, returns how many
+static size_t ascii_run8(uint8_t *d, const uint8_t *s, size_t n)
+{
+    n = ascii_len8(s, n);
+    memcpy(d, s, n);
+    return n;
+}
+
+// copies the leading ASCII code units of |s| to |d| as bytes, returns
+// how many; |s| is not word aligned, |n| is in code units
+static size_t ascii_run16(uint8_t *d, const uint8_t *s, size_t n)
+{
+    size_t i;
+
+    i = 0;
+#if defined(TRANSCODE_SSE2)
+    const __m128i hi = _mm_set1_epi16((short)0xFF80);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[2*i]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, hi), zero)) != 0xFFFF)
+            break;
+        _mm_storel_epi64((__m128i *)&d[i], _mm_packus_epi16(v, v));
+    }
+#elif defined(TRANSCODE_NEON)
+    for (; i + 8 <= n; i += 8) {
+        uint16x8_t v = vreinterpretq_u16_u8(vld1q_u8(&s[2*i]));
+        if (vmaxvq_u16(v) > 127)
+            break;
+        vst1_u8(&d[i], vmovn_u16(v));
+    }
+#endif
+    for (; i < n && s[2*i] < 128 && s[2*i+1] == 0; i++)
+        d[i] = s[2*i];
+    return i;
+}
+
+// number of bytes |s| takes up as UTF-8
+static size_t latin1_utf8_len(const uint8_t *s, size_t n)
+{
+    size_t i, k;
+
+    for (i = k = 0; i < n; i++)
+        k += s[i] >> 7; // vectorizes well enough on its own
+    return n + k;
+}
+
+// |d| must have room for latin1_utf8_len(s, n) bytes; returns end of |d|
+static uint8_t *latin1_to_utf8(uint8_t *d, const uint8_t *s, size_t n)
+{
+    size_t i, k;
+
+    for (i = 0; i < n;) {
+        k = ascii_run8(d, &s[i], n-i);
+        d += k, i += k;
+        for (; i < n && s[i] > 127; i++) {
+            *d++ = 0xC0 | s[i] >> 6;
+            *d++ = 0x80 | (s[i] & 0x3F);
+        }
+    }
+    return d;
+}
+
+// |d| must have room for 3*n bytes; |n| is in code units; returns end
+// of |d|, or NULL if |s| contains an unpaired surrogate
+static uint8_t *utf16le_to_utf8(uint8_t *d, const uint8_t *s, size_t n)
+{
+    uint32_t c, t;
+    size_t i, k;
+
+    for (i = 0; i < n;) {
+        k = ascii_run16(d, &s[2*i], n-i);
+        d += k, i += k;
+        if (i == n)
+            break;
+        c = s[2*i] | s[2*i+1] << 8;
+        i++;
+        if (c < 0x800) {
+            *d++ = 0xC0 | c >> 6;
+            *d++ = 0x80 | (c & 0x3F);
+        } else if (c < 0xD800 || c > 0xDFFF) {
+            *d++ = 0xE0 | c >> 12;
+            *d++ = 0x80 | (c >> 6 & 0x3F);
+            *d++ = 0x80 | (c & 0x3F);
+        } else {
+            if (c > 0xDBFF || i == n)
+                return NULL;
+            t = s[2*i] | s[2*i+1] << 8;
+            if (t < 0xDC00 || t > 0xDFFF)
+                return NULL;
+            i++;
+            c = 0x10000 + ((c - 0xD800) << 10) + (t - 0xDC00);
+            *d++ = 0xF0 | c >> 18;
+            *d++ = 0x80 | (c >> 12 & 0x3F);
+            *d++ = 0x80 | (c >> 6 & 0x3F);
+            *d++ = 0x80 | (c & 0x3F);
+        }
+    }
+    return d;
+}
+
+// scans valid UTF-8, stores the number of code points in |*nchars|;
+// returns the widest: 0 for ASCII, 1 for Latin-1, 2 for the BMP and
+// 3 for anything wider; the largest byte gives that away because
+// continuation bytes sort below the lead bytes of 2-byte sequences
+// past U+00FF
+static int utf8_width(const uint8_t *s, size_t n, size_t *nchars)
+{
+    size_t i, k;
+    uint8_t m;
+
+    i = k = m = 0;
+#if defined(TRANSCODE_SSE2)
+    __m128i vm = _mm_setzero_si128();
+    const __m128i cont = _mm_set1_epi8(-64); // 0xC0 signed
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&s[i]);
+        vm = _mm_max_epu8(vm, v);
+        k += __builtin_popcount(_mm_movemask_epi8(_mm_cmplt_epi8(v, cont)));
+    }
+    vm = _mm_max_epu8(vm, _mm_srli_si128(vm, 8));
+    vm = _mm_max_epu8(vm, _mm_srli_si128(vm, 4));
+    vm = _mm_max_epu8(vm, _mm_srli_si128(vm, 2));
+    vm = _mm_max_epu8(vm, _mm_srli_si128(vm, 1));
+    m = _mm_cvtsi128_si32(vm);
+#elif defined(TRANSCODE_NEON)
+    uint8x16_t vm = vdupq_n_u8(0);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(&s[i]);
+        vm = vmaxq_u8(vm, v);
+        // 1 for each continuation byte
+        k += vaddvq_u8(vshrq_n_u8(vceqq_u8(vandq_u8(v, vdupq_n_u8(0xC0)), vdupq_n_u8(0x80)), 7));
+    }
+    m = vmaxvq_u8(vm);
+#endif
+    for (; i < n; i++) {
+        k += (s[i] & 0xC0) == 0x80;
+        m = s[i] > m ? s[i] : m;
+    }
+    *nchars = n - k;
+    if (m > 0xEF)
+        return 3;
+    if (m > 0xC3)
+        return 2;
+    return m > 127;
+}
+
+// |s| must be valid UTF-8 with code points <= U+00FF
+static void utf8_to_latin1(uint8_t *d, const uint8_t *s, size_t n)
+{
+    size_t i, k;
+
+    for (i = 0; i < n;) {
+        k = ascii_run8(d, &s[i], n-i);
+        d += k, i += k;
+        for (; i < n && s[i] > 127; i += 2)
+            *d++ = (s[i] & 3) << 6 | (s[i+1] & 0x3F);
+    }
+}
+
+// |s| must be valid UTF-8 with code points <= U+FFFF
+static void utf8_to_utf16le(uint8_t *d, const uint8_t *s, size_t n)
+{
+    uint32_t c;
+    size_t i;
+
+    for (i = 0; i < n;) {
+        c = s[i];
+        if (c < 0x80) {
+            i += 1;
+        } else if (c < 0xE0) {
+            c = (c & 0x1F) << 6 | (s[i+1] & 0x3F);
+            i += 2;
+        } else {
+            c = (c & 0x0F) << 12 | (s[i+1] & 0x3F) << 6 | (s[i+2] & 0x3F);
+            i += 3;
+        }
+        *d++ = c & 0xFF;
+        *d++ = c >> 8;
+    }
+}
@@ -1,7 +1,19 @@
 require "mini_racer/version"
+require "fileutils"
 require "pathname"
 
 module MiniRacer
+  # Persists the code cache of contexts created with `code_cache:` to |dir|,
+  # so that new processes can skip compiling scripts seen by earlier ones.
+  class CodeCache
+    attr_reader :dir
+
+    def initialize(dir)
+      @dir = File.expand_path(dir.to_s)
+      FileUtils.mkdir_p(@dir)
+    end
+  end
+
   class Binary
     attr_reader :data
 
@@ -12,6 +24,120 @@ module MiniRacer
       @data = data
     end
   end
+
+  # A JavaScript typed array other than Uint8Array, which is returned as
+  # a binary String: |length| elements of |type| starting |byte_offset|
+  # bytes into |buffer|, a binary String with the whole ArrayBuffer.
+  # Elements are little-endian, like on the hosts V8 runs on.
+  class TypedArray
+    # type => [pack directive, element size]
+    TYPES = {
+      int8: ["c", 1],
+      uint8: ["C", 1],
+      uint8_clamped: ["C", 1],
+      int16: ["s<", 2],
+      uint16: ["S<", 2],
+      int32: ["l<", 4],
+      uint32: ["L<", 4],
+      float16: [nil, 2],
+      float32: ["e", 4],
+      float64: ["E", 8],
+      bigint64: ["q<", 8],
+      biguint64: ["Q<", 8]
+    }.freeze
+
+    attr_reader :type, :buffer, :byte_offset, :length
+
+    # MiniRacer::TypedArray.pack(:float64, [1.5, 2.5])
+    def self.pack(type, values)
+      directive, = TYPES.fetch(type) { raise ArgumentError, "bad type #{type}" }
+      data =
+        if directive
+          values.pack("#{directive}*")
+        else
+          values.map { |v| float16_bits(v) }.pack("S<*")
+        end
+      new(type, data)
+    end
+
+    def initialize(type, buffer, byte_offset: 0, length: nil)
+      _, size = TYPES.fetch(type) { raise ArgumentError, "bad type #{type}" }
+      unless buffer.is_a?(String)
+        raise TypeError,
+              "wrong argument type #{buffer.class} (expected String)"
+      end
+      length ||= (buffer.bytesize - byte_offset) / size
+      if byte_offset < 0 || length < 0 || byte_offset % size != 0 ||
+           byte_offset + length * size > buffer.bytesize
+        raise RangeError, "typed array out of bounds"
+      end
+      @type = type
+      @buffer = buffer.encoding == Encoding::BINARY ? buffer : buffer.b
+      @byte_offset = byte_offset
+      @length = length
+    end
+
+    def element_size
+      TYPES[@type][1]
+    end
+
+    def bytesize
+      @length * element_size
+    end
+
+    # the bytes of the elements, without the rest of the buffer
+    def data
+      @buffer.byteslice(@byte_offset, bytesize)
+    end
+
+    def to_a
+      directive, = TYPES[@type]
+      if directive
+        @buffer.unpack("#{directive}#{@length}", offset: @byte_offset)
+      else
+        data.unpack("S<*").map { |bits| self.class.float16_value(bits) }
+      end
+    end
+
+    def ==(other)
+      other.is_a?(TypedArray) && other.type == @type && other.data == data
+    end
+    alias_method :eql?, :==
+
+    def hash
+      [@type, data].hash
+    end
+
+    def inspect
+      "#<#{self.class.name} #{@type}[#{@length}]>"
+    end
+
+    # IEEE 754 binary16; rounds to nearest even like JS does
+    def self.float16_bits(v)
+      f = Float(v)
+      return 0x7E00 if f.nan?
+      sign = f.negative? || (f.zero? && 1 / f < 0) ? 0x8000 : 0
+      f = f.abs
+      return sign | 0x7C00 if f >= 65520.0
+      return sign | (f * 2**24).round(half: :even) if f < 2.0**-14
+      e = Math.frexp(f)[1] - 1 # f = 1.m * 2**e
+      m = (f / 2.0**e * 1024).round(half: :even) - 1024
+      if m == 1024
+        m = 0
+        e += 1
+      end
+      sign | ((e + 15) << 10) | m
+    end
+
+    def self.float16_value(bits)
+      sign = bits & 0x8000 == 0 ? 1.0 : -1.0
+      e = (bits >> 10) & 0x1F
+      m = bits & 0x3FF
+      return sign * m * 2.0**-24 if e == 0
+      return m == 0 ? sign * Float::INFINITY : Float::NAN if e == 31
+      sign * (1024 + m) * 2.0**(e - 25)
+    end
+  end
 end
 
 if RUBY_ENGINE == "truffleruby"
@@ -101,7 +227,18 @@ module MiniRacer
       eval(File.read(filename))
     end
 
-    def write_heap_snapshot(file_or_io)
+    # Like #load but parses the script on a V8 worker thread; returns a
+    # Thread whose #value is the script's result. The context can serve
+    # other threads while the script compiles.
+    def load_async(filename, eager: false)
+      source = File.read(filename)
+      Thread.new do
+        Thread.current.report_on_exception = false
+        eval(source, filename: filename.to_s, compile: :background, eager: eager)
+      end
+    end
+
+    def write_heap_snapshot(file_or_io, gzip: false)
       f = nil
       implicit = false
 
@@ -112,11 +249,31 @@ module MiniRacer
         f = file_or_io
       end
 
-      raise ArgumentError, "file_or_io" unless File === f
+      raise ArgumentError, "file_or_io" unless IO === f
 
-      f.write(heap_snapshot())
+      # the V8 thread writes straight to the file descriptor in chunks
+      # instead of building the whole snapshot in memory
+      f.flush
+      write_heap_snapshot_fd(f.fileno, gzip)
     ensure
       f.close if implicit
     end
   end
+
+  # Returned by Context#function; resolves the function once so that
+  # repeated calls skip the name lookup.
+  class FunctionHandle
+    attr_reader :context, :name
+
+    private_class_method :new
+
+    # a copy would share the native handle, and outlive its dispose
+    def initialize_copy(other)
+      raise TypeError, "can't copy #{self.class.name}"
+    end
+
+    def inspect
+      "#<#{self.class.name} #{@name}>"
+    end
+  end
 end
@@ -104,8 +104,18 @@ module MiniRacer
       isolate: nil,
       ensure_gc_after_idle: nil,
       snapshot: nil,
-      marshal_stack_depth: nil
+      marshal_stack_depth: nil,
+      code_cache: nil,
+      transport: nil,
+      spin: nil,
+      track_refs: nil,
+      symbolize_keys: nil
     )
+      # TruffleRuby runs JavaScript in-process, there is no transport to pick
+      unless [nil, :mutex, :ring].include?(transport)
+        raise ArgumentError, "bad transport"
+      end
+
       check_init_options!(
         isolate: isolate,
         snapshot: snapshot,
@@ -122,6 +132,7 @@ module MiniRacer
       @timeout = timeout
       @max_memory = max_memory
       @marshal_stack_depth = marshal_stack_depth
+      @symbolize_keys = symbolize_keys
 
       # false signals it should be fetched if requested
       @isolate = isolate || false
@@ -160,11 +171,12 @@ module MiniRacer
       end
 
       filename = options && options[:filename].to_s
+      timeout_ms = options && options[:timeout]
 
       @eval_thread = Thread.current
       isolate_mutex.synchronize do
         @current_exception = nil
-        timeout { eval_unsafe(str, filename) }
+        timeout(timeout_ms) { eval_unsafe(str, filename) }
       end
     ensure
       @eval_thread = nil
@@ -188,6 +200,26 @@ module MiniRacer
       ensure_gc_thread if @ensure_gc_after_idle
     end
 
+    def call_many(calls)
+      raise ContextDisposedError if @disposed
+      calls.each_with_index do |call, i|
+        unless Array === call && String === call[0]
+          raise ArgumentError,
+                "Context.call_many: expected [name, args...] at index #{i}"
+        end
+      end
+      calls.map do |function_name, *arguments|
+        call(function_name, *arguments)
+      rescue RuntimeError => e
+        e
+      end
+    end
+
+    def function(function_name)
+      raise ContextDisposedError if @disposed
+      FunctionHandle.send(:new, self, function_name)
+    end
+
     def eval_await(*, **)
       raise MiniRacer::Error, "eval_await is not supported on TruffleRuby"
     end
@@ -196,6 +228,10 @@ module MiniRacer
       raise MiniRacer::Error, "call_await is not supported on TruffleRuby"
     end
 
+    def load_module(*, **)
+      raise MiniRacer::Error, "load_module is not supported on TruffleRuby"
+    end
+
     def dispose
       return if @disposed
       isolate_mutex.synchronize do
@@ -289,8 +325,9 @@ module MiniRacer
       end
     end
 
-    def timeout(&blk)
-      return blk.call unless @timeout
+    def timeout(timeout_ms = nil, &blk)
+      timeout_ms ||= @timeout
+      return blk.call if !timeout_ms || timeout_ms.zero?
 
       mutex = Mutex.new
       done = false
@@ -300,7 +337,7 @@ module MiniRacer
       t =
         Thread.new do
           begin
-            result = rp.wait_readable(@timeout / 1000.0)
+            result = rp.wait_readable(timeout_ms / 1000.0)
             mutex.synchronize { stop unless done } if !result
           rescue => e
             STDERR.puts e
@@ -387,7 +424,7 @@ module MiniRacer
 
   # `size` and `warmup!` public methods are defined in the C class
   class Snapshot
-    def initialize(str = "")
+    def initialize(str = "", verbose_exceptions: false)
       # ensure it first can load
       begin
         ctx = MiniRacer::Context.new
@@ -68,6 +68,16 @@ module MiniRacer
       GC.start
     end
 
+    def reset!
+      raise ContextDisposedError if @disposed
+      isolate_mutex.synchronize do
+        dispose_unsafe
+        @functions = {}
+        init_unsafe(nil, @snapshot)
+      end
+      nil
+    end
+
     private
 
     @context_initialized = false
@@ -95,6 +105,7 @@ module MiniRacer
         )
       Context.instance_variable_set(:@context_initialized, true)
       @js_object = @context.eval("js", "Object")
+      @js_map = @context.eval("js", "Map")
       @isolate_mutex = Mutex.new
       @stopped = false
       @entered = false
@@ -119,6 +130,10 @@ module MiniRacer
         eval_in_context "(x) => { return typeof x === 'symbol' }"
       @is_uint8_array_func =
         eval_in_context "(x) => { return x instanceof Uint8Array }"
+      @is_typed_array_func =
+        eval_in_context "(x) => { return ArrayBuffer.isView(x) && !(x instanceof DataView) }"
+      @js_typed_array_parts_func =
+        eval_in_context "(x) => { return [x.constructor.name, x.byteOffset, x.length, Array.from(new Uint8Array(x.buffer))] }"
 
       @js_date_to_time_func = eval_in_context "(x) => { return x.getTime(x) }"
       @js_symbol_to_symbol_func =
@@ -145,6 +160,8 @@ module MiniRacer
       JS
       @js_new_uint8array_func =
         eval_in_context "(x) => { return new Uint8Array(x) }"
+      @js_new_typed_array_func =
+        eval_in_context "(name, bytes, offset, length) => { return new globalThis[name](new Uint8Array(bytes).buffer, offset, length) }"
     end
 
     def dispose_unsafe
@@ -279,6 +296,7 @@ module MiniRacer
           value.to_str.dup
         elsif value.respond_to?(:to_ary)
           return value.to_a.pack("C*") if uint8_array?(value)
+          return js_typed_array_to_ruby(value) if typed_array?(value)
 
           value.to_ary.map do |e|
             e.respond_to?(:call) ? nil : convert_js_to_ruby(e)
@@ -300,7 +318,8 @@ module MiniRacer
           h = {}
           object.instance_variables.each do |member|
             v = object[member]
-            h[member.to_s] = convert_js_to_ruby(v) unless v.respond_to?(:call)
+            key = @symbolize_keys ? member.to_s.to_sym : member.to_s
+            h[key] = convert_js_to_ruby(v) unless v.respond_to?(:call)
           end
           h
         end
@@ -331,6 +350,35 @@ module MiniRacer
       @is_uint8_array_func.call(value)
     end
 
+    def typed_array?(value)
+      @is_typed_array_func.call(value)
+    end
+
+    TYPED_ARRAY_NAMES = {
+      int8: "Int8Array",
+      uint8: "Uint8Array",
+      uint8_clamped: "Uint8ClampedArray",
+      int16: "Int16Array",
+      uint16: "Uint16Array",
+      int32: "Int32Array",
+      uint32: "Uint32Array",
+      float16: "Float16Array",
+      float32: "Float32Array",
+      float64: "Float64Array",
+      bigint64: "BigInt64Array",
+      biguint64: "BigUint64Array"
+    }.freeze
+
+    def js_typed_array_to_ruby(value)
+      name, offset, length, bytes = @js_typed_array_parts_func.call(value).to_a
+      MiniRacer::TypedArray.new(
+        TYPED_ARRAY_NAMES.key(name.to_s),
+        bytes.to_a.pack("C*"),
+        byte_offset: offset,
+        length: length
+      )
+    end
+
     def js_date_to_time(value)
       millis = @js_date_to_time_func.call(value)
       Time.at(Rational(millis, 1000))
@@ -363,9 +411,17 @@ module MiniRacer
         value.each_with_index { |v, i| ary[i] = convert_ruby_to_js(v) }
         ary
       when Hash
-        h = @js_object.new
-        value.each_pair do |k, v|
-          h[convert_ruby_to_js(k.to_s)] = convert_ruby_to_js(v)
+        if value.each_key.all? { |k| String === k || Symbol === k || Integer === k }
+          h = @js_object.new
+          value.each_pair do |k, v|
+            h[convert_ruby_to_js(k.to_s)] = convert_ruby_to_js(v)
+          end
+        else
+          # same as the C extension, keys that can't be property names make a Map
+          h = @js_map.new
+          value.each_pair do |k, v|
+            h.set(convert_ruby_to_js(k), convert_ruby_to_js(v))
+          end
         end
         h
       when String, Symbol
@@ -376,6 +432,13 @@ module MiniRacer
         js_new_date(value.to_time.to_f * 1000)
       when MiniRacer::Binary
         @js_new_uint8array_func.call(value.data.bytes)
+      when MiniRacer::TypedArray
+        @js_new_typed_array_func.call(
+          TYPED_ARRAY_NAMES.fetch(value.type),
+          value.buffer.bytes,
+          value.byte_offset,
+          value.length
+        )
       else
         "Undefined Conversion"
       end
@@ -419,7 +482,144 @@ module MiniRacer
     end
   end
 
+  class FunctionHandle
+    # no native handle on TruffleRuby, calls resolve the name every time
+    def initialize(context, name)
+      @context = context
+      @name = name
+    end
+
+    def call(*args)
+      raise MiniRacer::RuntimeError, "disposed function handle" if @disposed
+      @context.call(@name, *args)
+    end
+
+    def call_await(*args)
+      raise MiniRacer::RuntimeError, "disposed function handle" if @disposed
+      @context.call_await(@name, *args)
+    end
+
+    def dispose
+      @disposed = true
+      nil
+    end
+  end
+
+  class ContextPool
+    # contexts don't count their calls here, max_calls counts checkouts
+    def initialize(size: 1, max_calls: nil, max_heap: nil, **options)
+      unless size.is_a?(Integer) && size.between?(1, 1024)
+        raise ArgumentError, "bad size"
+      end
+      if max_heap
+        raise MiniRacer::Error, "max_heap is not supported on TruffleRuby"
+      end
+      @size = size
+      @max_calls = max_calls
+      @options = options.freeze
+      @idle = Thread::Queue.new
+      @uses = {}.compare_by_identity
+      @checkouts = @recycles = @created = 0
+      @wait_time = 0.0
+      @closed = false
+      size.times { @idle << new_context }
+    end
+
+    def with
+      raise ContextDisposedError, "closed context pool" if @closed
+      t = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      ctx = @idle.pop
+      @wait_time += Process.clock_gettime(Process::CLOCK_MONOTONIC) - t
+      @checkouts += 1
+      raise ContextDisposedError, "closed context pool" unless ctx
+      broken = false
+      begin
+        yield ctx
+      rescue V8OutOfMemoryError, ContextDisposedError
+        broken = true
+        raise
+      ensure
+        # also runs for break, return and throw out of the block
+        uses = (@uses[ctx] || 0) + 1
+        if @closed
+          @uses.delete(ctx)
+          ctx.dispose
+        elsif broken || (@max_calls && uses >= @max_calls)
+          recycle(ctx)
+        else
+          @uses[ctx] = uses
+          @idle << ctx
+        end
+      end
+    end
+
+    def stats
+      {
+        size: @size,
+        idle: @idle.size,
+        waiters: @idle.num_waiting,
+        checkouts: @checkouts,
+        wait_time: @wait_time,
+        recycles: @recycles,
+        created: @created
+      }
+    end
+
+    def shutdown
+      return if @closed
+      @closed = true
+      @idle.close
+      @idle.pop.dispose until @idle.empty?
+      nil
+    end
+
+    private
+
+    def new_context
+      @created += 1
+      Context.new(**@options)
+    end
+
+    def recycle(ctx)
+      @uses.delete(ctx)
+      ctx.dispose
+      return if @closed
+      @recycles += 1
+      Thread.new { @idle << new_context }
+    end
+  end
+
+  class CodeCache
+    # TruffleRuby caches parsed sources itself, there is nothing to count
+    def self.stats
+      {
+        hits: 0,
+        misses: 0,
+        rejected: 0,
+        entries: 0,
+        bytes: 0,
+        disk_hits: 0,
+        disk_writes: 0
+      }
+    end
+
+    def self.clear
+    end
+  end
+
   class Snapshot
+    def self.build_many(sources, verbose_exceptions: false)
+      sources.map { |source| new(source, verbose_exceptions: verbose_exceptions) }
+    end
+
+    def self.mmap(path)
+      raise MiniRacer::Error, "Snapshot.mmap is not supported on TruffleRuby"
+    end
+
+    def self.build(**options)
+      raise MiniRacer::Error, "Snapshot.build is not supported on TruffleRuby"
+    end
+
     def load(str)
       unless str.is_a?(String)
         raise TypeError, "wrong type argument #{str.class} (should be a string)"
@@ -0,0 +1,108 @@
+require "test_helper"
+
+class MiniRacerContextPoolTest < Minitest::Test
+  def test_with
+    pool = MiniRacer::ContextPool.new(size: 2, timeout: 1000)
+    assert_equal 3, pool.with { |ctx| ctx.eval("1+2") }
+    assert_equal 2, pool.stats[:idle]
+    assert_equal 1, pool.stats[:checkouts]
+  ensure
+    pool&.shutdown
+  end
+
+  def test_contexts_are_reused
+    pool = MiniRacer::ContextPool.new(size: 1)
+    pool.with { |ctx| ctx.eval("var x = 42") }
+    assert_equal 42, pool.with { |ctx| ctx.eval("x") }
+    assert_equal 0, pool.stats[:recycles]
+    assert_equal 1, pool.stats[:created]
+  ensure
+    pool&.shutdown
+  end
+
+  def test_snapshot
+    snapshot = MiniRacer::Snapshot.new("var answer = 42")
+    pool = MiniRacer::ContextPool.new(size: 2, snapshot: snapshot)
+    assert_equal 42, pool.with { |ctx| ctx.eval("answer") }
+  ensure
+    pool&.shutdown
+  end
+
+  def test_recycle_after_max_calls
+    pool = MiniRacer::ContextPool.new(size: 1, max_calls: 2)
+    pool.with { |ctx| ctx.eval("var x = 1") }
+    pool.with { |ctx| ctx.eval("x") }
+    # replaced in the background, the next checkout waits for it
+    assert_equal "undefined", pool.with { |ctx| ctx.eval("typeof x") }
+    stats = pool.stats
+    assert_equal 1, stats[:recycles]
+    assert_equal 2, stats[:created]
+  ensure
+    pool&.shutdown
+  end
+
+  def test_recycle_after_max_heap
+    if RUBY_ENGINE == "truffleruby"
+      assert_raises(MiniRacer::Error) do
+        MiniRacer::ContextPool.new(size: 1, max_heap: 1)
+      end
+      return
+    end
+    pool = MiniRacer::ContextPool.new(size: 1, max_heap: 1)
+    pool.with { |ctx| ctx.eval("var x = 1") }
+    assert_equal "undefined", pool.with { |ctx| ctx.eval("typeof x") }
+    assert_operator pool.stats[:recycles], :>=, 1
+  ensure
+    pool&.shutdown
+  end
+
+  def test_recycle_after_out_of_memory
+    pool = MiniRacer::ContextPool.new(size: 1, max_memory: 20_000_000)
+    assert_raises(MiniRacer::V8OutOfMemoryError) do
+      pool.with { |ctx| ctx.eval("let s = 'x'; for (;;) s += s") }
+    end
+    assert_equal 2, pool.with { |ctx| ctx.eval("1+1") }
+    assert_equal 1, pool.stats[:recycles]
+  ensure
+    pool&.shutdown
+  end
+
+  def test_exceptions_return_context
+    pool = MiniRacer::ContextPool.new(size: 1)
+    assert_raises(MiniRacer::RuntimeError) do
+      pool.with { |ctx| ctx.eval("throw new Error('boom')") }
+    end
+    assert_raises(ArgumentError) { pool.with { raise ArgumentError } }
+    assert_equal :out, pool.with { break :out }
+    assert_equal 1, pool.stats[:idle]
+    assert_equal 0, pool.stats[:recycles]
+  ensure
+    pool&.shutdown
+  end
+
+  def test_waiters
+    pool = MiniRacer::ContextPool.new(size: 1)
+    q = Thread::Queue.new
+    t = Thread.new { pool.with { q.pop } }
+    Thread.pass until pool.stats[:idle] == 0
+    waiter = Thread.new { pool.with { |ctx| ctx.eval("1") } }
+    Thread.pass until pool.stats[:waiters] == 1
+    q << nil
+    assert_equal 1, waiter.value
+    t.join
+    assert_operator pool.stats[:wait_time], :>, 0
+  ensure
+    pool&.shutdown
+  end
+
+  def test_shutdown
+    pool = MiniRacer::ContextPool.new(size: 1)
+    pool.shutdown
+    assert_raises(MiniRacer::ContextDisposedError) { pool.with {} }
+  end
+
+  def test_bad_options
+    assert_raises(ArgumentError) { MiniRacer::ContextPool.new(size: 0) }
+    assert_raises(ArgumentError) { MiniRacer::ContextPool.new(transport: :x) }
+  end
+end
@@ -69,6 +69,103 @@ class MiniRacerFunctionTest < Minitest::Test
     assert_equal h, res
   end
 
+  def test_function_handle
+    context = MiniRacer::Context.new
+    context.eval("function f(x) { return 'I need ' + x + ' foos' }")
+    f = context.function("f")
+    assert_equal "f", f.name
+    assert_equal "I need 3 foos", f.call(3)
+    # the handle keeps the original function alive
+    context.eval("f = null")
+    assert_equal "I need 4 foos", f.call(4)
+  end
+
+  def test_function_handle_keeps_receiver
+    context = MiniRacer::Context.new
+    context.eval(<<~JS)
+      var App = { greeting: "hi", render(name) { return this.greeting + " " + name } }
+    JS
+    render = context.function("App.render")
+    assert_equal "hi bob", render.call("bob")
+  end
+
+  def test_function_handle_errors
+    context = MiniRacer::Context.new
+    context.eval("var notfn = 1; function f() { throw new Error('foo bar') }")
+    assert_raises(MiniRacer::RuntimeError) { context.function("g") }
+    assert_raises(MiniRacer::RuntimeError) { context.function("notfn") }
+    f = context.function("f")
+    err = assert_raises(MiniRacer::RuntimeError) { f.call }
+    assert_equal "Error: foo bar", err.message
+    context.dispose
+    assert_raises(MiniRacer::ContextDisposedError) { f.call }
+  end
+
+  def test_call_many_uncloneable_result
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby converts symbols"
+    end
+    [{}, { symbolize_keys: true }].each do |options|
+      context = MiniRacer::Context.new(**options)
+      context.eval(<<~JS)
+        function sym() { return { s: Symbol('x') } }
+        function one() { return { a: 1 } }
+      JS
+      one, sym, again = context.call_many([["one"], ["sym"], ["one"]])
+      assert_instance_of MiniRacer::RuntimeError, sym
+      assert_match(/could not be cloned/, sym.message)
+      assert_equal one, again
+      assert_equal [options.empty? ? "a" : :a], one.keys
+    end
+  end
+
+  def test_function_handle_dispose
+    context = MiniRacer::Context.new
+    context.eval("function f() { return 1 } function g() { return 2 }")
+    f = context.function("f")
+    assert_raises(NoMethodError) { MiniRacer::FunctionHandle.new(context, "f") }
+    assert_raises(TypeError) { f.dup }
+    assert_nil f.dispose
+    assert_nil f.dispose
+    err = assert_raises(MiniRacer::RuntimeError) { f.call }
+    assert_equal "disposed function handle", err.message
+    # takes over f's slot
+    g = context.function("g")
+    assert_equal 2, g.call
+    context.dispose
+    assert_nil g.dispose
+  end
+
+  def test_call_many
+    context = MiniRacer::Context.new
+    context.eval(<<~JS)
+      var Fmt = { prefix: "#", row(x) { return this.prefix + x } }
+      function boom(x) { throw new Error("boom " + x) }
+    JS
+    results =
+      context.call_many(
+        [["Fmt.row", 1], ["boom", 2], ["Fmt.row", "a"], ["missing"]]
+      )
+    assert_equal 4, results.size
+    assert_equal "#1", results[0]
+    assert_instance_of MiniRacer::RuntimeError, results[1]
+    assert_match(/boom 2/, results[1].message)
+    assert_equal "#a", results[2]
+    assert_instance_of MiniRacer::RuntimeError, results[3]
+    assert_equal [], context.call_many([])
+    assert_raises(ArgumentError) { context.call_many([[1]]) }
+    assert_raises(ArgumentError) { context.call_many(["Fmt.row"]) }
+  end
+
+  def test_call_many_timeout_aborts_batch
+    context = MiniRacer::Context.new(timeout: 50)
+    context.eval("function spin() { for (;;); } function one() { return 1 }")
+    assert_raises(MiniRacer::ScriptTerminatedError) do
+      context.call_many([["one"], ["spin"], ["one"]])
+    end
+    assert_equal [1], context.call_many([["one"]])
+  end
+
   def test_do_not_hang_with_concurrent_calls
     context = MiniRacer::Context.new
     context.eval("function f(x) { return 'I need ' + x + ' foos' }")
@@ -5,6 +5,7 @@ require "date"
 require "open3"
 require "rbconfig"
 require "tempfile"
+require "tmpdir"
 require "test_helper"
 
 class MiniRacerTest < Minitest::Test
@@ -176,6 +177,71 @@ class MiniRacerTest < Minitest::Test
     assert_raises { context.eval("while(true){}") }
   end
 
+  def test_eval_timeout_overrides_context_timeout
+    context = MiniRacer::Context.new
+    assert_raises(MiniRacer::ScriptTerminatedError) do
+      context.eval("while(true){}", timeout: 10)
+    end
+    assert_equal 2, context.eval("1+1")
+
+    context = MiniRacer::Context.new(timeout: 5)
+    result = context.eval(<<~JS, timeout: 0)
+      const start = Date.now();
+      while (Date.now() - start < 50) {}
+      42
+    JS
+    assert_equal 42, result
+    assert_raises(MiniRacer::ScriptTerminatedError) do
+      context.eval("while(true){}")
+    end
+  end
+
+  def test_eval_timeout_rejects_bad_values
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not validate per-call options"
+    end
+    context = MiniRacer::Context.new
+    assert_raises(ArgumentError) { context.eval("1", timeout: -1) }
+    assert_raises(TypeError) { context.eval("1", timeout: "1") }
+    assert_raises(ArgumentError) { context.eval("1", timeout: Float::NAN) }
+  end
+
+  def test_timeout_accepts_floats
+    context = MiniRacer::Context.new(timeout: 1500.5)
+    assert_equal 2, context.eval("1 + 1")
+    assert_equal 2, context.eval("1 + 1", timeout: 500.5)
+    assert_raises(MiniRacer::ScriptTerminatedError) do
+      context.eval("while(true){}", timeout: 10.5)
+    end
+  end
+
+  def test_timed_calls_share_one_watchdog
+    contexts = Array.new(4) { MiniRacer::Context.new(timeout: 1000) }
+    contexts.each { |context| context.eval("function f(x) { return x }") }
+    10_000.times { |i| assert_equal i, contexts[i % 4].call("f", i) }
+
+    threads =
+      contexts.map do |context|
+        Thread.new do
+          assert_raises(MiniRacer::ScriptTerminatedError) do
+            context.eval("while(true){}", timeout: 20)
+          end
+          context.call("f", 1)
+        end
+      end
+    assert_equal [1, 1, 1, 1], threads.map(&:value)
+
+    if RUBY_ENGINE == "ruby" && File.directory?("/proc/self/task")
+      names =
+        Dir["/proc/self/task/*/comm"].filter_map do |f|
+          File.read(f).chomp
+        rescue SystemCallError
+          nil # thread exited in the meantime
+        end
+      assert_equal 1, names.count("mini_racer-wd")
+    end
+  end
+
   def test_ruby_timeout_does_not_leave_stale_termination
     if RUBY_ENGINE == "truffleruby"
       skip "TruffleRuby does not use the native rb_nogvl unblock path"
@@ -496,6 +562,20 @@ class MiniRacerTest < Minitest::Test
     assert_equal ["banana", ["nose"]], context.eval("nose.type()")
   end
 
+  def test_return_number_arrays
+    context = MiniRacer::Context.new
+    expected = Array.new(200) { |i| i.odd? ? i : i + 0.5 }
+    expected[100] = "x"
+    expected[101] = nil
+    expected += [2**53, -(2**40), 1e300]
+    assert_equal expected, context.eval(<<~JS)
+      var a = Array.from({length: 200}, (_, i) => i % 2 ? i : i + 0.5);
+      a[100] = "x";
+      a[101] = undefined;
+      a.concat([2**53, -(2**40), 1e300]);
+    JS
+  end
+
   def test_return_hash
     context = MiniRacer::Context.new
     context.attach(
@@ -691,6 +771,120 @@ class MiniRacerTest < Minitest::Test
     assert_raises { context.load(File.dirname(__FILE__) + "/missing.js") }
   end
 
+  def test_background_compile
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby ignores the compile option"
+    end
+    context = MiniRacer::Context.new
+    source = "var bg = 'héllo'; function twice(x) { return 2*x }; twice(21)"
+    assert_equal 42, context.eval(source, compile: :background)
+    assert_equal "héllo", context.eval("bg")
+    assert_equal 42, context.eval("twice(21)", compile: :background, eager: true)
+    assert_equal 42, context.eval("twice(21)", eager: true)
+    assert_equal 42, context.eval_await("Promise.resolve(42)", compile: :background)
+    e = assert_raises(MiniRacer::ParseError) do
+      context.eval("var x = ;", filename: "bad.js", compile: :background)
+    end
+    assert_match(/bad\.js/, e.message)
+    assert_raises(MiniRacer::RuntimeError) do
+      context.eval("throw new Error('boom')", compile: :background)
+    end
+    assert_raises(MiniRacer::ScriptTerminatedError) do
+      context.eval("for (;;);", compile: :background, timeout: 50)
+    end
+    assert_raises(ArgumentError) { context.eval("1", compile: :later) }
+  end
+
+  def test_background_compile_leaves_context_usable
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby ignores the compile option"
+    end
+    context = MiniRacer::Context.new
+    context.eval("var n = 0")
+    source = "var big = [" + (1..50_000).map { |i| "function f#{i}() { return #{i} }" }.join(",") + "].length"
+    thread = Thread.new { context.eval(source, compile: :background) }
+    10.times { context.eval("n++") }
+    assert_equal 50_000, thread.value
+    assert_equal 10, context.eval("n")
+  end
+
+  def test_load_async
+    context = MiniRacer::Context.new
+    thread = context.load_async(File.dirname(__FILE__) + "/file.js")
+    thread.join
+    assert_equal "world", context.eval("hello")
+    assert_raises { context.load_async(File.dirname(__FILE__) + "/missing.js") }
+  end
+
+  def test_load_module
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not support load_module"
+    end
+    context = MiniRacer::Context.new
+    sources = {
+      "math" => "export const pi = 3; export default function twice(x) { return 2*x }",
+      "lib/util" => "import twice from 'math'; export const six = twice(3)",
+    }
+    asked = []
+    exports =
+      context.load_module("app", <<~JS) do |specifier, referrer|
+        import { pi } from "math"
+        import { six } from "./util"
+        export const answer = pi * 14
+        export const sum = six + await Promise.resolve(1)
+        globalThis.loaded = (globalThis.loaded || 0) + 1
+      JS
+        asked << [specifier, referrer]
+        specifier == "./util" ? ["lib/util", sources["lib/util"]] : sources[specifier]
+      end
+    assert_equal({ "answer" => 42, "sum" => 7 }, exports)
+    assert_equal [["math", "app"], ["./util", "app"], ["math", "lib/util"]], asked
+    # modules are evaluated once, loading them again returns their exports
+    assert_equal exports, context.load_module("app", "ignored")
+    assert_equal 1, context.eval("loaded")
+    assert_equal 3, context.load_module("math")["pi"]
+    # the block is kept for later loads
+    e = assert_raises(MiniRacer::RuntimeError) { context.load_module("other") }
+    assert_match(/cannot resolve module 'other'/, e.message)
+    sources["other"] = "export const x = 1"
+    assert_equal({ "x" => 1 }, context.load_module("other"))
+  end
+
+  def test_load_module_errors
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not support load_module"
+    end
+    context = MiniRacer::Context.new
+    assert_raises(MiniRacer::ParseError) { context.load_module("bad", "export {") }
+    e = assert_raises(MiniRacer::RuntimeError) do
+      context.load_module("a", "import 'missing'")
+    end
+    assert_match(/cannot resolve module 'missing' imported from 'a'/, e.message)
+    # a failed load can be retried once the resolver knows more
+    exports = context.load_module("a") { |specifier, _| "export const ok = 1" }
+    assert_equal({}, exports)
+    assert_raises(MiniRacer::RuntimeError) do
+      context.load_module("boom", "throw new Error('boom')")
+    end
+    e = assert_raises(RuntimeError) do
+      context.load_module("c", "import 'raises'") { |*| raise "from ruby" }
+    end
+    assert_equal "from ruby", e.message
+  end
+
+  def test_dynamic_import
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not support load_module"
+    end
+    context = MiniRacer::Context.new
+    e = assert_raises(MiniRacer::RuntimeError) do
+      context.eval_await("import('math')")
+    end
+    assert_match(/cannot import module 'math'.*Context#load_module/, e.message)
+    context.load_module("math", "export const pi = 3")
+    assert_equal 3, context.eval_await("import('math').then(m => m.pi)")
+  end
+
   def test_contexts_can_be_safely_GCed
     context = MiniRacer::Context.new
     context.eval 'var hello = "world";'
@@ -782,6 +976,147 @@ class MiniRacerTest < Minitest::Test
     assert_equal("bar", ctx.eval("foo"))
   end
 
+  def test_snapshot_mmap
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not yet implement snapshots"
+    end
+    snapshot = MiniRacer::Snapshot.new('var foo = "bar";')
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "snapshot.bin")
+      File.binwrite(path, snapshot.dump)
+      mapped = MiniRacer::Snapshot.mmap(path)
+      assert_equal(snapshot.size, mapped.size)
+      assert_equal(snapshot.dump, mapped.dump)
+      contexts = 3.times.map { MiniRacer::Context.new(snapshot: mapped) }
+      # contexts keep the mapping alive, warmup! doesn't touch it
+      mapped.warmup!("foo += '!'")
+      mapped = nil
+      GC.start
+      contexts.each { |ctx| assert_equal("bar", ctx.eval("foo")) }
+      contexts.each(&:dispose)
+      empty = File.join(dir, "empty.bin")
+      File.binwrite(empty, "")
+      assert_equal(0, MiniRacer::Snapshot.mmap(empty).size)
+      assert_raises(Errno::ENOENT) do
+        MiniRacer::Snapshot.mmap(File.join(dir, "missing"))
+      end
+    end
+  end
+
+  def test_snapshot_build_many
+    locales = { "en" => "hello", "fr" => "bonjour", "de" => "hallo" }
+    sources = locales.values.map { |word| "function greet() { return '#{word}' }" }
+    snapshots = MiniRacer::Snapshot.build_many(sources)
+    assert_equal(3, snapshots.size)
+    snapshots.zip(locales.values).each do |snapshot, word|
+      assert_kind_of(MiniRacer::Snapshot, snapshot)
+      ctx = MiniRacer::Context.new(snapshot: snapshot)
+      assert_equal(word, ctx.eval("greet()"))
+    end
+    assert_equal([], MiniRacer::Snapshot.build_many([]))
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not yet implement snapshots"
+    end
+    e =
+      assert_raises(MiniRacer::SnapshotError) do
+        MiniRacer::Snapshot.build_many(["var a = 1", "var b = c"])
+      end
+    assert_match(/c is not defined/, e.message)
+  end
+
+  def test_snapshot_source_encodings
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not yet implement snapshots"
+    end
+    source = "var s = 'caf\u00e9 \u2603'"
+    %w[UTF-8 UTF-16LE].each do |encoding|
+      snapshot = MiniRacer::Snapshot.new(source.encode(encoding))
+      snapshot.warmup!("s.length".encode(encoding))
+      ctx = MiniRacer::Context.new(snapshot: snapshot)
+      assert_equal("caf\u00e9 \u2603", ctx.eval("s"))
+    end
+    snapshot = MiniRacer::Snapshot.new("var s = 'caf\u00e9'".encode("ISO-8859-1"))
+    ctx = MiniRacer::Context.new(snapshot: snapshot)
+    assert_equal("caf\u00e9", ctx.eval("s"))
+  end
+
+  def test_snapshot_build_many_verbose_exceptions
+    snapshots = MiniRacer::Snapshot.build_many(["var a = 1"], verbose_exceptions: true)
+    ctx = MiniRacer::Context.new(snapshot: snapshots.first)
+    assert_equal 1, ctx.eval("a")
+    snapshot = MiniRacer::Snapshot.new("var b = 2", verbose_exceptions: true)
+    snapshot.warmup!("b")
+    assert_equal 2, MiniRacer::Context.new(snapshot: snapshot).eval("b")
+  end
+
+  def test_snapshot_build_many_interrupt
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not yet implement snapshots"
+    end
+    require "timeout"
+    assert_raises(Timeout::Error) do
+      Timeout.timeout(0.5) { MiniRacer::Snapshot.build_many(["for (;;);"] * 3) }
+    end
+    assert_equal 1, MiniRacer::Context.new.eval("1")
+  end
+
+  def test_snapshot_build
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not yet implement snapshots"
+    end
+    calls = 0
+    greet = ->(name) { calls += 1; "hello #{name}" }
+    snapshot =
+      MiniRacer::Snapshot.build do |ctx|
+        ctx.attach("ruby.greet", greet)
+        ctx.eval("var greetings = [ruby.greet('eval')]")
+        ctx.eval("function greet(name) { return ruby.greet(name) }")
+        ctx.call("greet", "call")
+      end
+    assert_equal(2, calls)
+    ctx = MiniRacer::Context.new(snapshot: snapshot)
+    assert_equal(["hello eval"], ctx.eval("greetings"))
+    assert_equal("hello restored", ctx.call("greet", "restored"))
+    ctx.attach("add", ->(a, b) { a + b })
+    assert_equal(3, ctx.eval("add(1, 2)"))
+    ctx.reset!
+    assert_equal("hello reset", ctx.eval("greet('reset')"))
+    assert_raises(MiniRacer::RuntimeError) { ctx.eval("add(1, 2)") }
+    snapshot.warmup!("greet.length")
+    ctx = MiniRacer::Context.new(snapshot: snapshot)
+    assert_equal("hello warm", ctx.call("greet", "warm"))
+    assert_equal(4, calls)
+    leaked = nil
+    assert_raises(MiniRacer::ParseError) do
+      MiniRacer::Snapshot.build do |c|
+        leaked = c
+        c.eval("(")
+      end
+    end
+    assert_raises(MiniRacer::ContextDisposedError) { leaked.eval("1") }
+  end
+
+  def test_snapshot_build_stale_callback_throws
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not yet implement snapshots"
+    end
+    snapshot = MiniRacer::Snapshot.build { |c| c.attach("one", -> { 1 }) }
+    ctx = MiniRacer::Context.new(snapshot: snapshot)
+    seen = []
+    ctx.attach("note", ->(s) { seen << s })
+    ctx.eval(<<~JS)
+      const i32 = new Int32Array(new SharedArrayBuffer(4));
+      Atomics.waitAsync(i32, 0, 0, 20).value.then(() => note("stale"));
+    JS
+    ctx.reset!
+    # the new context comes from the same snapshot, "other" gets note's id
+    ctx.attach("other", ->(s) { seen << "other: #{s}" })
+    sleep 0.05
+    ctx.pump_message_loop
+    assert_empty seen
+    assert_equal 1, ctx.eval("one()")
+  end
+
   def test_invalid_snapshots_throw_an_exception
     begin
       MiniRacer::Snapshot.new("var foo = bar;")
@@ -1118,6 +1453,111 @@ class MiniRacerTest < Minitest::Test
     )
   end
 
+  def test_ring_transport
+    context = MiniRacer::Context.new(transport: :ring, timeout: 500)
+    context.attach("rb.echo", ->(v) { v })
+    context.eval("function f(x) { return rb.echo(x) + 1 }")
+    assert_equal 43, context.call("f", 42)
+    big = "x" * 100_000 # larger than the ring's inline limit
+    assert_equal big, context.eval("rb.echo(#{big.inspect})")
+    1000.times { |i| assert_equal i + 1, context.call("f", i) }
+    assert_raises(MiniRacer::ScriptTerminatedError) do
+      context.eval("for (;;);")
+    end
+    assert_equal 2, context.eval("1+1")
+    context.dispose
+    assert_raises(MiniRacer::ContextDisposedError) { context.eval("1") }
+  end
+
+  def test_spin_then_park
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not have a separate V8 thread"
+    end
+    [{}, { transport: :ring }].each do |options|
+      context = MiniRacer::Context.new(spin: 50, timeout: 500, **options)
+      context.attach("rb.echo", ->(v) { v })
+      context.eval("function f(x) { return rb.echo(x) * 2 }")
+      1000.times { |i| assert_equal 2 * i, context.call("f", i) }
+      assert_raises(MiniRacer::ScriptTerminatedError) do
+        context.eval("for (;;);")
+      end
+      assert_equal 4, context.call("f", 2)
+      context.dispose
+    end
+    assert_raises(ArgumentError) { MiniRacer::Context.new(spin: -1) }
+    assert_raises(TypeError) { MiniRacer::Context.new(spin: "50") }
+  end
+
+  def test_ring_transport_rejects_bad_values
+    assert_raises(ArgumentError) { MiniRacer::Context.new(transport: :pipe) }
+  end
+
+  def test_code_cache_is_shared_between_contexts
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not use the V8 code cache"
+    end
+    source = <<~JS + "// #{"x" * 2048}"
+      function answer() { return 42 }
+    JS
+    before = MiniRacer::CodeCache.stats
+
+    MiniRacer::Context.new(code_cache: true).eval(source, filename: "a.js")
+    context = MiniRacer::Context.new(code_cache: true)
+    context.eval(source, filename: "a.js")
+    assert_equal 42, context.call("answer")
+    MiniRacer::Context.new.eval(source, filename: "a.js")
+
+    after = MiniRacer::CodeCache.stats
+    assert_equal 1, after[:misses] - before[:misses]
+    assert_equal 1, after[:hits] - before[:hits]
+    assert_equal 0, after[:rejected] - before[:rejected]
+    assert_operator after[:bytes], :>, 0
+  end
+
+  def test_code_cache_keys_include_filename
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not use the V8 code cache"
+    end
+    source = "var x = 1; // #{"x" * 2048}"
+    before = MiniRacer::CodeCache.stats
+    MiniRacer::Context.new(code_cache: true).eval(source, filename: "b.js")
+    MiniRacer::Context.new(code_cache: true).eval(source, filename: "c.js")
+    after = MiniRacer::CodeCache.stats
+    assert_equal 2, after[:misses] - before[:misses]
+    assert_equal 0, after[:hits] - before[:hits]
+  end
+
+  def test_code_cache_persists_to_disk
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not use the V8 code cache"
+    end
+    Dir.mktmpdir do |dir|
+      source = "function twice(x) { return 2*x } // #{SecureRandom.hex(1024)}"
+      cache = MiniRacer::CodeCache.new(dir)
+      before = MiniRacer::CodeCache.stats
+      MiniRacer::Context.new(code_cache: cache).eval(source)
+      assert_equal 1, MiniRacer::CodeCache.stats[:disk_writes] - before[:disk_writes]
+      assert_equal 1, Dir.children(dir).size
+
+      # simulate a new process: the in-memory cache is empty
+      MiniRacer::CodeCache.clear
+      context = MiniRacer::Context.new(code_cache: cache)
+      context.eval(source)
+      assert_equal 4, context.call("twice", 2)
+      after = MiniRacer::CodeCache.stats
+      assert_equal 1, after[:disk_hits] - before[:disk_hits]
+      assert_equal 1, after[:hits] - before[:hits]
+
+      # damaged files are discarded and rewritten
+      MiniRacer::CodeCache.clear
+      path = File.join(dir, Dir.children(dir).first)
+      File.binwrite(path, "garbage" * 10)
+      MiniRacer::Context.new(code_cache: cache).eval(source)
+      assert_equal after[:disk_hits], MiniRacer::CodeCache.stats[:disk_hits]
+      assert_operator File.size(path), :>, 70
+    end
+  end
+
   def test_eval_with_filename
     context = MiniRacer::Context.new()
     context.eval("var foo = function(){baz();}", filename: "b/c/foo1.js")
@@ -1185,6 +1625,54 @@ class MiniRacerTest < Minitest::Test
     FileUtils.rm(path)
   end
 
+  def test_heap_dump_streams
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not yet implement heap_dump"
+    end
+    context = MiniRacer::Context.new
+    context.eval("var big = Array.from({length: 10000}, (_, i) => ({i}))")
+    r, w = IO.pipe
+    reader = Thread.new { r.read }
+    w.write("x")
+    context.write_heap_snapshot(w)
+    w.close
+    dump = reader.value
+    assert_equal "x", dump[0]
+    assert JSON.parse(dump[1..]).key?("snapshot")
+  end
+
+  def test_heap_dump_stop_unblocks_full_pipe
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not yet implement heap_dump"
+    end
+    context = MiniRacer::Context.new
+    r, w = IO.pipe # nobody reads, the V8 thread blocks once it's full
+    stopper = Thread.new { sleep 0.2; context.stop }
+    assert_raises(Errno::ECANCELED) { context.write_heap_snapshot(w) }
+    stopper.join
+  ensure
+    r&.close
+    w&.close
+  end
+
+  def test_heap_dump_gzip
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not yet implement heap_dump"
+    end
+    require "zlib"
+    f = Tempfile.new("heap")
+    context = MiniRacer::Context.new
+    begin
+      context.write_heap_snapshot(f.path, gzip: true)
+    rescue NotImplementedError
+      skip "built without zlib"
+    end
+    dump = Zlib::GzipReader.open(f.path, &:read)
+    assert JSON.parse(dump).key?("snapshot")
+  ensure
+    f&.close!
+  end
+
   def test_pipe_leak
     # in Ruby 2.7 pipes will stay open for longer
     # make sure that we clean up early so pipe file
@@ -1565,6 +2053,31 @@ class MiniRacerTest < Minitest::Test
     assert_equal expected, context.eval(script)
   end
 
+  def test_function_property_with_snapshot
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not have snapshots"
+    end
+    # values that can't be serialized go through a filter that lives in
+    # the snapshot, or gets created on first use when there is none;
+    # either way it recognizes the Map and Set the context started with
+    expected = { "m" => { 1 => 2 }, "s" => [3], "x" => 42 }
+    script = <<~JS
+      Map = Set = function() {};
+      ({ f: () => {}, m: new M([[1,2]]), s: new S([3]), x: 42 })
+    JS
+    snapshot = MiniRacer::Snapshot.new("var M = Map, S = Set")
+    context = MiniRacer::Context.new(snapshot: snapshot)
+    assert_equal expected, context.eval(script)
+    context.reset!
+    assert_equal expected, context.eval(script)
+    snapshot.warmup!("new Map([[1,2]])")
+    context = MiniRacer::Context.new(snapshot: snapshot)
+    assert_equal expected, context.eval(script)
+    context = MiniRacer::Context.new
+    context.eval("var M = Map, S = Set")
+    assert_equal expected, context.eval(script)
+  end
+
   def test_dates_from_active_support
     require "active_support"
     require "active_support/time"
@@ -1594,6 +2107,45 @@ class MiniRacerTest < Minitest::Test
     end
   end
 
+  def test_string_arguments
+    context = MiniRacer::Context.new
+    context.eval("function f(s) { return [s.length, s.codePointAt(s.length-1), s] }")
+    # sent as one-byte, two-byte and utf8 strings respectively
+    [
+      ["abc", 3, 99],
+      ["a" * 40 + "é", 41, 0xe9],
+      ["ÿ\u0080", 2, 0x80],
+      [:"ключ", 4, 0x447],
+      ["日本語", 3, 0x8a9e],
+      ["a" * 40 + "Ā", 41, 0x100],
+      ["日本語😀", 5, 0xde00],
+      ["é".encode("ISO-8859-1"), 1, 0xe9],
+      ["abc".b, 3, 99]
+    ].each do |s, n, c|
+      assert_equal [n, c, s.to_s.encode("UTF-8")], context.call("f", s)
+    end
+  end
+
+  def test_long_string_transcoding
+    context = MiniRacer::Context.new
+    # one-byte (latin1) and two-byte (utf16) strings with ascii runs
+    # longer and shorter than a vector, and every utf-8 sequence length
+    [
+      "a" * 100,
+      "a" * 37 + "é" + "b" * 17 + "ÿ\u0080",
+      "é" * 100,
+      "a" * 37 + "Ā" + "b" * 17,
+      "\u07ff\u0800\uffff\ud7ff\ue000😀" * 20,
+      "x" * 1000 + "日本語" + "y" * 5
+    ].each do |s|
+      r = context.eval("'#{s}'")
+      assert_equal Encoding::UTF_8, r.encoding
+      assert_equal s, r
+      assert r.valid_encoding?
+      assert_equal s.ascii_only?, r.ascii_only?
+    end
+  end
+
   def test_object_ref
     context = MiniRacer::Context.new
     context.eval("function f(o) { return o }")
@@ -1603,6 +2155,77 @@ class MiniRacerTest < Minitest::Test
     assert_equal actual, expected
   end
 
+  def test_hash_with_arbitrary_keys
+    context = MiniRacer::Context.new
+    context.eval("function f(o) { return o instanceof Map ? o : null }")
+    context.eval("function get(m, k) { return m.get(k) }")
+    h = { [1, 2] => "pair", nil => "nil", 1.5 => "float", "s" => "string" }
+    assert_equal h, context.call("f", h)
+    assert_equal "float", context.call("get", h, 1.5)
+    assert_nil context.call("f", { "a" => 1, :b => 2, 3 => 4 })
+  end
+
+  def test_hash_as_map_keeps_refs
+    context = MiniRacer::Context.new
+    context.eval("function f(o) { return o }")
+    shared = { "x" => 42 }
+    # the non-string key comes last so the hash is serialized twice
+    h = { "a" => shared, "b" => [shared], [0] => shared }
+    actual = context.call("f", [h, shared])
+    assert_equal [h, shared], actual
+    skip "TruffleRuby copies objects" if RUBY_ENGINE == "truffleruby"
+    assert_same actual[0]["a"], actual[1]
+    assert_same actual[0]["b"][0], actual[1]
+  end
+
+  def test_object_keys_are_deduplicated
+    context = MiniRacer::Context.new
+    a = context.eval("[{id: 1, 'naïve': 1}, {id: 2, 'naïve': 2}]")
+    assert_equal [{ "id" => 1, "naïve" => 1 }, { "id" => 2, "naïve" => 2 }], a
+    assert a[0].keys.all?(&:frozen?)
+    assert_equal Encoding::UTF_8, a[0].keys[1].encoding
+    skip "TruffleRuby copies keys" if RUBY_ENGINE == "truffleruby"
+    assert_same a[0].keys[0], a[1].keys[0]
+    assert_same a[0].keys[1], a[1].keys[1]
+  end
+
+  def test_symbolize_keys
+    context = MiniRacer::Context.new(symbolize_keys: true)
+    assert_equal(
+      { a: 1, "b c": { d: [{ e: 2 }] }, "1": 3 },
+      context.eval("({a: 1, 'b c': {d: [{e: 2}]}, 1: 3})")
+    )
+    # Map keys are values and stay as they are
+    assert_equal({ "x" => 1 }, context.eval("new Map([['x', 1]])"))
+    result = context.eval("({y: 1})")
+    assert_equal({ y: 1 }, result)
+    assert_equal Symbol, result.keys.first.class
+    # so are the arguments of ruby callbacks
+    context.attach("key_class", ->(h) { h.keys.first.class.name })
+    assert_equal "Symbol", context.eval("key_class({y: 1})")
+    e =
+      assert_raises(MiniRacer::RuntimeError) do
+        context.eval("throw new Error('boom')")
+      end
+    assert_match(/boom/, e.message)
+    assert context.heap_stats.key?(:used_heap_size)
+  end
+
+  def test_track_refs_false
+    context = MiniRacer::Context.new(track_refs: false)
+    context.eval("function f(o) { return o }")
+    shared = { "x" => 42 }
+    actual = context.call("f", [shared, shared])
+    assert_equal [shared, shared], actual
+    refute_same actual[0], actual[1]
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not detect cycles"
+    end
+    cyclic = []
+    cyclic << cyclic
+    assert_raises(MiniRacer::RuntimeError) { context.call("f", cyclic) }
+  end
+
   def test_termination_exception
     context = MiniRacer::Context.new
     a = Thread.new { context.stop while true }
@@ -1790,6 +2413,43 @@ class MiniRacerTest < Minitest::Test
     assert_equal true, result
   end
 
+  def test_typed_array_is_converted_to_typed_array
+    context = MiniRacer::Context.new
+    a = context.eval("new Float64Array([1.5, -2.5, 1e300])")
+    assert_kind_of MiniRacer::TypedArray, a
+    assert_equal :float64, a.type
+    assert_equal 3, a.length
+    assert_equal [1.5, -2.5, 1e300], a.to_a
+    a = context.eval("new Int16Array(new Int16Array([1, -2, 3, -4]).buffer, 2, 2)")
+    assert_equal [:int16, 2, 2, 8], [a.type, a.byte_offset, a.length, a.buffer.bytesize]
+    assert_equal [-2, 3], a.to_a
+    assert_equal [-1, 0], context.eval("new BigInt64Array([-1n, 0n])").to_a
+    assert_equal [2**64 - 1], context.eval("new BigUint64Array([-1n])").to_a
+    # views on part of a buffer only return that part
+    assert_equal "\x02\x03".b,
+                 context.eval("new Uint8Array(new Uint8Array([1, 2, 3, 4]).buffer, 1, 2)")
+  end
+
+  def test_typed_array_argument
+    context = MiniRacer::Context.new
+    context.eval(<<~JS)
+      function describe(a) {
+        return [a.constructor.name, a.byteOffset, a.length, Array.from(a)]
+      }
+      function same(a, b) { return a === b && a.buffer === b.buffer }
+    JS
+    a = MiniRacer::TypedArray.pack(:float32, [0.5, -1, 2])
+    assert_equal ["Float32Array", 0, 3, [0.5, -1, 2]], context.call("describe", a)
+    b = MiniRacer::TypedArray.new(:uint16, a.buffer, byte_offset: 4, length: 2)
+    assert_equal ["Uint16Array", 4, 2, [0, 49024]], context.call("describe", b)
+    assert_equal true, context.call("same", a, a)
+    context.eval("function id(a) { return a }")
+    assert_equal a, context.call("id", a)
+    assert_raises(RangeError) do
+      MiniRacer::TypedArray.new(:int32, "abcdef", byte_offset: 1)
+    end
+  end
+
   def test_exception_message_encoding
     e = nil
     begin
@@ -1800,4 +2460,66 @@ class MiniRacerTest < Minitest::Test
     assert e
     assert_equal(e.message.encoding.to_s, "UTF-8")
   end
+
+  def test_reset
+    snapshot = MiniRacer::Snapshot.new("var answer = 42")
+    context = MiniRacer::Context.new(snapshot: snapshot)
+    context.eval("var x = 1; answer = 0")
+    context.reset!
+    assert_equal "undefined", context.eval("typeof x")
+    assert_equal 42, context.eval("answer")
+    context.eval("var x = 2")
+    assert_equal 2, context.eval("x")
+  end
+
+  def test_reset_drops_callbacks_and_handles
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not have native function handles"
+    end
+    context = MiniRacer::Context.new
+    context.attach("echo", ->(x) { x })
+    context.eval("function f() { return 1 }")
+    f = context.function("f")
+    context.reset!
+    assert_equal "undefined", context.eval("typeof echo")
+    assert_raises(MiniRacer::RuntimeError) { f.call }
+    context.attach("echo", ->(x) { x * 2 })
+    assert_equal 4, context.eval("echo(2)")
+  end
+
+  def test_reset_stale_callback_throws
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby does not have a message loop"
+    end
+    context = MiniRacer::Context.new
+    seen = []
+    context.attach("note", ->(s) { seen << s })
+    context.eval(<<~JS)
+      const i32 = new Int32Array(new SharedArrayBuffer(4));
+      Atomics.waitAsync(i32, 0, 0, 20).value.then(() => note("stale"));
+    JS
+    context.reset!
+    # same callback id as the stale function
+    context.attach("other", ->(s) { seen << "other: #{s}" })
+    sleep 0.05
+    context.pump_message_loop
+    assert_empty seen
+  end
+
+  def test_reset_from_callback
+    if RUBY_ENGINE == "truffleruby"
+      skip "TruffleRuby allows resetting from a callback"
+    end
+    context = MiniRacer::Context.new
+    context.attach("reset", -> { context.reset! })
+    assert_raises(MiniRacer::RuntimeError) { context.eval("reset()") }
+    assert_equal 2, context.eval("1+1")
+  end
+
+  def test_reset_ring_transport
+    context = MiniRacer::Context.new(transport: :ring)
+    context.eval("var x = 1")
+    context.reset!
+    assert_equal "undefined", context.eval("typeof x")
+  end
 end